@@ -1,7 +1,11 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <arpa/inet.h>
+#include <math.h>
 #include "abtop.h"
+#include "topk.h"
 
 /*
  * keep a backward looking event record of x id's associated with
@@ -12,118 +16,506 @@
  * ba) often enough that the ab (canonicalized) entry does not fall out of the
  * hash table.  
  *
- * In other words, ab or ba must occur among the last N distinct events
- * where N is the cache_sz or it gets ejected from the cache even though
- * the ab/ba count may be larger than others that remain in the cache.
+ * In other words, ab or ba must occur about as often as every N distinct
+ * events where N is the cache_sz or it gets ejected from the cache even
+ * though the ab/ba count may be larger than others that remain in the cache.
+ *
+ * ids are fixed size binary keys (ab_key_t), stored inline in a flat
+ * open addressing table of at least twice cache_sz slots. no strings are
+ * made on the packet path; a key is formatted only when it is shown.
+ *
+ * replacement is CLOCK, an approximation of LRU. a hit sets the entry's
+ * ref bit, in the cache line its key was just compared in, and that is
+ * all; there is no recency list to relink. the work is done on a miss in
+ * a full cache: the hand sweeps on from where it stopped, clearing ref
+ * bits, and evicts the first entry not hit since the hand last passed it.
+ * a new entry starts with no ref bit, so pairs seen only once (a scan)
+ * go first, and a pair hit again before the hand comes round stays.
+ *
+ * ipv6 pairs share the table. their keys carry the addresses folded to
+ * 32 bits, which is what is hashed; the full addresses sit in t->a6, a
+ * parallel array made on the first ipv6 hit, and are compared only when
+ * the folded key already matches. an ipv4 probe never looks at them.
  *
  */
 
-static void ab_init(ab_t *ab) { utstring_init(&ab->id); }
-static void ab_fini(ab_t *ab) { utstring_done(&ab->id); }
+// one entry per cache line
+static ab_t *slots_new(uint32_t n) {
+  void *p;
+  if (posix_memalign(&p, 64, n * sizeof(ab_t))) return NULL;
+  memset(p, 0, n * sizeof(ab_t));
+  return p;
+}
 
-abtop_t *abtop_new(int cache_sz, int top_sz) {
-  int i;
+abtop_t *abtop_new(int cache_sz, int top_sz, double tau, int by_rate) {
   abtop_t *t = calloc(1,sizeof(abtop_t));
   if (!t) return NULL;
-  t->cache = malloc(cache_sz * sizeof(ab_t));
-  if (!t->cache) {free(t); return NULL;}
   t->cache_sz = cache_sz;
   t->top_sz = top_sz;
-  t->avail = t->cache;
-  t->navail = t->cache_sz;
-  for(i=0; i<t->cache_sz; i++) ab_init(&t->cache[i]);
-  utarray_init(&t->top,&ut_ptr_icd);
+  t->tau = tau;
+  t->by_rate = by_rate;
+  for(t->mask = 1; t->mask < 2 * (uint32_t)cache_sz; t->mask <<= 1) ; // load <= 1/2
+  t->slots = slots_new(t->mask);
+  t->mask--;
+  t->top = malloc(top_sz * sizeof(ab_t*));
+  t->view = malloc(top_sz * sizeof(ab_top_t));
+  if (!t->slots || !t->top || !t->view) {abtop_free(t); return NULL;}
   return t;
 }
 
-// sort id's by count. if count is equal sort old-to-new
-static int topsort_low_to_high(const void *_a, const void *_b) { 
-  ab_t **a = (ab_t**)_a;
-  ab_t **b = (ab_t**)_b;
-  int c = ((*a)->count - (*b)->count);
-  if (c) return c;
-  return (*a)->last - (*b)->last;
+_Static_assert(sizeof(ab_key_t) == 16, "ab_key_t is hashed as two words");
+
+static uint64_t key_hash64(const ab_key_t *k) {
+  uint64_t w[2], h;
+  memcpy(w, k, sizeof(w));
+  h = (w[0] * 0x9e3779b97f4a7c15ULL) ^ (w[1] * 0xc2b2ae3d27d4eb4fULL);
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 29;
+  return h;
+}
+
+static uint32_t key_hash(const ab_key_t *k) { return (uint32_t)key_hash64(k); }
+
+// an ipv6 address as the 32 bit word its key carries; collisions only
+// cost a longer probe, since the full address is compared as well
+uint32_t abtop_fold6(const uint8_t *addr) {
+  uint64_t w[2], h;
+  memcpy(w, addr, sizeof(w));
+  h = (w[0] * 0x9e3779b97f4a7c15ULL) ^ (w[1] * 0xc2b2ae3d27d4eb4fULL);
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+// a slot whose key matches holds ipv6 addresses a6 too, if given
+static inline int same_a6(abtop_t *t, uint32_t i, const ab_addr6_t *a6) {
+  return (a6 == NULL) || (memcmp(&t->a6[i], a6, sizeof(*a6)) == 0);
+}
+
+// an entry moved slots (see topk.h); its window ring and addresses go too
+static inline void moved(abtop_t *t, uint32_t from, uint32_t to) {
+  if (t->win) t->win[to] = t->win[from];
+  if (t->a6 && (t->slots[to].key.flags & AB_KEY_V6)) t->a6[to] = t->a6[from];
+}
+
+// ab_find, ab_victim (CLOCK) and ab_del (backward shift)
+TOPK_TABLE(ab, abtop_t, ab_t, ab_key_t, ab_addr6_t, key_hash, same_a6, moved)
+
+/*
+ * rates are exponentially weighted with time constant tau. rather than
+ * decaying every entry each second, a hit adds its bits scaled by
+ * g = e^((now - landmark)/tau); an entry's score is then its decayed bit
+ * sum in units of the landmark. all scores decay alike, so comparing
+ * them ranks by current rate exactly, and the heap stays valid without
+ * touching idle entries. the rate is score * e^(-(now - landmark)/tau)
+ * / tau. the landmark moves forward (rescaling every score, which keeps
+ * their order) long before g can overflow.
+ */
+#define RESCALE_TAUS 500
+
+static void rate_clock(abtop_t *t, time_t now) {
+  uint32_t i;
+  double f;
+  if (now == t->gnow) return;
+  if (t->landmark == 0) t->landmark = now;
+  if ((now - t->landmark) > RESCALE_TAUS * t->tau) {
+    f = exp(-(now - t->landmark) / t->tau);
+    for(i=0; i <= t->mask; i++) t->slots[i].score *= f;
+    for(i=0; i < t->cm_w * t->cm_d; i++) t->cm[i] *= f;
+    t->cm_mass *= f;
+    t->landmark = now;
+  }
+  t->gnow = now;
+  t->g = exp((now - t->landmark) / t->tau);
+}
+
+double abtop_rate(abtop_t *t, ab_t *u, time_t now) {
+  return u->score * exp(-(now - t->landmark) / t->tau) / t->tau;
+}
+
+/* the value that ranks an entry: total bytes, or rate */
+static inline double rank(abtop_t *t, ab_t *u) {
+  return t->by_rate ? u->score : (double)u->count;
+}
+
+
+/*
+ * the top list is a binary min-heap of up to top_sz entries, in the same
+ * order as the display (by rank, then old-to-new), so the root is the one
+ * to displace next.
+ * each ab_t keeps its heap slot in top_idx (-1 if not in the list); a hit
+ * on a listed entry is a sift-down from that slot, never a search or sort.
+ */
+static inline int top_lt(abtop_t *t, ab_t *a, ab_t *b) {
+  double ra = rank(t,a), rb = rank(t,b);
+  if (ra != rb) return ra < rb;
+  return a->last < b->last;
+}
+
+// ab_top_update, ab_top_remove
+TOPK_HEAP(ab, abtop_t, ab_t, top_lt)
+
+/*
+ * sliding windows. each entry gets a ring of ten 1s buckets and one of
+ * thirty 10s buckets, kept in t->win alongside the slots. a hit adds to
+ * the current bucket of each ring, first zeroing any buckets the entry
+ * skipped since its last hit (at most the ring length, so constant).
+ * the sums over 10s, 1m and 5m are worked out only when displayed; the
+ * longer two are to within one 10s bucket.
+ */
+const int abtop_win_secs[AB_NWIN] = {10, 60, 300};
+const char *abtop_win_label[AB_NWIN] = {"10s", "1m", "5m"};
+
+int abtop_windows(abtop_t *t) {
+  t->win = calloc(t->mask + 1, sizeof(ab_win_t));
+  return t->win ? 0 : -1;
+}
+
+static void win_add(ab_win_t *w, time_t now, unsigned long bytes) {
+  time_t s;
+  if (now > w->t1) {
+    for(s = now; (s > w->t1) && (s > now - AB_RING1); s--) w->s1[s % AB_RING1] = 0;
+    w->t1 = now;
+  }
+  if (now / 10 > w->t10) {
+    for(s = now / 10; (s > w->t10) && (s > now / 10 - AB_RING10); s--) w->s10[s % AB_RING10] = 0;
+    w->t10 = now / 10;
+  }
+  w->s1[now % AB_RING1] += bytes;
+  w->s10[(now / 10) % AB_RING10] += bytes;
+}
+
+// bytes in the window of secs seconds ending now
+static unsigned long win_sum(const ab_win_t *w, time_t now, int secs) {
+  unsigned long sum = 0;
+  time_t s;
+  if (secs <= AB_RING1) {
+    for(s = w->t1; (s > w->t1 - AB_RING1) && (s > now - secs); s--) sum += w->s1[s % AB_RING1];
+  } else {
+    for(s = w->t10; (s > w->t10 - AB_RING10) && (s > (now / 10) - (secs / 10)); s--)
+      sum += w->s10[s % AB_RING10];
+  }
+  return sum;
+}
+
+static void wtop_down(ab_top_t *h, int n, int i) {
+  ab_top_t x = h[i];
+  int c;
+  while ((c = 2*i + 1) < n) {
+    if ((c + 1 < n) && (h[c+1].count < h[c].count)) c++;
+    if (h[c].count >= x.count) break;
+    h[i] = h[c];
+    i = c;
+  }
+  h[i] = x;
+}
+
+/* copy out the top_sz entries by bytes in window w (an index into
+ * abtop_win_secs), unsorted. a scan of the whole table, with a heap of
+ * top_sz to select; this is display work, not per packet. */
+int abtop_top_win(abtop_t *t, time_t now, int w, ab_top_t *out) {
+  int secs = abtop_win_secs[w], n = 0, i;
+  unsigned long sum;
+  uint32_t j;
+
+  if (t->win == NULL) return 0;
+  for(j=0; j <= t->mask; j++) {
+    if (!t->slots[j].used) continue;
+    sum = win_sum(&t->win[j], now, secs);
+    if (sum == 0) continue;
+    if ((n == t->top_sz) && (sum <= out[0].count)) continue;
+    if (n == t->top_sz) i = 0;
+    else i = n++;
+    memset(&out[i], 0, sizeof(out[i]));
+    out[i].key = t->slots[j].key;
+    if (t->slots[j].key.flags & AB_KEY_V6) out[i].a6 = t->a6[j];
+    out[i].count = sum;
+    out[i].last = t->slots[j].last;
+    out[i].rate = sum * 8.0 / secs;
+    if (n == t->top_sz) {
+      if (i) for(i = n/2 - 1; i >= 0; i--) wtop_down(out, n, i); // just filled
+      else wtop_down(out, n, 0);
+    }
+  }
+  return n;
 }
 
-static int is_top(abtop_t *t, ab_t *u) {
-  size_t l = utarray_len(&t->top);
-  if (l < t->top_sz) return 1;
-  ab_t **f = (ab_t**)utarray_front(&t->top);
-  if (u->count >= (*f)->count) return 1;
-  return 0;
+/*
+ * sketch mode. the cache above loses a heavy pair whenever more than
+ * cache_sz other pairs pass between its packets, which a scan or flood
+ * easily does. in sketch mode every packet is counted into a count-min
+ * sketch (cm_d rows of cm_w counters) with conservative update: only the
+ * counters at the current minimum are raised. the table holds just the
+ * top_sz candidates; a pair whose estimate passes the heap root takes its
+ * place. memory is fixed whatever the number of pairs, and an estimate
+ * exceeds the truth by at most e/cm_w of the total with probability
+ * 1 - e^-cm_d (98% with 4 rows).
+ *
+ * the sketch counts whatever ranks entries: bytes, or decayed bits.
+ */
+int abtop_sketch(abtop_t *t, int width, int depth) {
+  if ((depth < 1) || (depth > CM_MAX_DEPTH)) return -1;
+  for(t->cm_w = 1; t->cm_w < (uint32_t)width; t->cm_w <<= 1) ;
+  t->cm_d = depth;
+  t->cm = calloc(t->cm_w * t->cm_d, sizeof(double));
+  if (t->cm == NULL) return -1;
+
+  /* the table need only hold the candidates */
+  free(t->slots);
+  t->cache_sz = t->top_sz;
+  for(t->mask = 1; t->mask < 2 * (uint32_t)t->cache_sz; t->mask <<= 1) ;
+  t->slots = slots_new(t->mask);
+  t->mask--;
+  return t->slots ? 0 : -1;
 }
 
-static ab_t **lfind_in_top(abtop_t *t, ab_t *u) {
-  ab_t **up=NULL;
-  while( (up=(ab_t**)utarray_next(&t->top,up))) {
-    if (u == *up) return up;
+// add v to key's counters, conservatively; returns the new estimate
+static double cm_add(abtop_t *t, const ab_key_t *key, double v) {
+  uint64_t h = key_hash64(key);
+  uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1, r;
+  double *c[CM_MAX_DEPTH], est;
+
+  c[0] = &t->cm[h1 & (t->cm_w - 1)];
+  est = *c[0];
+  for(r=1; r < t->cm_d; r++) { // row r uses h1 + r*h2 (double hashing)
+    c[r] = &t->cm[r * t->cm_w + ((h1 + r * h2) & (t->cm_w - 1))];
+    if (*c[r] < est) est = *c[r];
   }
-  return NULL;
+  est += v;
+  for(r=0; r < t->cm_d; r++) if (*c[r] < est) *c[r] = est;
+  t->cm_mass += v;
+  return est;
 }
 
-void abtop_hit(abtop_t *t, char *id, time_t when, unsigned long ab, unsigned long ba) {
+static void sketch_hit(abtop_t *t, const ab_key_t *key, const ab_addr6_t *a6,
+                       time_t when, unsigned long ab, unsigned long ba) {
+  double v, est;
+  uint32_t o, i;
+  int found;
   ab_t *u;
-  HASH_FIND(hh, t->head, id, strlen(id), u);
-  if (!u) {
-    // delete oldest one if at max 
-    if (HASH_COUNT(t->head) == t->cache_sz) {
-      ab_t *oldest = t->head;
-      HASH_DELETE(hh, t->head, oldest);
-      t->avail = oldest;
-      t->navail=1;
-      if (is_top(t,oldest)) { // if it was in top list, clear record
-        ab_t **p = lfind_in_top(t,oldest);
-        if (p) utarray_erase(&t->top,utarray_eltidx(&t->top,p),1);
-      }
+
+  rate_clock(t, when);
+  v = t->by_rate ? (ab + ba) * 8 * t->g : (double)(ab + ba);
+  est = cm_add(t, key, v);
+
+  i = ab_find(t, key, a6, &found);
+  if (!found) {
+    if (t->ntop == t->top_sz) {
+      u = t->top[0];
+      if (est <= (t->by_rate ? u->score : (double)u->count)) return;
+      o = u - t->slots; // displace the weakest candidate
+      ab_top_remove(t,u);
+      ab_del(t,o);
+      t->count--;
+      i = ab_find(t, key, a6, &found);
     }
-    // claim first free slot
-    u = t->avail; assert(u);
-    t->avail = (--t->navail) ? (t->avail+1) : NULL;
-    utstring_clear(&u->id);
-    utstring_bincpy(&u->id, id, strlen(id));
-    u->count=0;
-    u->ab=0;
-    u->ba=0;
-    u->last=0;
+    u = &t->slots[i];
+    memset(u,0,sizeof(*u));
+    u->key = *key;
+    u->used = 1;
+    u->top_idx = -1;
+    t->count++;
+    if (a6) t->a6[i] = *a6;
+    if (t->win) memset(&t->win[i], 0, sizeof(ab_win_t));
+  } else u = &t->slots[i];
+  if (t->win) win_add(&t->win[i], when, ab + ba);
+
+  /* the ranking value comes from the sketch; the rest counts from admission */
+  u->ab += ab;
+  u->ba += ba;
+  if (t->by_rate) {
+    u->score = est;
+    u->count += (ab + ba);
   } else {
-    HASH_DELETE(hh, t->head, u); // before promoting to newest 
+    u->count = (unsigned long)est;
+    u->score += (ab + ba) * 8 * t->g;
   }
-  char *id_ptr = utstring_body(&u->id);
-  int id_len = utstring_len(&u->id);
-  HASH_ADD_KEYPTR(hh, t->head, id_ptr, id_len, u); //newest
+  if (when > u->last) u->last=when;
+  ab_top_update(t,u);
+}
+
+// overestimate bound for any pair, in display units (bytes or bit/s)
+double abtop_error(abtop_t *t, time_t now) {
+  double e;
+  if (t->cm == NULL) return 0;
+  e = M_E / t->cm_w * t->cm_mass;
+  return t->by_rate ? e * exp(-(now - t->landmark) / t->tau) / t->tau : e;
+}
+
+void abtop_hit(abtop_t *t, const ab_key_t *key, const ab_addr6_t *a6,
+               time_t when, unsigned long ab, unsigned long ba) {
+  int found;
+  uint32_t o, i;
+  ab_t *u;
+  if (a6 && (t->a6 == NULL) &&
+      ((t->a6 = calloc(t->mask + 1, sizeof(ab_addr6_t))) == NULL)) return;
+  if (t->cm) { sketch_hit(t, key, a6, when, ab, ba); return; }
+  i = ab_find(t, key, a6, &found);
+  if (!found) {
+    // evict one if at max 
+    if (t->count == t->cache_sz) {
+      o = ab_victim(t);
+      if (t->slots[o].top_idx >= 0) ab_top_remove(t,&t->slots[o]); // drop from top list
+      ab_del(t,o);
+      t->count--;
+      i = ab_find(t, key, a6, &found); // the delete may have shifted our slot
+    }
+    u = &t->slots[i];
+    memset(u,0,sizeof(*u));
+    u->key = *key;
+    u->used = 1;
+    u->top_idx = -1;
+    t->count++;
+    if (a6) t->a6[i] = *a6;
+    if (t->win) memset(&t->win[i], 0, sizeof(ab_win_t));
+  } else {
+    u = &t->slots[i];
+    u->ref = 1;
+  }
+  if (t->win) win_add(&t->win[i], when, ab + ba);
   u->count += (ab + ba);
   u->ab += ab;
   u->ba += ba;
   if (when > u->last) u->last=when;
-  if (is_top(t,u)) { // maintain top list
-    if (!lfind_in_top(t,u)) utarray_push_back(&t->top,&u);
-    utarray_sort(&t->top,topsort_low_to_high);
-    if (utarray_len(&t->top) > t->top_sz) utarray_erase(&t->top,0,1);
+  rate_clock(t, when);
+  u->score += (ab + ba) * 8 * t->g;
+  ab_top_update(t,u);
+}
+
+// text form of a key, only ever made for display. an ipv6 address is
+// bracketed when a port follows it
+#define KEY_STRLEN (2 * (INET6_ADDRSTRLEN + 8) + 20)
+static char *key_str(const ab_key_t *k, const ab_addr6_t *a6, char *buf, size_t len) {
+  char a[INET6_ADDRSTRLEN], b[INET6_ADDRSTRLEN], vlan[12] = "";
+  const char *fmt = (k->flags & AB_KEY_V6) ? "[%s]:%u->[%s]:%u/%u%s" : "%s:%u->%s:%u/%u%s";
+  if (k->flags & AB_KEY_V6) {
+    inet_ntop(AF_INET6, a6->a, a, sizeof(a));
+    inet_ntop(AF_INET6, a6->b, b, sizeof(b));
+  } else {
+    inet_ntop(AF_INET, &k->a, a, sizeof(a));
+    inet_ntop(AF_INET, &k->b, b, sizeof(b));
   }
+  if (k->vid) snprintf(vlan, sizeof(vlan), " vlan %u", k->vid);
+  if (k->proto == 0) snprintf(buf, len, "%s->%s%s", a, b, vlan);
+  else snprintf(buf, len, fmt, a, ntohs(k->a_port), b, ntohs(k->b_port), k->proto, vlan);
+  return buf;
 }
 
 void show_abtop(abtop_t *t) {
-  ab_t *u, *tmp;
-  HASH_ITER(hh, t->head, u, tmp) {
-    printf(" %s: %lu\n",  utstring_body(&u->id), u->count);
+  char buf[KEY_STRLEN];
+  uint32_t i;
+  for(i = 0; i <= t->mask; i++) {
+    if (!t->slots[i].used) continue;
+    printf(" %s: %lu\n",  key_str(&t->slots[i].key, t->a6 ? &t->a6[i] : NULL,
+           buf, sizeof(buf)), t->slots[i].count);
   }
   printf("\n");
 }
 
-void show_abtop_top(abtop_t *t) {
-  ab_t **up=NULL,*u;
-  while( (up=(ab_t**)utarray_next(&t->top,up))) {
-    u = *up;
-    printf(" top> %s: %lu\n",  utstring_body(&u->id), u->count);
+static char *bps_str(double bps, char *buf, size_t len) {
+  if (bps >= 1e9) snprintf(buf, len, "%.1f Gbit/s", bps / 1e9);
+  else if (bps >= 1e6) snprintf(buf, len, "%.1f Mbit/s", bps / 1e6);
+  else if (bps >= 1e3) snprintf(buf, len, "%.1f kbit/s", bps / 1e3);
+  else snprintf(buf, len, "%.0f bit/s", bps);
+  return buf;
+}
+
+// copy out the top list, unsorted, with rates as of now. returns count
+int abtop_top(abtop_t *t, time_t now, ab_top_t *out) {
+  ab_t *u;
+  int i;
+  for(i=0; i < t->ntop; i++) {
+    u = t->top[i];
+    out[i].key = u->key;
+    if (u->key.flags & AB_KEY_V6) out[i].a6 = t->a6[u - t->slots];
+    out[i].ab = u->ab;
+    out[i].ba = u->ba;
+    out[i].count = u->count;
+    out[i].last = u->last;
+    out[i].rate = abtop_rate(t,u,now);
+  }
+  return t->ntop;
+}
+
+static int sort_by_rate; // qsort has no context argument
+
+static int topsort_by_key(const void *_a, const void *_b) {
+  const ab_top_t *a = _a, *b = _b;
+  int c = memcmp(&a->key, &b->key, sizeof(ab_key_t));
+  if (c || !(a->key.flags & AB_KEY_V6)) return c;
+  return memcmp(&a->a6, &b->a6, sizeof(ab_addr6_t));
+}
+
+// sort by rank. if rank is equal sort old-to-new
+static int topsort_low_to_high(const void *_a, const void *_b) { 
+  const ab_top_t *a = _a, *b = _b;
+  double ra = sort_by_rate ? a->rate : a->count;
+  double rb = sort_by_rate ? b->rate : b->count;
+  if (ra != rb) return (ra < rb) ? -1 : 1;
+  return (a->last < b->last) ? -1 : (a->last > b->last);
+}
+
+/* sum the entries for the same key among n top entries, which may come
+ * from several abtop shards, and sort them lowest rank first. returns the
+ * number left. */
+int abtop_merge(ab_top_t *top, int n, int by_rate) {
+  int i, m;
+  if (n > 1) {
+    qsort(top, n, sizeof(*top), topsort_by_key);
+    for(m=0, i=1; i < n; i++) {
+      if (topsort_by_key(&top[i], &top[m])) { top[++m] = top[i]; continue; }
+      top[m].ab += top[i].ab;
+      top[m].ba += top[i].ba;
+      top[m].count += top[i].count;
+      top[m].rate += top[i].rate;
+      if (top[i].last > top[m].last) top[m].last = top[i].last;
+    }
+    n = m + 1;
+  }
+  sort_by_rate = by_rate;
+  qsort(top, n, sizeof(*top), topsort_low_to_high);
+  return n;
+}
+
+/* print the k highest ranked of n top entries, merged as above. reorders
+ * top. a window's list is given its label, and has no ab/ba split. */
+void abtop_show(ab_top_t *top, int n, int k, int by_rate, const char *label) {
+  char buf[KEY_STRLEN], bps[20];
+  int i;
+  n = abtop_merge(top, n, by_rate);
+  for(i = (n > k) ? (n - k) : 0; i < n; i++) {
+    key_str(&top[i].key, &top[i].a6, buf, sizeof(buf));
+    bps_str(top[i].rate, bps, sizeof(bps));
+    if (label) printf(" %s> %s: %lu %s\n", label, buf, top[i].count, bps);
+    else printf(" top> %s: %lu (ab %lu ba %lu) %s\n", buf, top[i].count,
+                top[i].ab, top[i].ba, bps);
   }
   printf("\n");
 }
 
+void abtop_show_error(double err, int by_rate) {
+  char buf[20];
+  if (by_rate) bps_str(err, buf, sizeof(buf));
+  else snprintf(buf, sizeof(buf), "%.0f", err);
+  printf(" (sketch: counts may be high by up to %s, 98%% confidence)\n\n", buf);
+}
+
+// sorts a copy of the heap; the hot path never pays for ordering
+void show_abtop_top(abtop_t *t, time_t now) {
+  int n = abtop_top(t, now, t->view), w;
+  abtop_show(t->view, n, t->top_sz, t->by_rate, NULL);
+  if (t->cm) abtop_show_error(abtop_error(t, now), t->by_rate);
+  for(w=0; t->win && (w < AB_NWIN); w++) {
+    n = abtop_top_win(t, now, w, t->view);
+    abtop_show(t->view, n, t->top_sz, 0, abtop_win_label[w]);
+  }
+}
+
 void abtop_free(abtop_t *t) {
-  int i;
-  HASH_CLEAR(hh,t->head);
-  for(i=0; i<t->cache_sz; i++) ab_fini(&t->cache[i]);
-  free(t->cache);
-  utarray_done(&t->top);
+  free(t->a6);
+  free(t->win);
+  free(t->cm);
+  free(t->slots);
+  free(t->top);
+  free(t->view);
   free(t);
 }
@@ -0,0 +1,322 @@
+/*
+ * Benchmark iptop's capture backends against each other
+ *
+ *   pcap - pcap_create and pcap_dispatch, iptop's default
+ *   ring - iptop -R, its own TPACKET_V3 ring walked block by block
+ *
+ * Both feed the same decode and abtop accounting (ip.c, abtop.c, keyed on
+ * ports as with iptop -p) and get the same amount of buffer: the ring's
+ * blocks * block size, which is also given to pcap_set_buffer_size unless
+ * -B says otherwise. A forked generator sends UDP datagrams over loopback
+ * at a fixed offered load (0 = as fast as it can) to -a distinct 127/8
+ * addresses, so the accounting sees that many pairs. The receiver runs a
+ * single capture, as iptop without -n, and counts:
+ *
+ *  frames handed to the decode path, kernel drops, receiver CPU time
+ *  (getrusage) and from those the CPU cost per frame.
+ *
+ * On loopback each datagram is seen twice (outgoing, incoming). One CSV
+ * row per (backend, load) goes to stdout or -o <file>.
+ *
+ *  sudo ./capbench -l 100000,400000,0 -d 5 -o capbench.csv
+ *
+ */
+
+#define _GNU_SOURCE
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "iptop.h"
+
+#define BATCH 64 /* datagrams per sendmmsg */
+
+struct iptop_conf cfg = {
+  .snaplen = 65535,
+  .nthreads = 1,
+  .dev = "lo",
+  .cache_sz = 1000,
+  .top_sz = 10,
+  .tau = 10,
+  .ports = 1,
+  .ring_block_sz = 1 << 22,
+  .ring_block_nr = 16,
+  .ring_frame_sz = 1 << 11,
+};
+
+char *backend_names[] = {"pcap", "ring"};
+#define NUM_BACKENDS (sizeof(backend_names)/sizeof(*backend_names))
+
+struct {
+  char *out;
+  FILE *outf;
+  char *loads;
+  char *backends;
+  int duration;
+  uint16_t port;
+  int addrs;
+  int payload;
+  int sink_fd;
+} bench = {
+  .loads = "100000,400000,0",
+  .backends = "pcap,ring",
+  .duration = 5,
+  .port = 9999,
+  .addrs = 1024,
+  .payload = 64,
+  .sink_fd = -1,
+};
+
+void usage() {
+  fprintf(stderr,"usage: %s [-v] [options]\n"
+       " options: \n"
+       " -i <eth>             -interface name (default lo)\n"
+       " -l <pps,pps,...>     -offered loads in packets/sec, 0 = flat out\n"
+       " -m <backend,...>     -backends among pcap,ring\n"
+       " -d <seconds>         -duration of each run\n"
+       " -p <port>            -udp port for generated traffic\n"
+       " -a <addrs>           -distinct destinations (pairs) to send to\n"
+       " -s <bytes>           -udp payload size\n"
+       " -o <file.csv>        -report file (default stdout)\n"
+       " -B <cap-buf-sz>      -pcap buffer size (default: the ring size)\n"
+       " -b <num-blocks>      -packet ring num-blocks e.g. 16\n"
+       " -S <log2-block-size> -log2 packet ring block size, 12-30 (e.g. 22 = 4mb)\n"
+       " -Z <frame-size>      -max frame (packet + header) size (e.g. 2048)\n"
+       "\n", cfg.prog);
+  exit(-1);
+}
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* generator: runs in a child process, sends rate datagrams/sec for the
+ * duration and writes the number sent to fd */
+void generate(unsigned rate, int fd) {
+  struct sockaddr_in sin[BATCH];
+  struct mmsghdr msg[BATCH];
+  struct iovec iov;
+  struct timespec next;
+  uint64_t gap, end, sent = 0;
+  char *buf;
+  int s, i, n;
+
+  if ( (buf = calloc(1, bench.payload)) == NULL) _exit(-1);
+  s = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s == -1) {
+    fprintf(stderr,"socket: %s\n", strerror(errno));
+    _exit(-1);
+  }
+  iov.iov_base = buf;
+  iov.iov_len = bench.payload;
+  memset(msg, 0, sizeof(msg));
+  for(i=0; i < BATCH; i++) {
+    memset(&sin[i], 0, sizeof(sin[i]));
+    sin[i].sin_family = AF_INET;
+    sin[i].sin_port = htons(bench.port);
+    msg[i].msg_hdr.msg_name = &sin[i];
+    msg[i].msg_hdr.msg_namelen = sizeof(sin[i]);
+    msg[i].msg_hdr.msg_iov = &iov;
+    msg[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  gap = rate ? (1000000000ULL * BATCH / rate) : 0;
+  end = now_ns() + bench.duration * 1000000000ULL;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+
+  while (now_ns() < end) {
+    /* a batch at a time, at the batch's scheduled time */
+    if (gap) {
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+      next.tv_nsec += gap;
+      while (next.tv_nsec >= 1000000000) { next.tv_nsec -= 1000000000; next.tv_sec++; }
+    }
+    for(i=0; i < BATCH; i++) /* 127.0.0.1 to 127.1.x.y */
+      sin[i].sin_addr.s_addr = htonl(0x7f010000 + ((sent + i) % bench.addrs));
+    if ( (n = sendmmsg(s, msg, BATCH, 0)) > 0) sent += n;
+  }
+
+  if (write(fd, &sent, sizeof(sent)) != sizeof(sent)) _exit(-1);
+  close(s);
+  _exit(0);
+}
+
+void report_header(void) {
+  fprintf(bench.outf, "backend,offered_pps,duration_s,buffer_bytes,sent,"
+    "frames,kernel_drops,drop_pct,cpu_user_s,cpu_sys_s,cpu_pct,ns_per_frame\n");
+}
+
+double tv_sec(struct timeval *a, struct timeval *b) {
+  return (b->tv_sec - a->tv_sec) + (b->tv_usec - a->tv_usec) / 1e6;
+}
+
+int run_one(int b, unsigned rate) {
+  struct rusage ru0, ru1;
+  struct shard s;
+  struct pollfd pfd;
+  unsigned long recv, drop, frames;
+  uint64_t sent = 0, t0, t1, drain = 0;
+  int rc = -1, status, pipefd[2] = {-1, -1};
+  pid_t pid = -1;
+
+  memset(&s, 0, sizeof(s));
+  cfg.ring = (strcmp(backend_names[b], "ring") == 0);
+  cfg.now = time(NULL);
+  s.abtop = abtop_new(cfg.cache_sz, cfg.top_sz, cfg.tau, 1);
+  if (s.abtop == NULL) {
+    fprintf(stderr,"out of memory\n");
+    goto done;
+  }
+  if (open_capture(&s) < 0) goto done;
+  pfd.fd = s.fd;
+  pfd.events = POLLIN;
+  if (pipe(pipefd) < 0) {
+    fprintf(stderr,"pipe: %s\n", strerror(errno));
+    goto done;
+  }
+
+  getrusage(RUSAGE_SELF, &ru0);
+  t0 = now_ns();
+  if ( (pid = fork()) == -1) {
+    fprintf(stderr,"fork: %s\n", strerror(errno));
+    goto done;
+  }
+  if (pid == 0) generate(rate, pipefd[1]);
+
+  /* capture until the generator is done, then a little more to drain */
+  while ((drain == 0) || (now_ns() < drain)) {
+    cfg.now = time(NULL);
+    if ((poll(&pfd, 1, 10) > 0) || s.map) { /* rings: see capture.c */
+      if (get_capture_data(&s) < 0) goto done;
+    }
+    if ((drain == 0) && (waitpid(pid, &status, WNOHANG) == pid)) {
+      drain = now_ns() + 200 * 1000000ULL;
+      pid = -1;
+    }
+  }
+  t1 = now_ns();
+  getrusage(RUSAGE_SELF, &ru1);
+
+  if (capture_stats(&s, &recv, &drop) < 0) goto done;
+  if (read(pipefd[0], &sent, sizeof(sent)) != sizeof(sent)) {
+    fprintf(stderr,"generator failed\n");
+    goto done;
+  }
+  frames = recv - drop;
+
+  double cpu_u = tv_sec(&ru0.ru_utime, &ru1.ru_utime);
+  double cpu_s = tv_sec(&ru0.ru_stime, &ru1.ru_stime);
+  double wall = (t1 - t0) / 1e9;
+
+  fprintf(bench.outf, "%s,%u,%d,%lu,%lu,%lu,%lu,%.2f,%.3f,%.3f,%.1f,%.0f\n",
+    backend_names[b], rate, bench.duration,
+    cfg.ring ? (unsigned long)s.map_len : (unsigned long)cfg.capbuf,
+    (unsigned long)sent, frames, drop, recv ? (100.0 * drop / recv) : 0,
+    cpu_u, cpu_s, 100 * (cpu_u + cpu_s) / wall,
+    frames ? ((cpu_u + cpu_s) * 1e9 / frames) : 0);
+  fflush(bench.outf);
+  if (cfg.verbose) show_abtop_top(s.abtop, cfg.now);
+  rc = 0;
+
+ done:
+  if (pid > 0) {
+    if (rc < 0) kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+  }
+  if (pipefd[0] != -1) close(pipefd[0]);
+  if (pipefd[1] != -1) close(pipefd[1]);
+  close_capture(&s);
+  if (s.abtop) abtop_free(s.abtop);
+  return rc;
+}
+
+/* a bound udp socket so the generator's datagrams have somewhere to go */
+int setup_sink(void) {
+  struct sockaddr_in sin;
+  int sz = 4096;
+
+  bench.sink_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (bench.sink_fd == -1) {
+    fprintf(stderr,"socket: %s\n", strerror(errno));
+    return -1;
+  }
+  setsockopt(bench.sink_fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_ANY); /* all of 127/8 is local */
+  sin.sin_port = htons(bench.port);
+  if (bind(bench.sink_fd, (struct sockaddr*)&sin, sizeof(sin)) == -1) {
+    fprintf(stderr,"bind: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  char *backends, *loads, *bp, *lp, *m, *l;
+  int opt, i, rc = -1;
+
+  cfg.prog = argv[0];
+  bench.outf = stdout;
+
+  while ( (opt=getopt(argc,argv,"vi:l:m:d:p:a:s:o:B:b:S:Z:h")) != -1) {
+    switch(opt) {
+      case 'v': cfg.verbose++; break;
+      case 'i': cfg.dev=strdup(optarg); break;
+      case 'l': bench.loads=strdup(optarg); break;
+      case 'm': bench.backends=strdup(optarg); break;
+      case 'd': bench.duration=atoi(optarg); break;
+      case 'p': bench.port=atoi(optarg); break;
+      case 'a': bench.addrs=atoi(optarg); break;
+      case 's': bench.payload=atoi(optarg); break;
+      case 'o': bench.out=strdup(optarg); break;
+      case 'B': cfg.capbuf=atoi(optarg); break;
+      case 'b': cfg.ring_block_nr=atoi(optarg); break;
+      case 'S': i = atoi(optarg); /* 4k .. 1g; 1 << 31 and up is undefined */
+                if ((i < 12) || (i > 30)) usage();
+                cfg.ring_block_sz = 1U << i; break;
+      case 'Z': cfg.ring_frame_sz=atoi(optarg); break;
+      case 'h': default: usage(); break;
+    }
+  }
+  if ((bench.duration < 1) || (bench.addrs < 1) || (bench.payload < 1)) usage();
+  if ((cfg.ring_block_nr < 1) || (cfg.ring_frame_sz < 1)) usage();
+  if (cfg.ring_block_sz % cfg.ring_frame_sz) {
+    fprintf(stderr,"-S block size must be a multiple of -Z frame size\n");
+    usage();
+  }
+  if (cfg.capbuf == 0) cfg.capbuf = cfg.ring_block_sz * cfg.ring_block_nr;
+
+  if (bench.out && ((bench.outf = fopen(bench.out, "w")) == NULL)) {
+    fprintf(stderr,"can't open %s: %s\n", bench.out, strerror(errno));
+    goto done;
+  }
+
+  if (setup_sink() < 0) goto done;
+  report_header();
+
+  loads = strdup(bench.loads);
+  for(l = strtok_r(loads, ",", &lp); l; l = strtok_r(NULL, ",", &lp)) {
+    backends = strdup(bench.backends);
+    for(m = strtok_r(backends, ",", &bp); m; m = strtok_r(NULL, ",", &bp)) {
+      for(i=0; i < (int)NUM_BACKENDS; i++) if (!strcmp(m, backend_names[i])) break;
+      if (i == (int)NUM_BACKENDS) {
+        fprintf(stderr,"unknown backend %s\n", m);
+        usage();
+      }
+      if (run_one(i, atoi(l)) < 0) fprintf(stderr,"%s run failed\n", m);
+    }
+    free(backends);
+  }
+  free(loads);
+  rc = 0;
+
+ done:
+  if (bench.sink_fd != -1) close(bench.sink_fd);
+  if (bench.outf && (bench.outf != stdout)) fclose(bench.outf);
+  return rc;
+}
@@ -0,0 +1,240 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include "iptop.h"
+
+extern struct iptop_conf cfg;
+
+/*
+ * capture backends. both hand each frame to cb() in ip.c.
+ *
+ *  pcap - pcap_create on the interface, read by pcap_dispatch (default)
+ *  ring - with -R, our own AF_PACKET socket with a TPACKET_V3 ring that
+ *         we walk block by block, as raw/rx-ring3.c does. this skips
+ *         libpcap's per-packet layering, and the ring can be made as
+ *         large as the link needs (-b blocks of 2^-S bytes) rather than
+ *         what pcap_set_buffer_size is allowed to give.
+ *
+ * capbench.c measures one against the other.
+ */
+
+/* the bpf program attaches to the pcap handle, or straight to the ring's
+ * socket, compiled for ethernet with the snaplen as the accept length */
+static int set_filter(struct shard *s) {
+  struct bpf_program fp;
+  struct sock_fprog prog;
+  pcap_t *p = s->pcap;
+  int rc=-1;
+
+  if (cfg.filter == NULL) return 0;
+  if ((p == NULL) && ((p = pcap_open_dead(DLT_EN10MB, cfg.snaplen)) == NULL)) {
+    fprintf(stderr, "pcap_open_dead failed\n");
+    goto done;
+  }
+
+  if (pcap_compile(p, &fp, cfg.filter, 0, PCAP_NETMASK_UNKNOWN) != 0) {
+    fprintf(stderr, "error in filter expression: %s\n", pcap_geterr(p));
+    goto done;
+  }
+  if (s->pcap) {
+    if (pcap_setfilter(p, &fp) != 0) {
+      fprintf(stderr, "can't set filter expression: %s\n", pcap_geterr(p));
+      pcap_freecode(&fp);
+      goto done;
+    }
+  } else {
+    prog.len = fp.bf_len;
+    prog.filter = (struct sock_filter*)fp.bf_insns; /* same layout */
+    if (setsockopt(s->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+      fprintf(stderr, "setsockopt SO_ATTACH_FILTER: %s\n", strerror(errno));
+      pcap_freecode(&fp);
+      goto done;
+    }
+  }
+  pcap_freecode(&fp);
+  rc=0;
+
+ done:
+  if (p && (p != s->pcap)) pcap_close(p);
+  return rc;
+}
+
+static int open_pcap(struct shard *s) {
+  if ( (s->pcap = pcap_create(cfg.dev, cfg.err)) == NULL) {
+    fprintf(stderr,"can't open %s: %s\n", cfg.dev, cfg.err);
+    return -1;
+  }
+  if (pcap_set_promisc(s->pcap, 1))              {fprintf(stderr,"pcap_set_promisc failed\n"); return -1;}
+  if (pcap_set_snaplen(s->pcap, cfg.snaplen))    {fprintf(stderr,"pcap_set_snaplen failed\n"); return -1;}
+  if (pcap_set_buffer_size(s->pcap, cfg.capbuf)) {fprintf(stderr,"pcap_set_buf_size failed\n");return -1;}
+  if (pcap_activate(s->pcap))                    {fprintf(stderr,"pcap_activate failed\n");    return -1;}
+  if (set_filter(s))                             return -1;
+  s->fd = pcap_get_selectable_fd(s->pcap);
+  if (s->fd == -1)                               {fprintf(stderr,"pcap_get_sel_fd failed\n");  return -1;}
+  return 0;
+}
+
+/* the ring is set up before the socket is bound to a protocol, so no
+ * packet reaches it before the filter is in place */
+static int open_ring(struct shard *s) {
+  struct sockaddr_ll sl;
+  struct packet_mreq m;
+  unsigned ifindex;
+  int v = TPACKET_V3;
+
+  if ( (ifindex = if_nametoindex(cfg.dev)) == 0) {
+    fprintf(stderr,"failed to find interface %s\n", cfg.dev);
+    return -1;
+  }
+  if ( (s->fd = socket(AF_PACKET, SOCK_RAW, 0)) == -1) {
+    fprintf(stderr,"socket: %s\n", strerror(errno));
+    return -1;
+  }
+  if (setsockopt(s->fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) < 0) {
+    fprintf(stderr,"setsockopt PACKET_VERSION: %s\n", strerror(errno));
+    return -1;
+  }
+  if (set_filter(s)) return -1;
+
+  /* frame size only bounds the frame count; V3 packs packets by length */
+  memset(&s->req, 0, sizeof(s->req));
+  s->req.tp_block_size = cfg.ring_block_sz;
+  s->req.tp_block_nr = cfg.ring_block_nr;
+  s->req.tp_frame_size = cfg.ring_frame_sz;
+  s->req.tp_frame_nr = (cfg.ring_block_sz / cfg.ring_frame_sz) * cfg.ring_block_nr;
+  if (setsockopt(s->fd, SOL_PACKET, PACKET_RX_RING, &s->req, sizeof(s->req)) < 0) {
+    fprintf(stderr,"setsockopt PACKET_RX_RING: %s\n", strerror(errno));
+    return -1;
+  }
+  s->map_len = (size_t)s->req.tp_block_size * s->req.tp_block_nr;
+  s->map = mmap(NULL, s->map_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_LOCKED, s->fd, 0);
+  if (s->map == MAP_FAILED) {
+    fprintf(stderr,"mmap: %s\n", strerror(errno));
+    s->map = NULL;
+    return -1;
+  }
+  if (cfg.verbose) fprintf(stderr,"ring: %u blocks * %u bytes\n",
+                           s->req.tp_block_nr, s->req.tp_block_size);
+
+  memset(&sl, 0, sizeof(sl));
+  sl.sll_family = AF_PACKET;
+  sl.sll_protocol = htons(ETH_P_ALL);
+  sl.sll_ifindex = ifindex;
+  if (bind(s->fd, (struct sockaddr*)&sl, sizeof(sl)) < 0) {
+    fprintf(stderr,"bind: %s\n", strerror(errno));
+    return -1;
+  }
+
+  memset(&m, 0, sizeof(m));
+  m.mr_ifindex = ifindex;
+  m.mr_type = PACKET_MR_PROMISC;
+  if (setsockopt(s->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &m, sizeof(m)) < 0) {
+    fprintf(stderr,"setsockopt PACKET_ADD_MEMBERSHIP: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* open capture interface and get underlying descriptor */
+int open_capture(struct shard *s) {
+  unsigned fan;
+
+  if ((cfg.ring ? open_ring(s) : open_pcap(s)) < 0) return -1;
+  if (cfg.nthreads == 1) return 0;
+
+  /* join the fanout group; the pcap descriptor is the AF_PACKET socket */
+  fan = (getpid() & 0xffff) | (PACKET_FANOUT_HASH << 16);
+  if (setsockopt(s->fd, SOL_PACKET, PACKET_FANOUT, &fan, sizeof(fan)) < 0) {
+    fprintf(stderr,"setsockopt PACKET_FANOUT: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int get_pcap_data(struct shard *s) {
+  int rc=-1;
+
+  if (pcap_dispatch(s->pcap, 10000,cb,(u_char*)s) < 0) {
+    pcap_perror(s->pcap, "pcap error: ");
+    goto done;
+  }
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* hand every block the kernel has retired to us to cb(), then give it back.
+ * at most one lap, so the caller gets to answer the display in between.
+ * it is safe to call with nothing ready, which is just as well: a V3 ring
+ * does not always wake the poll for a block with a packet or two. */
+static int get_ring_data(struct shard *s) {
+  struct tpacket_block_desc *pbd;
+  struct tpacket3_hdr *ppd;
+  struct pcap_pkthdr hdr;
+  unsigned n, i;
+
+  for(n=0; n < s->req.tp_block_nr; n++) {
+    pbd = (struct tpacket_block_desc*)(s->map + (size_t)s->cur * s->req.tp_block_size);
+    if ((pbd->hdr.bh1.block_status & TP_STATUS_USER) == 0) break;
+    __sync_synchronize(); /* read the block only after seeing it is ours */
+
+    ppd = (struct tpacket3_hdr*)((uint8_t*)pbd + pbd->hdr.bh1.offset_to_first_pkt);
+    for(i=0; i < pbd->hdr.bh1.num_pkts; i++) {
+      hdr.ts.tv_sec = ppd->tp_sec;
+      hdr.ts.tv_usec = ppd->tp_nsec / 1000;
+      hdr.caplen = ppd->tp_snaplen;
+      hdr.len = ppd->tp_len;
+      /* a tag the NIC stripped is not in the frame, only here; the test
+       * is libpcap's, as older kernels leave the status bit unset */
+      if (cfg.vlans)
+        s->vid = ((ppd->tp_status & TP_STATUS_VLAN_VALID) || ppd->hv1.tp_vlan_tci) ?
+                 (ppd->hv1.tp_vlan_tci & 0xfff) : 0;
+      cb((u_char*)s, &hdr, (uint8_t*)ppd + ppd->tp_mac);
+      ppd = (struct tpacket3_hdr*)((uint8_t*)ppd + ppd->tp_next_offset);
+    }
+
+    __sync_synchronize(); /* done with the block before the kernel has it */
+    pbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    s->cur = (s->cur + 1) % s->req.tp_block_nr;
+  }
+  return 0;
+}
+
+int get_capture_data(struct shard *s) {
+  return s->map ? get_ring_data(s) : get_pcap_data(s);
+}
+
+/* packets received and dropped since the capture was opened */
+int capture_stats(struct shard *s, unsigned long *recv, unsigned long *drop) {
+  struct tpacket_stats_v3 st;
+  socklen_t len = sizeof(st);
+  struct pcap_stat ps;
+
+  if (s->pcap) {
+    if (pcap_stats(s->pcap, &ps) < 0) {fprintf(stderr,"pcap_stat error\n"); return -1;}
+    *recv = ps.ps_recv;
+    *drop = ps.ps_drop;
+    return 0;
+  }
+  if (getsockopt(s->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0) {
+    fprintf(stderr,"getsockopt PACKET_STATISTICS: %s\n", strerror(errno));
+    return -1;
+  }
+  s->recv += st.tp_packets; /* includes drops */
+  s->drop += st.tp_drops;
+  *recv = s->recv;
+  *drop = s->drop;
+  return 0;
+}
+
+void close_capture(struct shard *s) {
+  if (s->pcap) pcap_close(s->pcap);
+  if (s->map) munmap(s->map, s->map_len);
+  if ((s->pcap == NULL) && (s->fd > 0)) close(s->fd);
+  s->pcap = NULL;
+  s->map = NULL;
+}
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <arpa/inet.h>
+#include "fanout.h"
+
+/*
+ * fan-out: the number of distinct destinations each source talks to,
+ * which is what gives a scanner away. storing the pairs would take memory
+ * in proportion to the scan; instead each source has a HyperLogLog of
+ * FO_M one-byte registers (a few hundred bytes) estimating its distinct
+ * destinations to within about 1.04/sqrt(FO_M), 6.5% with FO_M 256.
+ *
+ * sources live in a fixed set-associative table of FO_WAYS per bucket.
+ * a new source takes the lowest-estimate way of its bucket that is not
+ * in the top list, so memory is bounded and the busiest sources stay.
+ * registers only grow, and only rarely, so the top list is a heap with
+ * back-pointers updated only when a register changes.
+ */
+
+static inline double pow2neg(int r) { return ldexp(1.0, -r); }
+
+fanout_t *fanout_new(int max_src, int top_sz) {
+  fanout_t *f = calloc(1,sizeof(fanout_t));
+  if (!f) return NULL;
+  for(f->nbuckets = 1; f->nbuckets * FO_WAYS < (uint32_t)max_src; f->nbuckets <<= 1) ;
+  f->top_sz = top_sz;
+  f->slots = calloc(f->nbuckets * FO_WAYS, sizeof(fo_src_t));
+  f->top = malloc(top_sz * sizeof(fo_src_t*));
+  f->view = malloc(top_sz * sizeof(fo_src_t));
+  if (!f->slots || !f->top || !f->view) {fanout_free(f); return NULL;}
+  return f;
+}
+
+static inline uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+double fanout_estimate(const fo_src_t *s) {
+  double m = FO_M, alpha = 0.7213 / (1 + 1.079 / m), e;
+  e = alpha * m * m / s->sum;
+  if ((e <= 2.5 * m) && s->zeros) e = m * log(m / s->zeros); // linear counting
+  return e;
+}
+
+static int top_lt(fo_src_t *a, fo_src_t *b) {
+  return fanout_estimate(a) < fanout_estimate(b);
+}
+
+static void top_set(fanout_t *f, int i, fo_src_t *s) {
+  f->top[i] = s;
+  s->top_idx = i;
+}
+
+static void top_up(fanout_t *f, int i) {
+  fo_src_t *s = f->top[i];
+  int p;
+  while (i > 0) {
+    p = (i - 1) / 2;
+    if (!top_lt(s, f->top[p])) break;
+    top_set(f, i, f->top[p]);
+    i = p;
+  }
+  top_set(f, i, s);
+}
+
+static void top_down(fanout_t *f, int i) {
+  fo_src_t *s = f->top[i];
+  int c;
+  while ((c = 2*i + 1) < f->ntop) {
+    if ((c + 1 < f->ntop) && top_lt(f->top[c+1], f->top[c])) c++;
+    if (!top_lt(f->top[c], s)) break;
+    top_set(f, i, f->top[c]);
+    i = c;
+  }
+  top_set(f, i, s);
+}
+
+// s's estimate changed; list it if it now ranks among the top_sz
+static void top_update(fanout_t *f, fo_src_t *s) {
+  if (s->top_idx >= 0) {
+    top_up(f, s->top_idx); // the switch from linear counting is not monotone
+    top_down(f, s->top_idx);
+  } else if (f->ntop < f->top_sz) {
+    top_set(f, f->ntop, s);
+    f->ntop++;
+    top_up(f, s->top_idx);
+  } else if (top_lt(f->top[0], s)) {
+    f->top[0]->top_idx = -1;
+    top_set(f, 0, s);
+    top_down(f, 0);
+  }
+}
+
+// the source's slot, claimed if new; NULL if its bucket is all top sources
+static fo_src_t *lookup(fanout_t *f, uint32_t src) {
+  fo_src_t *b = &f->slots[(mix64(src) & (f->nbuckets - 1)) * FO_WAYS], *v = NULL;
+  int w;
+  for(w=0; w < FO_WAYS; w++) {
+    if (b[w].used && (b[w].src == src)) return &b[w];
+  }
+  for(w=0; w < FO_WAYS; w++) {
+    if (!b[w].used) { v = &b[w]; break; }
+    if (b[w].top_idx >= 0) continue;
+    if ((v == NULL) || (b[w].sum > v->sum)) v = &b[w]; // larger sum, fewer peers
+  }
+  if (v == NULL) return NULL;
+  if (v->used) f->evicted++;
+  memset(v, 0, sizeof(*v));
+  v->src = src;
+  v->used = 1;
+  v->zeros = FO_M;
+  v->sum = FO_M;
+  v->top_idx = -1;
+  return v;
+}
+
+void fanout_hit(fanout_t *f, uint32_t src, uint32_t dst) {
+  uint64_t h = mix64(((uint64_t)src << 32) | dst);
+  uint32_t j = h >> (64 - FO_P);
+  uint8_t r = __builtin_clzll((h << FO_P) | (1ULL << (FO_P - 1))) + 1;
+  fo_src_t *s = lookup(f, src);
+
+  if ((s == NULL) || (r <= s->reg[j])) return; // the usual case
+  if (s->reg[j] == 0) s->zeros--;
+  s->sum += pow2neg(r) - pow2neg(s->reg[j]);
+  s->reg[j] = r;
+  top_update(f, s);
+}
+
+// copy out the top list, unsorted. returns count
+int fanout_top(fanout_t *f, fo_src_t *out) {
+  int i;
+  for(i=0; i < f->ntop; i++) out[i] = *f->top[i];
+  return f->ntop;
+}
+
+static int fosort_by_src(const void *_a, const void *_b) {
+  const fo_src_t *a = _a, *b = _b;
+  return (a->src < b->src) ? -1 : (a->src > b->src);
+}
+
+static int fosort_low_to_high(const void *_a, const void *_b) {
+  double ea = fanout_estimate(_a), eb = fanout_estimate(_b);
+  return (ea < eb) ? -1 : (ea > eb);
+}
+
+/* print the k largest of n top sources, which may come from several shards.
+ * a source seen by more than one shard has its registers merged (max). */
+void fanout_show(fo_src_t *top, int n, int k) {
+  char a[INET_ADDRSTRLEN];
+  int i, m, j;
+  if (n > 1) {
+    qsort(top, n, sizeof(*top), fosort_by_src);
+    for(m=0, i=1; i < n; i++) {
+      if (top[i].src != top[m].src) { top[++m] = top[i]; continue; }
+      top[m].zeros = 0;
+      top[m].sum = 0;
+      for(j=0; j < FO_M; j++) {
+        if (top[i].reg[j] > top[m].reg[j]) top[m].reg[j] = top[i].reg[j];
+        if (top[m].reg[j] == 0) top[m].zeros++;
+        top[m].sum += pow2neg(top[m].reg[j]);
+      }
+    }
+    n = m + 1;
+  }
+  qsort(top, n, sizeof(*top), fosort_low_to_high);
+  for(i = (n > k) ? (n - k) : 0; i < n; i++) {
+    inet_ntop(AF_INET, &top[i].src, a, sizeof(a));
+    printf(" fan> %s: %.0f peers\n", a, fanout_estimate(&top[i]));
+  }
+  printf("\n");
+}
+
+void show_fanout_top(fanout_t *f) {
+  int n = fanout_top(f, f->view);
+  fanout_show(f->view, n, f->top_sz);
+}
+
+void fanout_free(fanout_t *f) {
+  free(f->slots);
+  free(f->top);
+  free(f->view);
+  free(f);
+}
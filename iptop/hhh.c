@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "hhh.h"
+
+/*
+ * hierarchical heavy hitters: which /24 or /16 is hot, not just which
+ * host. summing the abtop top list by prefix afterwards would miss the
+ * subnet made of many hosts that are each too small to be listed.
+ *
+ * instead bytes are counted at each prefix length in hhh_len, each level
+ * a space-saving summary of m counters: a counter for a prefix not yet
+ * tracked is taken from the smallest, inheriting its count as error. a
+ * level's counts are high by at most its total/m, and any prefix with
+ * more than that holds a counter. memory is fixed at HHH_LEVELS * m
+ * counters whatever the traffic. the smallest counter is the root of a
+ * min-heap, with the counts in the heap itself so a sift stays in one
+ * array; a hit only ever raises a count, so it sifts down.
+ *
+ * the costly update is the take-over, a sift from the root, and random
+ * traffic makes one at nearly every level. so, after RHHH (Ben Basat et
+ * al., "Constant Time Updates in Hierarchical Heavy Hitters"), a packet
+ * updates just one level, picked at random, with its bytes times
+ * HHH_LEVELS. each level sees an unbiased sample of a quarter of the
+ * packets; at the packet rates worth watching, the sampling error is
+ * small beside the threshold.
+ *
+ * a prefix is reported when its residual, its bytes less those of the
+ * heavy prefixes already reported beneath it, reaches pct percent of all
+ * bytes. so a /24 is listed for the traffic its hot hosts do not explain,
+ * and a /16 for what its hot /24s and hosts do not. the children's lower
+ * bounds (count - err) are subtracted, so a residual errs high, not low.
+ */
+
+const int hhh_len[HHH_LEVELS] = {32, 24, 16, 8};
+
+hhh_t *hhh_new(int m) {
+  hhh_t *h = calloc(1,sizeof(hhh_t));
+  hh_level_t *l;
+  int i;
+  if (!h) return NULL;
+  h->m = m;
+  for(i=0; i < HHH_LEVELS; i++) {
+    l = &h->lv[i];
+    l->mask = hhh_len[i] ? (0xffffffffU << (32 - hhh_len[i])) : 0;
+    for(l->imask = 1; l->imask < 2 * (uint32_t)m; l->imask <<= 1) ; // load <= 1/2
+    l->index = calloc(l->imask, sizeof(uint32_t));
+    l->imask--;
+    l->ctr = calloc(m, sizeof(hh_ctr_t));
+    l->heap = malloc(m * sizeof(hh_heap_t));
+    if (!l->index || !l->ctr || !l->heap) {hhh_free(h); return NULL;}
+  }
+  h->rng = 0x2545f4914f6cdd1dULL;
+  h->view = malloc(HHH_LEVELS * m * sizeof(hh_entry_t));
+  if (!h->view) {hhh_free(h); return NULL;}
+  return h;
+}
+
+static inline uint32_t prefix_hash(uint32_t p) {
+  return (uint32_t)((p * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static void heap_set(hh_level_t *l, uint32_t i, hh_heap_t x) {
+  l->heap[i] = x;
+  l->ctr[x.c].pos = i;
+}
+
+static void heap_up(hh_level_t *l, uint32_t i) {
+  hh_heap_t x = l->heap[i];
+  uint32_t p;
+  while (i > 0) {
+    p = (i - 1) / 2;
+    if (l->heap[p].count <= x.count) break;
+    heap_set(l, i, l->heap[p]);
+    i = p;
+  }
+  heap_set(l, i, x);
+}
+
+static void heap_down(hh_level_t *l, uint32_t i) {
+  hh_heap_t x = l->heap[i];
+  uint32_t k, n = l->n;
+  while ((k = 2*i + 1) < n) {
+    if ((k + 1 < n) && (l->heap[k+1].count < l->heap[k].count)) k++;
+    if (l->heap[k].count >= x.count) break;
+    heap_set(l, i, l->heap[k]);
+    i = k;
+  }
+  heap_set(l, i, x);
+}
+
+// index slot holding prefix p, or the empty slot where it would go
+static uint32_t find(hh_level_t *l, uint32_t p) {
+  uint32_t i = prefix_hash(p) & l->imask;
+  while (l->index[i] && (l->ctr[l->index[i] - 1].prefix != p)) i = (i + 1) & l->imask;
+  return i;
+}
+
+// empty index slot i, shifting back later members of its probe run
+static void unindex(hh_level_t *l, uint32_t i) {
+  uint32_t j = i, h;
+  l->index[i] = 0;
+  for(;;) {
+    j = (j + 1) & l->imask;
+    if (l->index[j] == 0) break;
+    h = prefix_hash(l->ctr[l->index[j] - 1].prefix) & l->imask;
+    if (((j - h) & l->imask) < ((j - i) & l->imask)) continue; // home is in (i,j]
+    l->index[i] = l->index[j];
+    l->index[j] = 0;
+    i = j;
+  }
+}
+
+static void level_hit(hhh_t *h, hh_level_t *l, uint32_t p, unsigned long bytes) {
+  uint32_t i = find(l, p), c;
+  hh_ctr_t *u;
+
+  if (l->index[i]) {                 // tracked
+    c = l->index[i] - 1;
+    l->heap[l->ctr[c].pos].count += bytes;
+    heap_down(l, l->ctr[c].pos);
+    return;
+  }
+  if (l->n < h->m) {                 // a free counter
+    c = l->n++;
+    u = &l->ctr[c];
+    u->prefix = p;
+    u->err = 0;
+    l->index[i] = c + 1;
+    heap_set(l, l->n - 1, (hh_heap_t){bytes, c});
+    heap_up(l, l->n - 1);
+    return;
+  }
+  c = l->heap[0].c;                  // take over the smallest
+  u = &l->ctr[c];
+  unindex(l, find(l, u->prefix));
+  u->prefix = p;
+  u->err = l->heap[0].count;
+  l->heap[0].count += bytes;
+  l->index[find(l, p)] = c + 1;
+  heap_down(l, 0);
+}
+
+void hhh_hit(hhh_t *h, uint32_t addr, unsigned long bytes) {
+  hh_level_t *l;
+  uint64_t r;
+  h->total += bytes;
+  r = h->rng;                        // xorshift64
+  r ^= r << 13; r ^= r >> 7; r ^= r << 17;
+  h->rng = r;
+  l = &h->lv[(r >> 32) % HHH_LEVELS];
+  level_hit(h, l, ntohl(addr) & l->mask, bytes * HHH_LEVELS);
+}
+
+// copy out every counter of every level. returns count
+int hhh_top(hhh_t *h, hh_entry_t *out, unsigned long *total) {
+  hh_level_t *l;
+  int i, c, n = 0;
+  for(i=0; i < HHH_LEVELS; i++) {
+    l = &h->lv[i];
+    for(c=0; c < l->n; c++) {
+      out[n].prefix = l->ctr[c].prefix;
+      out[n].len = hhh_len[i];
+      out[n].count = l->heap[l->ctr[c].pos].count;
+      out[n].err = l->ctr[c].err;
+      n++;
+    }
+  }
+  *total = h->total;
+  return n;
+}
+
+// longest prefixes first, then by address
+static int hsort_by_prefix(const void *_a, const void *_b) {
+  const hh_entry_t *a = _a, *b = _b;
+  if (a->len != b->len) return (a->len > b->len) ? -1 : 1;
+  return (a->prefix < b->prefix) ? -1 : (a->prefix > b->prefix);
+}
+
+/* print the prefixes whose residual reaches pct percent of total, from n
+ * counters which may come from several shards. a prefix counted by more
+ * than one shard has its counts and errors summed. reorders e. */
+void hhh_show(hh_entry_t *e, int n, unsigned long total, double pct) {
+  unsigned long thresh = total * pct / 100, sub, residual, *res = NULL;
+  uint32_t mask;
+  int *hh = NULL, *covered = NULL, nhh = 0, i, j, m;
+  char a[INET_ADDRSTRLEN];
+  uint32_t p;
+
+  if ((n == 0) || (total == 0)) return;
+  qsort(e, n, sizeof(*e), hsort_by_prefix);
+  for(m=0, i=1; i < n; i++) {
+    if ((e[i].len != e[m].len) || (e[i].prefix != e[m].prefix)) { e[++m] = e[i]; continue; }
+    e[m].count += e[i].count;
+    e[m].err += e[i].err;
+  }
+  n = m + 1;
+
+  hh = malloc(n * sizeof(int));
+  covered = calloc(n, sizeof(int));
+  res = malloc(n * sizeof(unsigned long));
+  if (!hh || !covered || !res) { fprintf(stderr,"out of memory\n"); goto done; }
+
+  /* most specific first, so a prefix's heavy descendants are known */
+  for(i=0; i < n; i++) {
+    if (e[i].count < thresh) continue; // its residual can only be less
+    mask = e[i].len ? (0xffffffffU << (32 - e[i].len)) : 0;
+    for(sub=0, j=0; j < nhh; j++) {
+      if (covered[j] || (e[hh[j]].len <= e[i].len)) continue;
+      if ((e[hh[j]].prefix & mask) != e[i].prefix) continue;
+      sub += e[hh[j]].count - e[hh[j]].err;
+    }
+    residual = (e[i].count > sub) ? (e[i].count - sub) : 0;
+    if (residual < thresh) continue;
+    for(j=0; j < nhh; j++) {  // now explained by this prefix
+      if ((e[hh[j]].len > e[i].len) && ((e[hh[j]].prefix & mask) == e[i].prefix)) covered[j] = 1;
+    }
+    res[nhh] = residual;
+    hh[nhh++] = i;
+  }
+
+  /* widest first */
+  for(j = nhh - 1; j >= 0; j--) {
+    i = hh[j];
+    p = htonl(e[i].prefix);
+    inet_ntop(AF_INET, &p, a, sizeof(a));
+    printf(" hhh> %s/%d: %lu (%.1f%%) residual %lu (%.1f%%)\n", a, e[i].len,
+      e[i].count, 100.0 * e[i].count / total, res[j], 100.0 * res[j] / total);
+  }
+  printf("\n");
+
+ done:
+  free(hh);
+  free(covered);
+  free(res);
+}
+
+void show_hhh_top(hhh_t *h, double pct) {
+  unsigned long total;
+  int n = hhh_top(h, h->view, &total);
+  hhh_show(h->view, n, total, pct);
+}
+
+void hhh_free(hhh_t *h) {
+  int i;
+  for(i=0; i < HHH_LEVELS; i++) {
+    free(h->lv[i].index);
+    free(h->lv[i].ctr);
+    free(h->lv[i].heap);
+  }
+  free(h->view);
+  free(h);
+}
@@ -1,31 +1,110 @@
+#ifndef __ABTOP_H__
+#define __ABTOP_H__
+
+#include <stdint.h>
 #include <time.h>
-#include "utstring.h"
-#include "utarray.h"
-#include "uthash.h"
 
 /* A and B: entities interacting bidirectionally */
 
+/* fixed size binary key; addresses and ports in network order. unused
+ * fields must be zero since keys are hashed and compared as raw bytes.
+ * an ipv6 pair's key has AB_KEY_V6 set and each address folded to 32 bits;
+ * the full addresses go alongside, in an ab_addr6_t, and are compared too,
+ * so the key stays 16 bytes and ipv4 pays nothing for ipv6. */
 typedef struct {
-  UT_string id;
+  uint32_t a;      // ipv4 address, or ipv6 address folded
+  uint32_t b;
+  uint16_t a_port;
+  uint16_t b_port;
+  uint8_t proto;
+  uint8_t flags;   // AB_KEY_V6
+  uint16_t vid;    // vlan id, with -V; else 0
+} ab_key_t;
+
+#define AB_KEY_V6 0x01
+
+typedef struct {
+  uint8_t a[16];
+  uint8_t b[16];
+} ab_addr6_t;
+
+typedef struct {
+  ab_key_t key;
   unsigned long ab;
   unsigned long ba;
   unsigned long count;
   time_t last;
-  UT_hash_handle hh;
-} ab_t;
+  double score;    // decayed bit count, see abtop_rate
+  int top_idx;     // slot in top heap, or -1
+  uint8_t used;
+  uint8_t ref;     // hit since the clock hand last passed
+} ab_t;            // 64 bytes, one cache line
+
+/* per-entry sliding window rings, bytes per 1s and per 10s bucket */
+#define AB_NWIN   3
+#define AB_RING1  10
+#define AB_RING10 30
+typedef struct {
+  time_t t1;   // second of the newest 1s bucket
+  time_t t10;  // tens of seconds of the newest 10s bucket
+  unsigned long s1[AB_RING1];
+  unsigned long s10[AB_RING10];
+} ab_win_t;
+
+extern const int abtop_win_secs[AB_NWIN];
+extern const char *abtop_win_label[AB_NWIN];
 
+/* a copy of a top list entry with its rate worked out, for display */
 typedef struct {
-  ab_t *head;
-  ab_t *cache;
-  UT_array top;
+  ab_key_t key;
+  ab_addr6_t a6;   // if key.flags & AB_KEY_V6
+  unsigned long ab;
+  unsigned long ba;
+  unsigned long count;
+  time_t last;
+  double rate;     // bits per second
+} ab_top_t;
+
+typedef struct {
+  ab_t *slots;   // open addressing table, linear probing
+  uint32_t mask; // slots - 1; slots is a power of two
+  uint32_t hand; // clock hand, the next slot to consider for eviction
+  int count;
+  ab_t **top;   // min-heap by count
+  ab_top_t *view; // scratch for sorted display
+  int ntop;
   int cache_sz;  // Y
   int top_sz;    // X
-  ab_t *avail;
-  int navail; // contiguous free slots starting at avail
+  double tau;    // rate time constant, seconds
+  int by_rate;   // rank by rate, else by total bytes
+  time_t landmark;
+  time_t gnow;   // second for which g is current
+  double g;      // e^((gnow - landmark)/tau)
+  double *cm;    // count-min sketch, cm_d rows of cm_w; NULL unless -s
+  uint32_t cm_w;
+  uint32_t cm_d;
+  double cm_mass; // total counted into the sketch
+  ab_win_t *win; // window rings, one per slot; NULL unless -W
+  ab_addr6_t *a6; // ipv6 addresses, one per slot; NULL until an ipv6 hit
 } abtop_t;
 
-abtop_t *abtop_new(int cache_sz, int top_sz);
-void abtop_hit(abtop_t *t, char *id, time_t when, unsigned long ab, unsigned long ba);
+#define CM_MAX_DEPTH 8
+
+abtop_t *abtop_new(int cache_sz, int top_sz, double tau, int by_rate);
+void abtop_hit(abtop_t *t, const ab_key_t *key, const ab_addr6_t *a6, // a6 NULL for ipv4
+               time_t when, unsigned long ab, unsigned long ba);
+uint32_t abtop_fold6(const uint8_t *addr); // ipv6 address to its key word
 void abtop_free(abtop_t *t);
 void show_abtop(abtop_t *t);
-void show_abtop_top(abtop_t *t);
+void show_abtop_top(abtop_t *t, time_t now);
+double abtop_rate(abtop_t *t, ab_t *u, time_t now); // bits per second
+int abtop_top(abtop_t *t, time_t now, ab_top_t *out);  // out has top_sz room
+int abtop_merge(ab_top_t *top, int n, int by_rate); // sorted low to high
+void abtop_show(ab_top_t *top, int n, int k, int by_rate, const char *label);
+int abtop_sketch(abtop_t *t, int width, int depth); // before any hits
+double abtop_error(abtop_t *t, time_t now);
+int abtop_windows(abtop_t *t); // before any hits, after abtop_sketch
+int abtop_top_win(abtop_t *t, time_t now, int w, ab_top_t *out);
+void abtop_show_error(double err, int by_rate);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __FANOUT_H__
+#define __FANOUT_H__
+
+#include <stdint.h>
+
+/* distinct peers per source: a HyperLogLog of FO_M registers per source */
+
+#define FO_P    8             // register index bits
+#define FO_M    (1 << FO_P)   // registers; standard error 1.04/sqrt(FO_M)
+#define FO_WAYS 4             // sources per table bucket
+
+typedef struct {
+  uint32_t src;     // network order
+  uint16_t zeros;   // registers still zero
+  uint8_t used;
+  int top_idx;      // slot in top heap, or -1
+  double sum;       // sum of 2^-reg, kept as registers change
+  uint8_t reg[FO_M];
+} fo_src_t;
+
+typedef struct {
+  fo_src_t *slots;   // nbuckets * FO_WAYS, set associative
+  uint32_t nbuckets; // power of two
+  fo_src_t **top;    // min-heap by estimate
+  fo_src_t *view;    // scratch for display
+  int ntop;
+  int top_sz;
+  unsigned long evicted;
+} fanout_t;
+
+fanout_t *fanout_new(int max_src, int top_sz);
+void fanout_hit(fanout_t *f, uint32_t src, uint32_t dst);
+double fanout_estimate(const fo_src_t *s);
+int fanout_top(fanout_t *f, fo_src_t *out);   // out has top_sz room
+void fanout_show(fo_src_t *top, int n, int k);
+void show_fanout_top(fanout_t *f);
+void fanout_free(fanout_t *f);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef __HHH_H__
+#define __HHH_H__
+
+#include <stdint.h>
+
+/* hierarchical heavy hitters: bytes per address prefix, at several prefix
+ * lengths at once, each a space-saving summary of m counters */
+
+#define HHH_LEVELS 4  // prefix lengths, see hhh_len
+
+extern const int hhh_len[HHH_LEVELS];
+
+typedef struct {
+  uint32_t prefix;        // host order, masked to the level's length
+  uint32_t pos;           // slot in the level's heap, which has the count
+  unsigned long err;      // the count is high by at most this
+} hh_ctr_t;
+
+typedef struct {
+  unsigned long count;    // bytes
+  uint32_t c;             // counter number
+} hh_heap_t;
+
+typedef struct {
+  uint32_t mask;          // netmask of this level, host order
+  hh_ctr_t *ctr;          // m counters
+  hh_heap_t *heap;        // min-heap by count
+  uint32_t *index;        // open addressing, counter number + 1; 0 is empty
+  uint32_t imask;         // index slots - 1
+  int n;                  // counters in use
+} hh_level_t;
+
+/* a counter, copied out for display */
+typedef struct {
+  uint32_t prefix;        // host order
+  int len;
+  unsigned long count;
+  unsigned long err;
+} hh_entry_t;
+
+typedef struct {
+  int m;                  // counters per level
+  unsigned long total;    // bytes counted
+  uint64_t rng;           // picks the level each packet updates
+  hh_level_t lv[HHH_LEVELS];
+  hh_entry_t *view;       // scratch for display
+} hhh_t;
+
+hhh_t *hhh_new(int m);
+void hhh_hit(hhh_t *h, uint32_t addr, unsigned long bytes); // addr network order
+int hhh_top(hhh_t *h, hh_entry_t *out, unsigned long *total); // out has HHH_LEVELS*m room
+void hhh_show(hh_entry_t *e, int n, unsigned long total, double pct);
+void show_hhh_top(hhh_t *h, double pct);
+void hhh_free(hhh_t *h);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef __TOP_LOG_H__
+#define __TOP_LOG_H__
+
+#include <stdint.h>
+#include "abtop.h"
+
+/*
+ * the top list history that iptop -L appends to, and iptop_read -l queries.
+ *
+ * two files, both only ever appended to:
+ *
+ *  <file>      a header page, then fixed size records: the time, and the
+ *              top_sz entries of the merged top list as displayed at it
+ *  <file>.idx  the time of each record, as an int64; 8 bytes a record, so
+ *              a binary search over a day of them touches a few pages
+ *
+ * the writer grows each file a chunk of records at a time, writes the
+ * record and its time, and only then raises nrec. a reader takes nrec
+ * records as complete and ignores anything past them, so a crash leaves
+ * at worst a record that is not counted, and a restart appends after it.
+ */
+
+#define TOP_LOG_MAGIC 0x6970746c /* "iptl" */
+#define TOP_LOG_HDR   4096       /* records start a page in */
+#define TOP_LOG_GROW  1024       /* records the files grow by */
+
+struct top_log_hdr {
+  uint32_t magic;
+  uint32_t entry_sz;   /* sizeof(ab_top_t), to catch a mismatched reader */
+  uint32_t top_sz;     /* entries per record */
+  uint32_t rec_sz;     /* bytes per record */
+  uint32_t by_rate;    /* else ranked by total bytes */
+  uint32_t interval;   /* seconds between records, as iptop -t */
+  volatile uint64_t nrec;
+};
+
+struct top_log_rec {
+  int64_t t;           /* unix time */
+  uint32_t ntop;
+  uint32_t pad;
+  uint64_t pkts;       /* frames seen by iptop, so far */
+  uint64_t bytes;
+  ab_top_t top[];      /* top_sz of them, highest ranked first */
+};
+
+static inline size_t top_log_rec_sz(int top_sz) {
+  return (sizeof(struct top_log_rec) + top_sz * sizeof(ab_top_t) + 7) & ~(size_t)7;
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef __TOP_SHM_H__
+#define __TOP_SHM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "abtop.h"
+
+/*
+ * the top list and counters that iptop -m publishes to shared memory, for
+ * iptop_read or a dashboard to map and read at any rate.
+ *
+ * iptop copies its merged top list in every -P ms inside a seqlock: seq
+ * is odd while a copy is in progress. a reader copies the header and the
+ * ntop entries out, and retries if seq was odd or changed meanwhile.
+ * readers never write to the segment, so they cannot hold up iptop.
+ */
+
+#define TOP_SHM     "/iptop"
+#define TOP_MAGIC   0x69707470 /* "iptp" */
+#define TOP_SHM_MAX 256        /* entries; a larger -k publishes this many */
+
+struct top_shm {
+  uint32_t magic;
+  uint32_t entry_sz;   /* sizeof(ab_top_t), to catch a mismatched reader */
+  uint32_t by_rate;    /* else ranked by total bytes */
+  uint32_t ntop;
+  volatile uint32_t seq;
+  uint32_t nthreads;
+  uint64_t published;  /* unix time of last copy, in ms */
+  uint64_t pkts;       /* frames seen by iptop */
+  uint64_t bytes;
+  uint64_t recv;       /* frames the kernel had for iptop, and dropped */
+  uint64_t drop;
+  uint64_t pairs;      /* pairs being tracked */
+  double err;          /* with -s, the sketch's overestimate bound */
+  ab_top_t top[TOP_SHM_MAX]; /* highest ranked first */
+};
+
+/* copy in the header fields from hdr and the n entries of top, which are
+ * ranked low to high as abtop_merge leaves them */
+static inline void top_publish(struct top_shm *shm, const struct top_shm *hdr,
+                               const ab_top_t *top, int n) {
+  int i;
+  if (n > TOP_SHM_MAX) { top += n - TOP_SHM_MAX; n = TOP_SHM_MAX; }
+  shm->seq++;
+  __sync_synchronize();
+  shm->by_rate = hdr->by_rate;
+  shm->nthreads = hdr->nthreads;
+  shm->published = hdr->published;
+  shm->pkts = hdr->pkts;
+  shm->bytes = hdr->bytes;
+  shm->recv = hdr->recv;
+  shm->drop = hdr->drop;
+  shm->pairs = hdr->pairs;
+  shm->err = hdr->err;
+  for(i=0; i < n; i++) shm->top[i] = top[n - 1 - i];
+  shm->ntop = n;
+  __sync_synchronize();
+  shm->seq++;
+}
+
+/* consistent copy of the shared segment into out; only out->ntop entries */
+static inline void top_snapshot(const struct top_shm *shm, struct top_shm *out) {
+  uint32_t s1, s2, n;
+  do {
+    while ((s1 = shm->seq) & 1) ;
+    __sync_synchronize();
+    memcpy(out, (const void*)shm, offsetof(struct top_shm, top));
+    n = (out->ntop < TOP_SHM_MAX) ? out->ntop : TOP_SHM_MAX;
+    memcpy(out->top, (const void*)shm->top, n * sizeof(ab_top_t));
+    __sync_synchronize();
+    s2 = shm->seq;
+  } while (s1 != s2);
+  out->ntop = n;
+}
+
+#endif
@@ -0,0 +1,290 @@
+#ifndef __TOPK_H__
+#define __TOPK_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * topk.h: abtop's table, and the same table generated for a given key
+ * and counters
+ *
+ *   typedef struct { uint8_t a[6], b[6]; } mac_pair_t;
+ *   TOPK_DEFINE(macs, mac_pair_t, uint64_t, 2)
+ *
+ * defines macs_entry_t { key; c[2]; ... } and macs_t, and
+ *
+ *   macs_t *macs_new(int cache_sz, int top_sz);
+ *   void macs_hit(macs_t *t, const mac_pair_t *key, const uint64_t add[2]);
+ *   int macs_top(macs_t *t, macs_entry_t *out);  // out has top_sz room
+ *   void macs_sort(macs_entry_t *e, int n);      // highest first
+ *   void macs_free(macs_t *t);
+ *
+ * each instance is its own code, with the key size and counter count
+ * known to the compiler: the key hash and compare unroll to a few word
+ * operations and the counter adds to a fixed sequence, with no void
+ * pointers or length arguments, and no strings. keys are hashed and
+ * compared as raw bytes, so padding in them must be zeroed.
+ *
+ * the design: one flat open addressing table of at least twice cache_sz
+ * entries, linear probing, deletion by backward shift; CLOCK replacement
+ * once cache_sz keys are held; and a min-heap with back-pointers of the
+ * top_sz entries ranked highest. TOPK_DEFINE ranks by the first counter.
+ *
+ * the table and the heap are generated by TOPK_TABLE and TOPK_HEAP, which
+ * abtop.c uses directly, with its own entry, hash and ranking, and its
+ * rates, sketch, windows and ipv6 addresses kept on top. a table type for
+ * them has slots, mask, hand, top, ntop and top_sz members, and an entry
+ * type key, used, ref and top_idx.
+ */
+
+/* hash n bytes; with n a constant this compiles to straight line code */
+static inline uint64_t topk_hash(const void *key, size_t n) {
+  const uint8_t *p = key;
+  uint64_t h = n * 0x9e3779b97f4a7c15ULL, w;
+  size_t i;
+  for(i=0; i + 8 <= n; i += 8) {
+    memcpy(&w, p + i, 8);
+    h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 31;
+  }
+  if (i < n) {
+    w = 0;
+    memcpy(&w, p + i, n - i);
+    h = (h ^ w) * 0xbf58476d1ce4e5b9ULL;
+  }
+  h ^= h >> 29;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 32;
+  return h;
+}
+
+/*
+ * TOPK_HEAP(name, tab_t, ent_t, LT): the top list, a binary min-heap of
+ * up to t->top_sz entries in t->top, ordered by LT(t, a, b), so the root
+ * is the one to displace next. each entry keeps its heap slot in top_idx
+ * (-1 if not in the list); a hit on a listed entry is a sift-down from
+ * that slot, never a search or sort. defines
+ *
+ *   void name_top_update(tab_t *t, ent_t *u);  // u grew; list it if it ranks
+ *   void name_top_remove(tab_t *t, ent_t *u);  // u is listed; unlist it
+ */
+#define TOPK_HEAP(name, tab_t, ent_t, LT)                                      \
+                                                                               \
+static inline void name##_top_set(tab_t *t, int i, ent_t *u) {                 \
+  t->top[i] = u;                                                               \
+  u->top_idx = i;                                                              \
+}                                                                              \
+                                                                               \
+static inline void name##_top_up(tab_t *t, int i) {                            \
+  ent_t *u = t->top[i];                                                        \
+  int p;                                                                       \
+  while (i > 0) {                                                              \
+    p = (i - 1) / 2;                                                           \
+    if (!LT(t, u, t->top[p])) break;                                           \
+    name##_top_set(t, i, t->top[p]);                                           \
+    i = p;                                                                     \
+  }                                                                            \
+  name##_top_set(t, i, u);                                                     \
+}                                                                              \
+                                                                               \
+static inline void name##_top_down(tab_t *t, int i) {                          \
+  ent_t *u = t->top[i];                                                        \
+  int c;                                                                       \
+  while ((c = 2*i + 1) < t->ntop) {                                            \
+    if ((c + 1 < t->ntop) && LT(t, t->top[c+1], t->top[c])) c++;               \
+    if (!LT(t, t->top[c], u)) break;                                           \
+    name##_top_set(t, i, t->top[c]);                                           \
+    i = c;                                                                     \
+  }                                                                            \
+  name##_top_set(t, i, u);                                                     \
+}                                                                              \
+                                                                               \
+static inline void name##_top_remove(tab_t *t, ent_t *u) {                     \
+  int i = u->top_idx;                                                          \
+  ent_t *m;                                                                    \
+  u->top_idx = -1;                                                             \
+  if (--t->ntop == i) return;                                                  \
+  m = t->top[t->ntop];                                                         \
+  name##_top_set(t, i, m);                                                     \
+  name##_top_down(t, i);                                                       \
+  name##_top_up(t, m->top_idx);                                                \
+}                                                                              \
+                                                                               \
+static inline void name##_top_update(tab_t *t, ent_t *u) {                     \
+  if (u->top_idx >= 0) {                                                       \
+    name##_top_down(t, u->top_idx);                                            \
+  } else if (t->ntop < t->top_sz) {                                            \
+    name##_top_set(t, t->ntop, u);                                             \
+    t->ntop++;                                                                 \
+    name##_top_up(t, u->top_idx);                                              \
+  } else if (LT(t, t->top[0], u)) {                                            \
+    t->top[0]->top_idx = -1;                                                   \
+    name##_top_set(t, 0, u);                                                   \
+    name##_top_down(t, 0);                                                     \
+  }                                                                            \
+}
+
+/*
+ * TOPK_TABLE(name, tab_t, ent_t, key_t, x_t, HASH, SAME, MOVED): the table
+ * in t->slots, t->mask + 1 of them, and its CLOCK hand. a hit sets the
+ * entry's ref bit and that is all; on a miss in a full cache the hand
+ * sweeps on, clearing ref bits, to the first entry not hit since it last
+ * passed. the hooks:
+ *
+ *   HASH(k)            hash of key k, of which the low bits pick the slot
+ *   SAME(t, i, x)      slot i's key matches; is it x's entry too? (x is
+ *                      side data of the key's, NULL if there is none)
+ *   MOVED(t, from, to) entry from is now in slot to; move its side data
+ *
+ * defines
+ *
+ *   uint32_t name_find(tab_t *t, const key_t *k, const x_t *x, int *found);
+ *                     // slot of k, or the empty slot where it would go
+ *   uint32_t name_victim(tab_t *t);       // entry to evict; advances the hand
+ *   void name_del(tab_t *t, uint32_t i);  // empty slot i, shifting back
+ *                                         // later members of its probe run
+ */
+#define TOPK_TABLE(name, tab_t, ent_t, key_t, x_t, HASH, SAME, MOVED)          \
+                                                                               \
+static inline uint32_t name##_find(tab_t *t, const key_t *k, const x_t *x,     \
+                                   int *found) {                               \
+  uint32_t i = (uint32_t)HASH(k) & t->mask;                                    \
+  while (t->slots[i].used) {                                                   \
+    if ((memcmp(&t->slots[i].key, k, sizeof(key_t)) == 0) && SAME(t, i, x)) {  \
+      *found = 1;                                                              \
+      return i;                                                                \
+    }                                                                          \
+    i = (i + 1) & t->mask;                                                     \
+  }                                                                            \
+  *found = 0;                                                                  \
+  return i;                                                                    \
+}                                                                              \
+                                                                               \
+static inline uint32_t name##_victim(tab_t *t) {                               \
+  ent_t *u;                                                                    \
+  for(;;) {                                                                    \
+    u = &t->slots[t->hand];                                                    \
+    t->hand = (t->hand + 1) & t->mask;                                         \
+    if (!u->used) continue;                                                    \
+    if (u->ref) { u->ref = 0; continue; } /* second chance */                  \
+    return u - t->slots;                                                       \
+  }                                                                            \
+}                                                                              \
+                                                                               \
+static inline void name##_del(tab_t *t, uint32_t i) {                          \
+  uint32_t j = i, h;                                                           \
+  ent_t *u;                                                                    \
+  t->slots[i].used = 0;                                                        \
+  for(;;) {                                                                    \
+    j = (j + 1) & t->mask;                                                     \
+    if (!t->slots[j].used) break;                                              \
+    h = (uint32_t)HASH(&t->slots[j].key) & t->mask;                            \
+    /* home is in (i,j] */                                                     \
+    if (((j - h) & t->mask) < ((j - i) & t->mask)) continue;                   \
+    u = &t->slots[i];                                                          \
+    *u = t->slots[j];                                                          \
+    t->slots[j].used = 0;                                                      \
+    if (u->top_idx >= 0) t->top[u->top_idx] = u;                               \
+    MOVED(t, j, i);                                                            \
+    i = j;                                                                     \
+  }                                                                            \
+}
+
+/* TOPK_DEFINE's hooks: no side data, ranked by the first counter */
+#define TOPK_SAME_ANY(t, i, x) 1
+#define TOPK_MOVED_NONE(t, from, to) do { } while (0)
+#define TOPK_LT_C0(t, a, b) ((a)->c[0] < (b)->c[0])
+
+#define TOPK_DEFINE(name, key_t, ctr_t, nctr)                                  \
+                                                                               \
+typedef struct {                                                               \
+  key_t key;                                                                   \
+  ctr_t c[nctr];   /* ranked by c[0] */                                        \
+  int top_idx;     /* slot in top heap, or -1 */                               \
+  uint8_t used;                                                                \
+  uint8_t ref;     /* hit since the clock hand last passed */                  \
+} name##_entry_t;                                                              \
+                                                                               \
+typedef struct {                                                               \
+  name##_entry_t *slots;                                                       \
+  uint32_t mask;                                                               \
+  uint32_t hand;                                                               \
+  int count;                                                                   \
+  int cache_sz;                                                                \
+  int top_sz;                                                                  \
+  name##_entry_t **top;                                                        \
+  int ntop;                                                                    \
+} name##_t;                                                                    \
+                                                                               \
+static inline uint64_t name##_hash(const key_t *k) {                           \
+  return topk_hash(k, sizeof(key_t));                                          \
+}                                                                              \
+                                                                               \
+TOPK_HEAP(name, name##_t, name##_entry_t, TOPK_LT_C0)                          \
+TOPK_TABLE(name, name##_t, name##_entry_t, key_t, void, name##_hash,           \
+           TOPK_SAME_ANY, TOPK_MOVED_NONE)                                     \
+                                                                               \
+static inline void name##_free(name##_t *t) {                                  \
+  free(t->slots);                                                              \
+  free(t->top);                                                                \
+  free(t);                                                                     \
+}                                                                              \
+                                                                               \
+static inline name##_t *name##_new(int cache_sz, int top_sz) {                 \
+  name##_t *t = calloc(1, sizeof(name##_t));                                   \
+  if (!t) return NULL;                                                         \
+  t->cache_sz = cache_sz;                                                      \
+  t->top_sz = top_sz;                                                          \
+  for(t->mask = 1; t->mask < 2 * (uint32_t)cache_sz; t->mask <<= 1) ;          \
+  t->slots = calloc(t->mask, sizeof(name##_entry_t));                          \
+  t->mask--;                                                                   \
+  t->top = malloc(top_sz * sizeof(name##_entry_t*));                           \
+  if (!t->slots || !t->top) { name##_free(t); return NULL; }                   \
+  return t;                                                                    \
+}                                                                              \
+                                                                               \
+static inline void name##_hit(name##_t *t, const key_t *key,                   \
+                              const ctr_t add[nctr]) {                         \
+  name##_entry_t *u;                                                           \
+  uint32_t i, o;                                                               \
+  int found, n;                                                                \
+  i = name##_find(t, key, NULL, &found);                                       \
+  if (!found) {                                                                \
+    if (t->count == t->cache_sz) {                                             \
+      o = name##_victim(t);                                                    \
+      if (t->slots[o].top_idx >= 0) name##_top_remove(t, &t->slots[o]);        \
+      name##_del(t, o);                                                        \
+      t->count--;                                                              \
+      i = name##_find(t, key, NULL, &found);                                   \
+    }                                                                          \
+    u = &t->slots[i];                                                          \
+    memset(u, 0, sizeof(*u));                                                  \
+    u->key = *key;                                                             \
+    u->used = 1;                                                               \
+    u->top_idx = -1;                                                           \
+    t->count++;                                                                \
+  } else {                                                                     \
+    u = &t->slots[i];                                                          \
+    u->ref = 1;                                                                \
+  }                                                                            \
+  for(n=0; n < (nctr); n++) u->c[n] += add[n];                                 \
+  name##_top_update(t, u);                                                     \
+}                                                                              \
+                                                                               \
+static inline int name##_top(name##_t *t, name##_entry_t *out) {               \
+  int i;                                                                       \
+  for(i=0; i < t->ntop; i++) out[i] = *t->top[i];                              \
+  return t->ntop;                                                              \
+}                                                                              \
+                                                                               \
+static inline int name##_cmp(const void *_a, const void *_b) {                 \
+  const name##_entry_t *a = _a, *b = _b;                                       \
+  return (a->c[0] > b->c[0]) ? -1 : (a->c[0] < b->c[0]);                       \
+}                                                                              \
+                                                                               \
+static inline void name##_sort(name##_entry_t *e, int n) {                     \
+  qsort(e, n, sizeof(*e), name##_cmp);                                         \
+}
+
+#endif
@@ -1,5 +1,4 @@
 #include <stdio.h>
-#include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,12 +14,18 @@ extern struct iptop_conf cfg;
 /*******************************************************************************
  * ethernet frame: | 6 byte dst MAC | 6 byte src MAC | 2 byte type | data
  * IP datagram: | 1 byte v/len | 1 byte TOS | 2 byte len | 16 more bytes | data
+ * IPv6: | 4 bytes v/class/flow | 2 byte payload len | 1 byte next | 1 byte hops
+ *       | 16 byte src | 16 byte dst | extension headers | data
  ******************************************************************************/
-void cb(u_char *unused, const struct pcap_pkthdr *hdr, const u_char *pkt) {
+void cb(u_char *user, const struct pcap_pkthdr *hdr, const u_char *pkt) {
+  struct shard *shard = (struct shard*)user; /* this capture thread's */
   /* data link: ethernet frame */
   const uint8_t *dst_mac=pkt, *src_mac=pkt+6, *typep=pkt+12;
   const uint8_t *data = pkt+14, *tci_p;
-  uint16_t type,tci,vid;
+  uint16_t type,tci,vid=shard->vid; /* a tag the ring took off, else 0 */
+
+  shard->pkts++;
+  shard->bytes += hdr->len;
 
   // need at least a MAC pair, ethertype and IP header
   if (hdr->caplen < 12+2+20) return;
@@ -36,16 +41,20 @@ void cb(u_char *unused, const struct pcap_pkthdr *hdr, const u_char *pkt) {
     goto again;
   }
 
-  if (type == 0x8100) /* vlan */ {
+  if ((type == 0x8100) || (type == 0x88a8) || (type == 0x9100)) /* vlan */ {
   /* vlan tags are 'interjected' before the ethertype; they are known by their
-   * own ethertype (0x8100) followed by a TCI, after which the real etherype 
-   * (or another double VLAN tag) occurs. Each VLAN tag adds two bytes to the
-   * frame size. The TCI (tag control identifier) contains the VLAN ID (vid).*/
+   * own ethertype (0x8100, or 0x88a8 for an 802.1ad outer tag) followed by a
+   * TCI, after which the real etherype (or another double VLAN tag) occurs.
+   * Each VLAN tag adds two bytes to the frame size. The TCI (tag control
+   * identifier) contains the VLAN ID (vid). With -V the vid is part of the
+   * key; of stacked tags, the innermost (customer) one's. A tag the NIC
+   * stripped comes from the ring instead, in shard->vid; any tag still in
+   * the frame is inside it. */
     tci_p = typep + 2; 
     if (hdr->caplen < ((tci_p - pkt)+2)) return;
     memcpy(&tci, tci_p, sizeof(uint16_t));  
     tci = ntohs(tci);
-    vid = tci & 0xfff; // vlan VID is in the low 12 bits of the TCI
+    if (cfg.vlans) vid = tci & 0xfff; // vlan VID is in the low 12 bits of the TCI
     typep = tci_p + 2;
     goto again; 
   }
@@ -58,13 +67,14 @@ void cb(u_char *unused, const struct pcap_pkthdr *hdr, const u_char *pkt) {
   const uint8_t *ip_datagram, *ip_hl, *ip_tos, *ip_len, *ip_id, *ip_fo, *ip_ttl,
           *ip_proto, *ip_sum, *ip_src, *ip_dst, *ip_opt, *ip_data;
   uint8_t ip_version, ip_hdr_len, *ap;
-  uint16_t ip_lenh, ip_idh, ip_opts_len;
-  uint32_t ip_srch, ip_dsth;
+  uint16_t ip_lenh, ip_idh, ip_foh, ip_opts_len, ap_tmp;
+  uint32_t ip_srch, ip_dsth, key_src, key_dst;
   if (type == 0x0800) {
     ip_datagram = data;
     if (hdr->caplen < ((ip_datagram - pkt) + 20)) return;
     ip_hl = data;   
-       ip_hdr_len = (*ip_hl & 0x0f) * 4; assert(ip_hdr_len >= 20);
+       ip_hdr_len = (*ip_hl & 0x0f) * 4;
+       if (ip_hdr_len < 20) return; /* corrupt; an archive may well have one */
        ip_opts_len = ip_hdr_len - 20;
        ip_version = (*ip_hl & 0xf0) >> 4;
     ip_tos = data + 1;
@@ -83,19 +93,103 @@ void cb(u_char *unused, const struct pcap_pkthdr *hdr, const u_char *pkt) {
     memcpy(&ip_idh, ip_id, sizeof(uint16_t)); ip_idh = ntohs(ip_idh);
     memcpy(&ip_srch, ip_src, sizeof(uint32_t)); ip_srch = ntohl(ip_srch);
     memcpy(&ip_dsth, ip_dst, sizeof(uint32_t)); ip_dsth = ntohl(ip_dsth);
-    utstring_clear(cfg.label);
-    utstring_printf(cfg.label, "%d.%d.%d.%d->%d.%d.%d.%d", 
-                                (ip_srch & 0xff000000) >> 24,
-                                (ip_srch & 0x00ff0000) >> 16,
-                                (ip_srch & 0x0000ff00) >>  8,
-                                (ip_srch & 0x000000ff) >>  0,
-                                (ip_dsth & 0xff000000) >> 24,
-                                (ip_dsth & 0x00ff0000) >> 16,
-                                (ip_dsth & 0x0000ff00) >>  8,
-                                (ip_dsth & 0x000000ff) >>  0);
+    memcpy(&key_src, ip_src, sizeof(uint32_t)); /* network order, for keys */
+    memcpy(&key_dst, ip_dst, sizeof(uint32_t));
     data = ip_data;
-    char *label = utstring_body(cfg.label);
-    abtop_hit(cfg.abtop, label, cfg.now, ip_lenh, 0); /* len excludes frame */ // FIXME ab ba
+
+    if (shard->fanout) fanout_hit(shard->fanout, key_src, key_dst);
+    if (shard->hhh) hhh_hit(shard->hhh, cfg.hhh_dst ? key_dst : key_src, ip_lenh);
+
+    ab_key_t key;
+    memset(&key, 0, sizeof(key));
+    memcpy(&key.a, ip_src, sizeof(key.a)); /* network order; no formatting */
+    memcpy(&key.b, ip_dst, sizeof(key.b));
+    /* only when there is one: a store into the zeroed half of the key that
+     * find() reads whole would hold up that read on every packet */
+    if (vid) key.vid = vid;
+    if (cfg.ports) {
+      key.proto = *ip_proto;
+      memcpy(&ip_foh, ip_fo, sizeof(uint16_t)); ip_foh = ntohs(ip_foh);
+      if (((key.proto == 6) || (key.proto == 17)) &&  /* tcp or udp */
+          ((ip_foh & 0x1fff) == 0) &&                  /* first fragment */
+          (hdr->caplen >= ((ip_data - pkt) + 4))) {
+        memcpy(&key.a_port, ip_data, sizeof(uint16_t));
+        memcpy(&key.b_port, ip_data + 2, sizeof(uint16_t));
+      }
+    }
+
+    if (shard->abtop == NULL) return; /* decode only; see offline.c */
+
+    /* canonical order: the lower address (then port) is a, so that both
+     * directions of a conversation count into one entry, as ab or ba */
+    if ((ip_srch > ip_dsth) ||
+        ((ip_srch == ip_dsth) && (ntohs(key.a_port) > ntohs(key.b_port)))) {
+      key.a = key.b; memcpy(&key.b, ip_src, sizeof(key.b));
+      ap_tmp = key.a_port; key.a_port = key.b_port; key.b_port = ap_tmp;
+      abtop_hit(shard->abtop, &key, NULL, cfg.now, 0, ip_lenh); /* len excludes frame */
+    } else {
+      abtop_hit(shard->abtop, &key, NULL, cfg.now, ip_lenh, 0);
+    }
+  } else if (type == 0x86dd) {
+    /* ipv6. the key carries the addresses folded (see abtop.h), and a6 the
+     * addresses themselves. to reach the ports, hop-by-hop, routing,
+     * destination options, fragment and AH headers are skipped; the key's
+     * proto is the header after them. fan-out and prefixes are ipv4 only. */
+    const uint8_t *nh_p = data + 40;
+    uint8_t nh;
+    uint16_t fo;
+    uint32_t len6;
+    int frag = 0, n;
+    ab_addr6_t a6;
+
+    if (hdr->caplen < ((data - pkt) + 40)) return;
+    memcpy(&ip_lenh, data + 4, sizeof(uint16_t));
+    len6 = ntohs(ip_lenh) + 40;  /* payload plus fixed header */
+    nh = data[6];
+    memcpy(a6.a, data + 8, sizeof(a6.a));
+    memcpy(a6.b, data + 24, sizeof(a6.b));
+
+    ab_key_t key;
+    memset(&key, 0, sizeof(key));
+    key.flags = AB_KEY_V6;
+    key.vid = vid;
+    if (cfg.ports) {
+      for(n=0; n < 8; n++) {
+        if (hdr->caplen < ((nh_p - pkt) + 8)) break;
+        if ((nh == 0) || (nh == 43) || (nh == 60)) {
+          nh = nh_p[0]; nh_p += (nh_p[1] + 1) * 8;
+        } else if (nh == 44) {  /* fragment: only the first has the ports */
+          memcpy(&fo, nh_p + 2, sizeof(uint16_t));
+          if (ntohs(fo) & 0xfff8) frag = 1;
+          nh = nh_p[0]; nh_p += 8;
+        } else if (nh == 51) {
+          nh = nh_p[0]; nh_p += (nh_p[1] + 2) * 4;
+        } else break;
+      }
+      key.proto = nh;
+      if (((nh == 6) || (nh == 17)) && !frag &&
+          (hdr->caplen >= ((nh_p - pkt) + 4))) {
+        memcpy(&key.a_port, nh_p, sizeof(uint16_t));
+        memcpy(&key.b_port, nh_p + 2, sizeof(uint16_t));
+      }
+    }
+
+    if (shard->abtop == NULL) return; /* decode only; see offline.c */
+
+    /* canonical order as for ipv4; memcmp orders addresses numerically */
+    n = memcmp(a6.a, a6.b, sizeof(a6.a));
+    if ((n > 0) || ((n == 0) && (ntohs(key.a_port) > ntohs(key.b_port)))) {
+      memcpy(a6.a, data + 24, sizeof(a6.a));
+      memcpy(a6.b, data + 8, sizeof(a6.b));
+      ap_tmp = key.a_port; key.a_port = key.b_port; key.b_port = ap_tmp;
+      key.a = abtop_fold6(a6.a);
+      key.b = abtop_fold6(a6.b);
+      abtop_hit(shard->abtop, &key, &a6, cfg.now, 0, len6);
+    } else {
+      key.a = abtop_fold6(a6.a);
+      key.b = abtop_fold6(a6.b);
+      abtop_hit(shard->abtop, &key, &a6, cfg.now, len6, 0);
+    }
   }
 }
 
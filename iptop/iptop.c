@@ -7,60 +7,273 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
 #include <pcap.h>
 #include "iptop.h"
 
 struct iptop_conf cfg = {
   .snaplen = 65535,
-  .pcap_fd = -1,
+  .nthreads = 1,
   .dev = "eth0",
   .capbuf = (1024*1024),
+  .ring_block_sz = 1 << 22, /* as raw/rx-ring3.c, but 16 blocks per shard */
+  .ring_block_nr = 16,
+  .ring_frame_sz = 1 << 11,
   .display_interval = 2,
+  .cache_sz = 1000,
+  .top_sz = 10,
+  .tau = 10,
+  .publish_ms = 100,
+  .publish_fd = -1,
+  .shm_fd = -1,
 };
 
 
 void usage() {
   fprintf(stderr,"usage: %s [-v] -f <bpf-filter>                \n"
                  "               -i <eth>        (read from interface)\n"
+                 "               -r <file|dir>   (read pcap file(s), report speed)\n"
                  "               -B <cap-buf-sz> (capture buf size eg. 10m)\n"
+                 "               -R              (own TPACKET_V3 ring, not pcap)\n"
+                 "               -b <num-blocks> (ring blocks, default 16)\n"
+                 "               -S <block-size> (ring block size log2, 12-30, default 22)\n"
+                 "               -Z <frame-size> (ring max frame size, default 2048)\n"
                  "               -t <seconds>    (display interval)\n"
+                 "               -c <cache-sz>   (pairs tracked, default 1000)\n"
+                 "               -k <top-sz>     (pairs shown, default 10)\n"
+                 "               -p              (key on protocol and ports too)\n"
+                 "               -V              (key on vlan id too)\n"
+                 "               -e <seconds>    (rate time constant, default 10)\n"
+                 "               -T              (rank by total bytes, not rate)\n"
+                 "               -n <threads>    (capture threads, in a fanout)\n"
+                 "               -s <width>      (count-min sketch mode, eg. 64k)\n"
+                 "               -W              (also show 10s, 1m, 5m windows)\n"
+                 "               -F <sources>    (also show top fan-out, eg. 256k)\n"
+                 "               -H <percent>    (also show prefixes with this share)\n"
+                 "               -D              (prefixes by destination, not source)\n"
+                 "               -m <shm-name>   (publish top list to shm, eg. %s)\n"
+                 "               -P <ms>         (publish interval, default 100)\n"
+                 "               -L <file>       (append top lists to a history)\n"
                  "\n",
-          cfg.prog);
+          cfg.prog, TOP_SHM);
   exit(-1);
 }
 
 /* signals that we'll accept via signalfd in epoll */
 int sigs[] = {SIGHUP,SIGTERM,SIGINT,SIGQUIT,SIGALRM};
 
-void periodic_work() {
-  cfg.now = time(NULL);
-  if ((cfg.now % cfg.display_interval) == 0) show_abtop_top(cfg.abtop);
+/* ask each capture thread for a copy of its top list, and with all set,
+ * its window, fan-out and prefix lists too. the copy is made between batches, so
+ * shards are never read while they are being updated and the capture path
+ * takes no locks. returns the generation the copies are tagged with. */
+unsigned snap_shards(int all) {
+  unsigned gen;
+  int i, ms, ready;
+
+  cfg.snap_all = all;
+  __sync_synchronize();
+  gen = ++cfg.snap_gen;
+  for(ms=0; ms < 500; ms++) {
+    for(ready=0, i=0; i < cfg.nthreads; i++) ready += (cfg.shards[i].gen == gen);
+    if (ready == cfg.nthreads) break;
+    usleep(1000);
+  }
+  __sync_synchronize();
+  return gen;
 }
 
-int set_filter() {
-  if (cfg.filter == NULL) return 0;
+/* gather the shards' copies of their top lists into cfg.merge */
+int merge_shards(unsigned gen, double *err) {
+  struct shard *s;
+  int i, n;
 
-  int rc=-1;
-  if ( (rc = pcap_compile(cfg.pcap, &cfg.fp, cfg.filter, 0, PCAP_NETMASK_UNKNOWN)) != 0) {
-    fprintf(stderr, "error in filter expression: %s\n", cfg.err);
+  *err = 0;
+  for(n=0, i=0; i < cfg.nthreads; i++) {
+    s = &cfg.shards[i];
+    if (s->gen != gen) {
+      fprintf(stderr,"capture thread %d missed the snapshot\n", i);
+      continue;
+    }
+    memcpy(&cfg.merge[n], s->snap, s->nsnap * sizeof(ab_top_t));
+    n += s->nsnap;
+    if (s->err > *err) *err = s->err; /* a pair is only ever in one shard */
+  }
+  return n;
+}
+
+/* every shard sees some of each prefix's bytes; hhh_show sums them */
+void show_shards_hhh(unsigned gen) {
+  struct shard *s;
+  unsigned long total = 0;
+  int i, n;
+
+  for(n=0, i=0; i < cfg.nthreads; i++) {
+    s = &cfg.shards[i];
+    if (s->gen != gen) continue;
+    memcpy(&cfg.hmerge[n], s->hsnap, s->nhsnap * sizeof(hh_entry_t));
+    n += s->nhsnap;
+    total += s->htotal;
+  }
+  hhh_show(cfg.hmerge, n, total, cfg.hhh_pct);
+}
+
+void show_shards(void) {
+  struct shard *s;
+  unsigned gen = snap_shards(1);
+  int i, n, w;
+  double err;
+
+  n = merge_shards(gen, &err);
+  abtop_show(cfg.merge, n, cfg.top_sz, !cfg.by_total, NULL);
+  if (cfg.sketch_w) abtop_show_error(err, !cfg.by_total);
+
+  for(w=0; cfg.windows && (w < AB_NWIN); w++) {
+    for(n=0, i=0; i < cfg.nthreads; i++) {
+      s = &cfg.shards[i];
+      if (s->gen != gen) continue;
+      memcpy(&cfg.merge[n], &s->snap[(w+1) * cfg.top_sz], s->nwsnap[w] * sizeof(ab_top_t));
+      n += s->nwsnap[w];
+    }
+    abtop_show(cfg.merge, n, cfg.top_sz, 0, abtop_win_label[w]);
+  }
+
+  if (cfg.hhh_pct > 0) show_shards_hhh(gen);
+
+  /* a source's peers may be spread over shards; fanout_show merges them */
+  if (cfg.fanout_sz == 0) return;
+  for(n=0, i=0; i < cfg.nthreads; i++) {
+    s = &cfg.shards[i];
+    if (s->gen != gen) continue;
+    memcpy(&cfg.fmerge[n], s->fsnap, s->nfsnap * sizeof(fo_src_t));
+    n += s->nfsnap;
+  }
+  fanout_show(cfg.fmerge, n, cfg.top_sz);
+}
+
+/* the shards' top lists merged into cfg.merge, ranked low to high, with
+ * the sketch error bound. returns the count */
+int collect_top(double *err) {
+  abtop_t *t = cfg.shards[0].abtop;
+  int n;
+
+  if (cfg.nthreads > 1) n = merge_shards(snap_shards(0), err);
+  else {
+    n = abtop_top(t, cfg.now, cfg.merge);
+    *err = abtop_error(t, cfg.now);
+  }
+  return abtop_merge(cfg.merge, n, !cfg.by_total);
+}
+
+/* copy the top list and counters to shared memory (-m). the counters of
+ * other threads' shards are read as they stand; each is a single word */
+void publish(void) {
+  struct top_shm hdr;
+  struct timespec ts;
+  unsigned long r, d;
+  int i, n, k;
+
+  memset(&hdr, 0, sizeof(hdr));
+  n = collect_top(&hdr.err);
+  k = (n > cfg.top_sz) ? cfg.top_sz : n;
+
+  for(i=0; i < cfg.nthreads; i++) {
+    hdr.pkts += cfg.shards[i].pkts;
+    hdr.bytes += cfg.shards[i].bytes;
+    hdr.pairs += cfg.shards[i].abtop->count;
+    if (capture_stats(&cfg.shards[i], &r, &d) < 0) continue;
+    hdr.recv += r;
+    hdr.drop += d;
+  }
+  clock_gettime(CLOCK_REALTIME, &ts);
+  hdr.published = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+  hdr.by_rate = !cfg.by_total;
+  hdr.nthreads = cfg.nthreads;
+  top_publish(cfg.shm, &hdr, &cfg.merge[n - k], k);
+}
+
+/* append the top list as of now to the history (-L); see toplog.c */
+void record_top(int wait) {
+  double err;
+  int n = collect_top(&err);
+  log_top(cfg.now, cfg.merge, n, wait);
+}
+
+int setup_shm(void) {
+  struct itimerspec it;
+  int rc = -1;
+
+  cfg.shm_fd = shm_open(cfg.shm_name, O_RDWR|O_CREAT, 0644);
+  if (cfg.shm_fd == -1) {
+    fprintf(stderr,"shm_open %s: %s\n", cfg.shm_name, strerror(errno));
+    goto done;
+  }
+  if (ftruncate(cfg.shm_fd, sizeof(struct top_shm)) == -1) {
+    fprintf(stderr,"ftruncate: %s\n", strerror(errno));
+    goto done;
+  }
+  cfg.shm = mmap(NULL, sizeof(struct top_shm), PROT_READ|PROT_WRITE,
+                 MAP_SHARED, cfg.shm_fd, 0);
+  if (cfg.shm == MAP_FAILED) {
+    fprintf(stderr,"mmap: %s\n", strerror(errno));
+    cfg.shm = NULL;
+    goto done;
+  }
+  memset(cfg.shm, 0, sizeof(struct top_shm));
+  cfg.shm->entry_sz = sizeof(ab_top_t);
+  cfg.shm->magic = TOP_MAGIC;
+
+  /* publishing runs off its own timer, in the main thread */
+  cfg.publish_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (cfg.publish_fd == -1) {
+    fprintf(stderr,"timerfd_create: %s\n", strerror(errno));
     goto done;
   }
-  if ( (rc = pcap_setfilter(cfg.pcap, &cfg.fp)) != 0) {
-    fprintf(stderr, "can't set filter expression: %s\n", cfg.err);
+  it.it_value.tv_sec = it.it_interval.tv_sec = cfg.publish_ms / 1000;
+  it.it_value.tv_nsec = it.it_interval.tv_nsec = (cfg.publish_ms % 1000) * 1000000;
+  if (timerfd_settime(cfg.publish_fd, 0, &it, NULL) == -1) {
+    fprintf(stderr,"timerfd_settime: %s\n", strerror(errno));
     goto done;
   }
-  rc=0;
+  rc = 0;
 
  done:
   return rc;
 }
 
+int handle_publish(void) {
+  uint64_t n;
+  if (read(cfg.publish_fd, &n, sizeof(n)) != sizeof(n)) return 0; /* spurious */
+  publish();
+  return 0;
+}
+
+void periodic_work() {
+  cfg.now = time(NULL);
+  if ((cfg.now % cfg.display_interval) != 0) return;
+  if (cfg.nthreads > 1) show_shards();
+  else {
+    show_abtop_top(cfg.shards[0].abtop, cfg.now);
+    if (cfg.shards[0].hhh) show_hhh_top(cfg.shards[0].hhh, cfg.hhh_pct);
+    if (cfg.shards[0].fanout) show_fanout_top(cfg.shards[0].fanout);
+  }
+  if (cfg.log_file) record_top(0);
+}
+
 void do_stats(void) {
-  struct pcap_stat ps;
+  unsigned long recv=0, drop=0, r, d;
+  int i;
   if (cfg.verbose == 0 ) return;
-  if (pcap_stats(cfg.pcap,&ps)<0) {fprintf(stderr,"pcap_stat error\n"); return;}
-  fprintf(stderr,"received : %u\n", ps.ps_recv);
-  fprintf(stderr,"dropped: %u\n", ps.ps_drop);
+  for(i=0; i < cfg.nthreads; i++) {
+    if (capture_stats(&cfg.shards[i], &r, &d) < 0) return;
+    recv += r;
+    drop += d;
+  }
+  fprintf(stderr,"received : %lu\n", recv);
+  fprintf(stderr,"dropped: %lu\n", drop);
 }
 
 int new_epoll(int events, int fd) {
@@ -88,6 +301,7 @@ int handle_signal() {
 
   switch(info.ssi_signo) {
     case SIGALRM: 
+      if (cfg.ring && (cfg.nthreads == 1)) get_capture_data(&cfg.shards[0]);
       periodic_work();
       if ((++cfg.ticks % 10) == 0) do_stats();
       alarm(1); 
@@ -104,17 +318,35 @@ int handle_signal() {
   return rc;
 }
 
-int get_pcap_data() {
-  int rc=-1;
+/* capture thread, each with its own pcap handle and abtop shard. the
+ * kernel fanout hashes on the flow, both directions alike, so a given
+ * pair is always counted in the same shard. */
+void *capture(void *arg) {
+  struct shard *s = arg;
+  struct pollfd pfd = { .fd = s->fd, .events = POLLIN };
+  unsigned gen;
+  int w;
 
-  if (pcap_dispatch(cfg.pcap, 10000,cb,NULL) < 0) {
-    pcap_perror(cfg.pcap, "pcap error: "); 
-    goto done;
+  while (!cfg.stop) {
+    gen = cfg.snap_gen;
+    if (s->gen != gen) { /* display or publisher wants our top list */
+      __sync_synchronize(); /* snap_all was set before snap_gen */
+      s->nsnap = abtop_top(s->abtop, cfg.now, s->snap);
+      s->err = abtop_error(s->abtop, cfg.now);
+      for(w=0; cfg.snap_all && cfg.windows && (w < AB_NWIN); w++)
+        s->nwsnap[w] = abtop_top_win(s->abtop, cfg.now, w, &s->snap[(w+1) * cfg.top_sz]);
+      if (cfg.snap_all && s->fanout) s->nfsnap = fanout_top(s->fanout, s->fsnap);
+      if (cfg.snap_all && s->hhh) s->nhsnap = hhh_top(s->hhh, s->hsnap, &s->htotal);
+      __sync_synchronize();
+      s->gen = gen;
+    }
+    if ((poll(&pfd, 1, 100) <= 0) && (s->map == NULL)) continue; /* rings: see capture.c */
+    if (get_capture_data(s) < 0) {
+      kill(getpid(), SIGTERM); /* have the main thread shut down */
+      break;
+    }
   }
-  rc = 0;
-
- done:
-  return rc;
+  return NULL;
 }
 
 /* parse a suffixed number like 1m (one megabyte) */
@@ -143,24 +375,103 @@ int parse_kmg(char *str) {
 
 int main(int argc, char *argv[]) {
   struct epoll_event ev;
+  struct shard *s;
   cfg.prog = argv[0];
-  utstring_new(cfg.label);
-  cfg.abtop = abtop_new(1000,10);
   cfg.now = time(NULL);
-  int n,opt;
+  int n,opt,hhh_m;
 
-  while ( (opt=getopt(argc,argv,"vB:f:i:t:h")) != -1) {
+  while ( (opt=getopt(argc,argv,"vB:Rb:S:Z:f:i:r:t:c:k:pVe:Tn:s:WF:H:Dm:P:L:h")) != -1) {
     switch(opt) {
       case 'v': cfg.verbose++; break;
       case 'f': cfg.filter=strdup(optarg); break; 
       case 'i': cfg.dev=strdup(optarg); break; 
+      case 'r': cfg.file=strdup(optarg); break; 
       case 'B': cfg.capbuf=parse_kmg(optarg); break; 
+      case 'R': cfg.ring=1; break; 
+      case 'b': cfg.ring_block_nr=atoi(optarg); break; 
+      case 'S': n = atoi(optarg); /* 4k .. 1g; 1 << 31 and up is undefined */
+                if ((n < 12) || (n > 30)) usage();
+                cfg.ring_block_sz = 1U << n; break; 
+      case 'Z': cfg.ring_frame_sz=atoi(optarg); break; 
       case 't': cfg.display_interval=atoi(optarg); break; 
+      case 'c': cfg.cache_sz=atoi(optarg); break; 
+      case 'k': cfg.top_sz=atoi(optarg); break; 
+      case 'p': cfg.ports=1; break; 
+      case 'V': cfg.vlans=1; break; 
+      case 'e': cfg.tau=atof(optarg); break; 
+      case 'T': cfg.by_total=1; break; 
+      case 'n': cfg.nthreads=atoi(optarg); break; 
+      case 's': cfg.sketch_w=parse_kmg(optarg); break; 
+      case 'W': cfg.windows=1; break; 
+      case 'F': cfg.fanout_sz=parse_kmg(optarg); break; 
+      case 'H': cfg.hhh_pct=atof(optarg); break; 
+      case 'D': cfg.hhh_dst=1; break; 
+      case 'm': cfg.shm_name=strdup(optarg); break; 
+      case 'P': cfg.publish_ms=atoi(optarg); break; 
+      case 'L': cfg.log_file=strdup(optarg); break; 
       case 'h': default: usage(); break;
     }
   }
 
   if (cfg.capbuf == -1) goto done; // syntax error 
+  if ((cfg.cache_sz < 1) || (cfg.top_sz < 1) || (cfg.tau <= 0)) usage();
+  if (cfg.nthreads < 1) usage();
+  if (cfg.file && (cfg.nthreads > 1)) usage();
+  if (cfg.publish_ms < 1) usage();
+  if ((cfg.ring_block_nr < 1) || (cfg.ring_frame_sz < 1)) usage();
+  if (cfg.ring_block_sz % cfg.ring_frame_sz) {
+    fprintf(stderr,"-S block size must be a multiple of -Z frame size\n");
+    usage();
+  }
+  if (cfg.sketch_w == -1) goto done;
+  if (cfg.fanout_sz == -1) goto done;
+  if ((cfg.hhh_pct < 0) || (cfg.hhh_pct > 100)) usage();
+  /* counters per prefix length, so a count errs by a tenth of the threshold */
+  hhh_m = (cfg.hhh_pct > 0) ? (int)(1000 / cfg.hhh_pct) + 1 : 0;
+
+  /* one abtop shard per capture thread; each sized as if it were alone */
+  cfg.shards = calloc(cfg.nthreads, sizeof(struct shard));
+  cfg.merge = malloc(cfg.nthreads * cfg.top_sz * sizeof(ab_top_t));
+  cfg.fmerge = malloc(cfg.nthreads * cfg.top_sz * sizeof(fo_src_t));
+  cfg.hmerge = malloc(cfg.nthreads * HHH_LEVELS * hhh_m * sizeof(hh_entry_t));
+  if ((cfg.shards == NULL) || (cfg.merge == NULL) || (cfg.fmerge == NULL) ||
+      (hhh_m && (cfg.hmerge == NULL))) {
+    fprintf(stderr,"out of memory\n");
+    goto done;
+  }
+  for(n=0; n < cfg.nthreads; n++) {
+    s = &cfg.shards[n];
+    s->abtop = abtop_new(cfg.cache_sz, cfg.top_sz, cfg.tau, !cfg.by_total);
+    s->snap = malloc((AB_NWIN + 1) * cfg.top_sz * sizeof(ab_top_t));
+    if ((s->abtop == NULL) || (s->snap == NULL) ||
+        (cfg.sketch_w && abtop_sketch(s->abtop, cfg.sketch_w, CM_DEPTH)) ||
+        (cfg.windows && abtop_windows(s->abtop))) {
+      fprintf(stderr,"out of memory\n");
+      goto done;
+    }
+    if (hhh_m) {
+      s->hhh = hhh_new(hhh_m);
+      s->hsnap = malloc(HHH_LEVELS * hhh_m * sizeof(hh_entry_t));
+      if ((s->hhh == NULL) || (s->hsnap == NULL)) {
+        fprintf(stderr,"out of memory\n");
+        goto done;
+      }
+    }
+    if (cfg.fanout_sz == 0) continue;
+    s->fanout = fanout_new(cfg.fanout_sz, cfg.top_sz);
+    s->fsnap = malloc(cfg.top_sz * sizeof(fo_src_t));
+    if ((s->fanout == NULL) || (s->fsnap == NULL)) {
+      fprintf(stderr,"out of memory\n");
+      goto done;
+    }
+  }
+
+  if (cfg.log_file && (log_open() < 0)) goto done;
+
+  if (cfg.file) {
+    read_offline(&cfg.shards[0]);
+    goto done;
+  }
 
   /* block all signals. we take signals synchronously via signalfd */
   sigset_t all;
@@ -188,33 +499,62 @@ int main(int argc, char *argv[]) {
 
   /* add descriptors of interest */
   if (new_epoll(EPOLLIN, cfg.signal_fd))   goto done; // signal socket
+  if (cfg.shm_name) {
+    if (setup_shm() < 0) goto done;
+    if (new_epoll(EPOLLIN, cfg.publish_fd)) goto done;
+  }
 
-  /* open capture interface and get underlying descriptor */
-  if ( (cfg.pcap = pcap_create(cfg.dev, cfg.err)) == NULL) {
-    fprintf(stderr,"can't open %s: %s\n", cfg.dev, cfg.err); 
-    goto done;
+  for(n=0; n < cfg.nthreads; n++) {
+    if (open_capture(&cfg.shards[n]) < 0) goto done;
+  }
+
+  /* a single shard is captured right here; more get their own threads,
+   * which inherit our blocked signal mask */
+  if (cfg.nthreads == 1) {
+    if (new_epoll(EPOLLIN, cfg.shards[0].fd)) goto done;
+  } else {
+    for(n=0; n < cfg.nthreads; n++) {
+      s = &cfg.shards[n];
+      if (pthread_create(&s->tid, NULL, capture, s)) {
+        fprintf(stderr,"pthread_create failed\n");
+        goto done;
+      }
+      s->started = 1;
+    }
   }
-  set_filter();
-  if (pcap_set_promisc(cfg.pcap, 1))              {fprintf(stderr,"pcap_set_promisc failed\n"); goto done;}
-  if (pcap_set_snaplen(cfg.pcap, cfg.snaplen))    {fprintf(stderr,"pcap_set_snaplen failed\n"); goto done;}
-  if (pcap_set_buffer_size(cfg.pcap, cfg.capbuf)) {fprintf(stderr,"pcap_set_buf_size failed\n");goto done;}
-  if (pcap_activate(cfg.pcap))                    {fprintf(stderr,"pcap_activate failed\n");    goto done; }
-  cfg.pcap_fd = pcap_get_selectable_fd(cfg.pcap);
-  if (cfg.pcap_fd == -1)                          {fprintf(stderr,"pcap_get_sel_fd failed\n");  goto done;}
-  if (new_epoll(EPOLLIN, cfg.pcap_fd)) goto done;
 
   alarm(1);
 
   while (epoll_wait(cfg.epoll_fd, &ev, 1, -1) > 0) {
     if (cfg.verbose > 1)  fprintf(stderr,"epoll reports fd %d\n", ev.data.fd);
     if      (ev.data.fd == cfg.signal_fd)   { if (handle_signal() < 0) goto done; }
-    else if (ev.data.fd == cfg.pcap_fd)     { if (get_pcap_data() < 0) goto done; }
+    else if (ev.data.fd == cfg.publish_fd)  { if (handle_publish() < 0) goto done; }
+    else if (ev.data.fd == cfg.shards[0].fd){ if (get_capture_data(&cfg.shards[0]) < 0) goto done; }
   }
 
 done:
-  if (cfg.pcap) pcap_close(cfg.pcap);
-  if (cfg.pcap_fd > 0) close(cfg.pcap_fd);
-  utstring_free(cfg.label);
-  abtop_free(cfg.abtop);
+  cfg.stop = 1;
+  log_close();
+  for(n=0; cfg.shards && (n < cfg.nthreads); n++) {
+    s = &cfg.shards[n];
+    if (s->started) pthread_join(s->tid, NULL);
+    close_capture(s);
+    if (s->abtop) abtop_free(s->abtop);
+    if (s->fanout) fanout_free(s->fanout);
+    if (s->hhh) hhh_free(s->hhh);
+    free(s->snap);
+    free(s->fsnap);
+    free(s->hsnap);
+  }
+  free(cfg.shards);
+  if (cfg.shm) munmap(cfg.shm, sizeof(struct top_shm));
+  if (cfg.shm_fd != -1) {
+    close(cfg.shm_fd);
+    shm_unlink(cfg.shm_name);
+  }
+  if (cfg.publish_fd != -1) close(cfg.publish_fd);
+  free(cfg.merge);
+  free(cfg.fmerge);
+  free(cfg.hmerge);
   return 0;
 }
@@ -12,28 +12,111 @@
 #include <string.h>
 #include <pcap.h>
 #include <time.h>
+#include <pthread.h>
+#include <linux/if_packet.h>
 #include "abtop.h"
+#include "fanout.h"
+#include "hhh.h"
+#include "top_shm.h"
+#include "top_log.h"
+
+#define CM_DEPTH 4 /* sketch rows; overestimate bound holds with 1-e^-4 */
 
 void cb(u_char *data, const struct pcap_pkthdr *hdr, const u_char *pkt);
 
+/* a capture handle and the abtop it feeds. with -n each runs in its own
+ * thread; the display asks for a copy of the top list by bumping snap_gen
+ * and the thread answers, between batches, by setting gen to match. */
+struct shard {
+  pthread_t tid;
+  int started;
+  pcap_t *pcap;     /* or, with -R, the ring below */
+  int fd;
+  uint8_t *map;     /* TPACKET_V3 ring, see capture.c */
+  size_t map_len;
+  struct tpacket_req3 req;
+  unsigned cur;     /* the block we expect the kernel to fill next */
+  unsigned long recv; /* ring statistics, which the kernel resets on read */
+  unsigned long drop;
+  uint16_t vid;     /* with -R -V, the vlan id the kernel took off this frame */
+  unsigned long pkts;  /* frames seen by cb(), all kinds */
+  unsigned long bytes;
+  abtop_t *abtop;
+  fanout_t *fanout;
+  fo_src_t *fsnap;
+  int nfsnap;
+  hhh_t *hhh;
+  hh_entry_t *hsnap;
+  int nhsnap;
+  unsigned long htotal; /* bytes counted into hhh, as of the copy */
+  ab_top_t *snap;  /* top list, then one per window */
+  int nsnap;
+  int nwsnap[AB_NWIN];
+  double err;   /* sketch error bound as of the copy */
+  volatile unsigned gen;
+};
+
 struct iptop_conf {
   int verbose;
   char *prog;
   char *dev;
   char *filter;
-  int pcap_fd;
-  pcap_t *pcap;
-  struct bpf_program fp;
+  char *file;
   char err[PCAP_ERRBUF_SIZE];
   int snaplen;
   int ticks;
   int signal_fd;
   int epoll_fd;
   int capbuf;
+  int ring;
+  unsigned ring_block_sz;
+  unsigned ring_block_nr;
+  unsigned ring_frame_sz;
   time_t now;
   int display_interval;
-  UT_string *label;
-  abtop_t *abtop;
+  int cache_sz;
+  int top_sz;
+  int ports;
+  int vlans;
+  double tau;
+  int by_total;
+  int nthreads;
+  int sketch_w;
+  int windows;
+  int fanout_sz;
+  fo_src_t *fmerge;
+  double hhh_pct;
+  int hhh_dst;
+  hh_entry_t *hmerge;
+  struct shard *shards;
+  ab_top_t *merge;  /* the shards' top lists, together */
+  volatile unsigned snap_gen;
+  volatile int snap_all;  /* the display wants windows and fan-out too */
+  char *shm_name;
+  int publish_ms;
+  int publish_fd;
+  int shm_fd;
+  struct top_shm *shm;
+  char *log_file;
+  volatile int stop;
 };
 
+/* iptop.c */
+int collect_top(double *err);
+void record_top(int wait);
+
+/* capture.c */
+int open_capture(struct shard *s);
+int get_capture_data(struct shard *s);
+int capture_stats(struct shard *s, unsigned long *recv, unsigned long *drop);
+void close_capture(struct shard *s);
+
+/* offline.c */
+int read_offline(struct shard *s);
+
+/* toplog.c */
+int log_open(void);
+void log_top(time_t t, const ab_top_t *top, int n, int wait);
+void log_close(void);
+
 #endif
@@ -0,0 +1,257 @@
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include "top_shm.h"
+#include "top_log.h"
+
+/*
+ * print the top list and counters that iptop -m publishes.
+ * the segment is mapped read-only; no syscall reaches iptop.
+ *
+ *  ./iptop_read               (once)
+ *  ./iptop_read -t 500        (every 500ms)
+ *
+ * or, with -l, answer from the history that iptop -L keeps: the top
+ * talkers between two times, over the records between them.
+ *
+ *  ./iptop_read -l top.log -a -3600          (the last hour)
+ *  ./iptop_read -l top.log -a 09:00 -b 09:30 (today, local time)
+ */
+
+struct {
+  int verbose;
+  char *prog;
+  char *shm_name;
+  int interval_ms;
+  struct top_shm *shm;
+  struct top_shm cur;
+  struct top_shm prev;
+  char *log_file;
+  int64_t from;
+  int64_t to;
+  int top_sz;
+} cfg = {
+  .shm_name = TOP_SHM,
+  .to = INT64_MAX,
+};
+
+void usage() {
+  fprintf(stderr,"usage: %s [-v] [-n <shm-name>] [-t <ms>]\n"
+                 "       %s [-v] -l <file> [-a <time>] [-b <time>] [-k <top-sz>]\n"
+                 "          time: unix seconds, -<seconds> ago, or hh:mm[:ss] today\n",
+          cfg.prog, cfg.prog);
+  exit(-1);
+}
+
+int64_t parse_time(char *s) {
+  struct tm tm;
+  time_t now = time(NULL);
+  int h, m, sec = 0;
+
+  if (*s == '-') return now - atol(s + 1);
+  if (strchr(s, ':')) {
+    if (sscanf(s, "%d:%d:%d", &h, &m, &sec) < 2) usage();
+    localtime_r(&now, &tm);
+    tm.tm_hour = h;
+    tm.tm_min = m;
+    tm.tm_sec = sec;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+  }
+  return atoll(s);
+}
+
+/* first record at or after t, among n sorted times */
+static uint64_t lower_bound(const int64_t *idx, uint64_t n, int64_t t) {
+  uint64_t lo = 0, hi = n, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (idx[mid] < t) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * the top talkers from cfg.from to cfg.to. the records in range are found
+ * by binary search of the index, and only their pages of the history are
+ * read. a pair's rate over the range is the mean of its rate in each
+ * record, counting the records it is absent from as zero, and its bytes
+ * are that rate over the records' span. so a pair in the top list for the
+ * whole range ranks above a brief burst, which it would not by peak rate.
+ */
+int query_log(void) {
+  struct top_log_hdr *h;
+  struct top_log_rec *r;
+  struct stat sb, isb;
+  uint8_t *map = NULL;
+  int64_t *idx = NULL;
+  char idx_name[1024], tbuf[2][32];
+  uint64_t nrec, a, b, i;
+  ab_top_t *top = NULL;
+  struct timespec t0, t1;
+  time_t t;
+  double span;
+  int fd = -1, idx_fd = -1, rc = -1, n = 0, j, k;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  snprintf(idx_name, sizeof(idx_name), "%s.idx", cfg.log_file);
+  if ( (fd = open(cfg.log_file, O_RDONLY)) == -1) {
+    fprintf(stderr,"open %s: %s\n", cfg.log_file, strerror(errno));
+    goto done;
+  }
+  if ( (idx_fd = open(idx_name, O_RDONLY)) == -1) {
+    fprintf(stderr,"open %s: %s\n", idx_name, strerror(errno));
+    goto done;
+  }
+  if ((fstat(fd, &sb) == -1) || (fstat(idx_fd, &isb) == -1)) {
+    fprintf(stderr,"fstat: %s\n", strerror(errno));
+    goto done;
+  }
+  if ((sb.st_size < TOP_LOG_HDR) || (isb.st_size < (off_t)sizeof(int64_t))) {
+    fprintf(stderr,"%s: empty\n", cfg.log_file);
+    goto done;
+  }
+  map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  idx = mmap(NULL, isb.st_size, PROT_READ, MAP_SHARED, idx_fd, 0);
+  if ((map == MAP_FAILED) || (idx == MAP_FAILED)) {
+    fprintf(stderr,"mmap: %s\n", strerror(errno));
+    goto done;
+  }
+  h = (struct top_log_hdr*)map;
+  if ((h->magic != TOP_LOG_MAGIC) || (h->entry_sz != sizeof(ab_top_t)) ||
+      (h->rec_sz != top_log_rec_sz(h->top_sz))) {
+    fprintf(stderr,"%s: not an iptop history of this version\n", cfg.log_file);
+    goto done;
+  }
+
+  /* only what the writer had finished, and both files have room for */
+  nrec = h->nrec;
+  if ((sb.st_size - TOP_LOG_HDR) / h->rec_sz < nrec) nrec = (sb.st_size - TOP_LOG_HDR) / h->rec_sz;
+  if (isb.st_size / sizeof(int64_t) < nrec) nrec = isb.st_size / sizeof(int64_t);
+  a = lower_bound(idx, nrec, cfg.from);
+  b = lower_bound(idx, nrec, (cfg.to == INT64_MAX) ? cfg.to : cfg.to + 1);
+  if (a == b) {
+    printf("no records in range, of %lu\n", (unsigned long)nrec);
+    rc = 0;
+    goto done;
+  }
+
+  top = malloc((b - a) * h->top_sz * sizeof(ab_top_t));
+  if (top == NULL) {
+    fprintf(stderr,"out of memory\n");
+    goto done;
+  }
+  for(i=a; i < b; i++) {
+    r = (struct top_log_rec*)(map + TOP_LOG_HDR + i * h->rec_sz);
+    k = (r->ntop > h->top_sz) ? h->top_sz : r->ntop;
+    memcpy(&top[n], r->top, k * sizeof(ab_top_t));
+    if (cfg.verbose > 1) { /* each record, in our copy: the map is read-only */
+      t = r->t;
+      strftime(tbuf[0], sizeof(tbuf[0]), "%F %T", localtime(&t));
+      abtop_show(&top[n], k, k, 1, tbuf[0]);
+    }
+    n += k;
+  }
+  n = abtop_merge(top, n, 1);
+  span = (double)(b - a) * h->interval;
+  for(j=0; j < n; j++) {
+    top[j].rate /= (b - a);
+    top[j].count = top[j].rate * span / 8;
+  }
+
+  t = idx[a];
+  strftime(tbuf[0], sizeof(tbuf[0]), "%F %T", localtime(&t));
+  t = idx[b-1];
+  strftime(tbuf[1], sizeof(tbuf[1]), "%F %T", localtime(&t));
+  printf("%s to %s: %lu records of %lu\n", tbuf[0], tbuf[1],
+    (unsigned long)(b - a), (unsigned long)nrec);
+  abtop_show(top, n, cfg.top_sz ? cfg.top_sz : (int)h->top_sz, 1, "hist");
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (cfg.verbose) fprintf(stderr,"query took %.3f ms\n",
+    (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+  rc = 0;
+
+ done:
+  if (map && (map != MAP_FAILED)) munmap(map, sb.st_size);
+  if (idx && (idx != MAP_FAILED)) munmap(idx, isb.st_size);
+  if (fd != -1) close(fd);
+  if (idx_fd != -1) close(idx_fd);
+  free(top);
+  return rc;
+}
+
+/* counters, and with an interval, their rates since the last read */
+void show_counters(struct top_shm *c, struct top_shm *p) {
+  double secs = (p && (c->published > p->published)) ?
+                (c->published - p->published) / 1000.0 : 0;
+
+  printf("published %lu.%03lu threads %u pairs %lu\n",
+    (unsigned long)(c->published / 1000), (unsigned long)(c->published % 1000),
+    c->nthreads, (unsigned long)c->pairs);
+  printf("frames %lu bytes %lu received %lu dropped %lu\n",
+    (unsigned long)c->pkts, (unsigned long)c->bytes,
+    (unsigned long)c->recv, (unsigned long)c->drop);
+  if (secs > 0) printf("frames/s %.0f bits/s %.0f drops/s %.0f\n",
+    (c->pkts - p->pkts) / secs, (c->bytes - p->bytes) * 8 / secs,
+    (c->drop - p->drop) / secs);
+}
+
+int main(int argc, char *argv[]) {
+  int fd = -1, opt, rc = -1;
+  cfg.prog = argv[0];
+
+  while ( (opt=getopt(argc,argv,"vn:t:l:a:b:k:h")) != -1) {
+    switch(opt) {
+      case 'v': cfg.verbose++; break;
+      case 'n': cfg.shm_name=strdup(optarg); break;
+      case 't': cfg.interval_ms=atoi(optarg); break;
+      case 'l': cfg.log_file=strdup(optarg); break;
+      case 'a': cfg.from=parse_time(optarg); break;
+      case 'b': cfg.to=parse_time(optarg); break;
+      case 'k': cfg.top_sz=atoi(optarg); break;
+      case 'h': default: usage(); break;
+    }
+  }
+
+  if (cfg.log_file) return query_log();
+
+  if ( (fd = shm_open(cfg.shm_name, O_RDONLY, 0)) == -1) {
+    fprintf(stderr,"shm_open %s: %s\n", cfg.shm_name, strerror(errno));
+    goto done;
+  }
+  cfg.shm = mmap(NULL, sizeof(struct top_shm), PROT_READ, MAP_SHARED, fd, 0);
+  if (cfg.shm == MAP_FAILED) {
+    fprintf(stderr,"mmap: %s\n", strerror(errno));
+    cfg.shm = NULL;
+    goto done;
+  }
+  if ((cfg.shm->magic != TOP_MAGIC) || (cfg.shm->entry_sz != sizeof(ab_top_t))) {
+    fprintf(stderr,"%s: not an iptop segment of this version\n", cfg.shm_name);
+    goto done;
+  }
+
+  top_snapshot(cfg.shm, &cfg.prev);
+  do {
+    if (cfg.interval_ms) usleep(cfg.interval_ms * 1000);
+    top_snapshot(cfg.shm, &cfg.cur);
+    show_counters(&cfg.cur, cfg.interval_ms ? &cfg.prev : NULL);
+    /* already merged and ranked; abtop_show prints them the way iptop does */
+    abtop_show(cfg.cur.top, cfg.cur.ntop, cfg.cur.ntop, cfg.cur.by_rate, NULL);
+    if (cfg.cur.err > 0) abtop_show_error(cfg.cur.err, cfg.cur.by_rate);
+    fflush(stdout);
+    cfg.prev = cfg.cur;
+  } while (cfg.interval_ms);
+  rc = 0;
+
+ done:
+  if (cfg.shm) munmap(cfg.shm, sizeof(struct top_shm));
+  if (fd != -1) close(fd);
+  return rc;
+}
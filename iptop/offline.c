@@ -0,0 +1,224 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <byteswap.h>
+#include <limits.h>
+#include "iptop.h"
+
+extern struct iptop_conf cfg;
+
+/*
+ * offline mode: iptop -r <file.pcap | directory>
+ *
+ * each capture file is mapped and its records handed straight to cb(),
+ * with no libpcap and no copying, as fast as the decode and accounting
+ * go. a directory is read file by file in name order, which for the
+ * usual rotated archives is time order. the clock iptop keeps (cfg.now)
+ * follows the packet timestamps, so rates and windows come out as they
+ * were at capture time, and the top list at the end is as of the last
+ * packet.
+ *
+ * each file is walked twice. the first walk decodes only (a shard with
+ * no abtop, see ip.c); the second decodes and accounts. their difference
+ * is the cost of abtop_hit and fanout_hit, reported per packet along with
+ * the decode cost, so changes to ip.c or abtop.c can be measured on the
+ * same input. the file is mapped with MAP_POPULATE so page faults fall
+ * outside both walks.
+ *
+ * with -L the history gets a record at each display interval of packet
+ * time, so an archive can be loaded into it after the fact. the time
+ * taken to make the records is not counted in the figures.
+ *
+ * classic pcap files only (microsecond or nanosecond, either byte order)
+ * with ethernet link type; pcapng and other link types are skipped.
+ */
+
+#define PCAP_MAGIC      0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_MAX_REC    (256*1024)  /* larger caplen means a corrupt file */
+
+static time_t log_next; /* packet time of the next history record */
+static uint64_t log_ns;  /* spent recording them, left out of the figures */
+
+struct offline_stats {
+  int files;
+  unsigned long pkts;
+  unsigned long bytes;
+  uint64_t decode_ns;
+  uint64_t total_ns;
+  time_t first;
+  time_t last;
+};
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* hand each record in the mapped file to cb(). returns records walked */
+static unsigned long walk(struct shard *s, const uint8_t *map, size_t len,
+                          int swap, int nsec, unsigned long *bytes) {
+  struct pcap_pkthdr hdr;
+  uint32_t rec[4]; /* ts_sec, ts_frac, caplen, len */
+  unsigned long n = 0;
+  size_t off = 24;
+  uint64_t t;
+
+  while (off + sizeof(rec) <= len) {
+    memcpy(rec, map + off, sizeof(rec));
+    if (swap) {
+      rec[0] = bswap_32(rec[0]); rec[1] = bswap_32(rec[1]);
+      rec[2] = bswap_32(rec[2]); rec[3] = bswap_32(rec[3]);
+    }
+    if ((rec[2] > PCAP_MAX_REC) || (off + sizeof(rec) + rec[2] > len)) break;
+    hdr.ts.tv_sec = rec[0];
+    hdr.ts.tv_usec = nsec ? (rec[1] / 1000) : rec[1];
+    hdr.caplen = rec[2];
+    hdr.len = rec[3];
+    cfg.now = hdr.ts.tv_sec;
+    if (cfg.log_file && s->abtop && (cfg.now >= log_next)) {
+      if (log_next) { /* as of just before this packet */
+        t = now_ns();
+        record_top(1);
+        log_ns += now_ns() - t;
+      }
+      log_next = (cfg.now / cfg.display_interval + 1) * cfg.display_interval;
+    }
+    cb((u_char*)s, &hdr, map + off + sizeof(rec));
+    *bytes += hdr.len;
+    off += sizeof(rec) + rec[2];
+    n++;
+  }
+  if ((off != len) && s->abtop) /* once, not for the decode-only walk too */
+    fprintf(stderr,"truncated or corrupt record at offset %zu\n", off);
+  return n;
+}
+
+static int read_file(struct shard *s, char *file, struct offline_stats *st) {
+  struct shard decode_only;
+  struct stat sb;
+  uint8_t *map = NULL;
+  uint32_t magic, linktype;
+  unsigned long n, bytes = 0;
+  int fd = -1, rc = -1, swap, nsec;
+  uint64_t t0, t1, t2;
+
+  if ( (fd = open(file, O_RDONLY)) == -1) {
+    fprintf(stderr,"open %s: %s\n", file, strerror(errno));
+    goto done;
+  }
+  if (fstat(fd, &sb) == -1) {
+    fprintf(stderr,"fstat %s: %s\n", file, strerror(errno));
+    goto done;
+  }
+  if (sb.st_size < 24) {
+    fprintf(stderr,"%s: not a pcap file, skipped\n", file);
+    rc = 0;
+    goto done;
+  }
+  map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr,"mmap %s: %s\n", file, strerror(errno));
+    map = NULL;
+    goto done;
+  }
+  madvise(map, sb.st_size, MADV_SEQUENTIAL);
+
+  memcpy(&magic, map, sizeof(magic));
+  memcpy(&linktype, map + 20, sizeof(linktype));
+  swap = (magic == bswap_32(PCAP_MAGIC)) || (magic == bswap_32(PCAP_MAGIC_NSEC));
+  if (swap) { magic = bswap_32(magic); linktype = bswap_32(linktype); }
+  nsec = (magic == PCAP_MAGIC_NSEC);
+  if ((magic != PCAP_MAGIC) && (magic != PCAP_MAGIC_NSEC)) {
+    fprintf(stderr,"%s: not a pcap file, skipped\n", file);
+    rc = 0;
+    goto done;
+  }
+  if ((linktype & 0xffff) != DLT_EN10MB) {
+    fprintf(stderr,"%s: link type %u is not ethernet, skipped\n", file, linktype);
+    rc = 0;
+    goto done;
+  }
+
+  memset(&decode_only, 0, sizeof(decode_only));
+  t0 = now_ns();
+  walk(&decode_only, map, sb.st_size, swap, nsec, &bytes);
+  t1 = now_ns();
+  bytes = 0;
+  log_ns = 0;
+  n = walk(s, map, sb.st_size, swap, nsec, &bytes);
+  t2 = now_ns() - log_ns;
+
+  if (cfg.verbose) fprintf(stderr,"%s: %lu packets\n", file, n);
+  if ((st->pkts == 0) && n) { /* the first file with packets */
+    memcpy(&magic, map + 24, sizeof(magic)); /* first record's ts_sec */
+    st->first = swap ? bswap_32(magic) : magic;
+  }
+  st->files++;
+  st->pkts += n;
+  st->bytes += bytes;
+  st->decode_ns += t1 - t0;
+  st->total_ns += t2 - t1;
+  st->last = cfg.now;
+  rc = 0;
+
+ done:
+  if (map) munmap(map, sb.st_size);
+  if (fd != -1) close(fd);
+  return rc;
+}
+
+static void report(struct offline_stats *st) {
+  double pkts = st->pkts ? st->pkts : 1;
+  double decode = st->decode_ns / pkts, total = st->total_ns / pkts;
+
+  printf(" files %d, packets %lu, bytes %lu, %ld seconds of traffic\n",
+    st->files, st->pkts, st->bytes, (long)(st->last - st->first));
+  printf(" decode     %6.1f ns/packet\n", decode);
+  printf(" accounting %6.1f ns/packet\n", (total > decode) ? (total - decode) : 0);
+  printf(" total      %6.1f ns/packet, %.2f Mpps\n", total,
+    st->total_ns ? (st->pkts * 1e3 / st->total_ns) : 0);
+  printf("\n");
+}
+
+/* read a capture file, or each file in a directory, then show the top */
+int read_offline(struct shard *s) {
+  struct offline_stats st;
+  struct dirent **names = NULL;
+  struct stat sb;
+  char path[PATH_MAX];
+  int rc = -1, n = 0, i;
+
+  memset(&st, 0, sizeof(st));
+  if (stat(cfg.file, &sb) == -1) {
+    fprintf(stderr,"stat %s: %s\n", cfg.file, strerror(errno));
+    goto done;
+  }
+
+  if (S_ISDIR(sb.st_mode)) {
+    if ( (n = scandir(cfg.file, &names, NULL, alphasort)) == -1) {
+      fprintf(stderr,"scandir %s: %s\n", cfg.file, strerror(errno));
+      n = 0;
+      goto done;
+    }
+    for(i=0; i < n; i++) {
+      snprintf(path, sizeof(path), "%s/%s", cfg.file, names[i]->d_name);
+      if ((stat(path, &sb) == -1) || !S_ISREG(sb.st_mode)) continue;
+      if (read_file(s, path, &st) < 0) goto done;
+    }
+  } else if (read_file(s, cfg.file, &st) < 0) goto done;
+
+  report(&st);
+  if (cfg.log_file && st.pkts) record_top(1);
+  show_abtop_top(s->abtop, cfg.now);
+  if (s->hhh) show_hhh_top(s->hhh, cfg.hhh_pct);
+  if (s->fanout) show_fanout_top(s->fanout);
+  rc = 0;
+
+ done:
+  for(i=0; i < n; i++) free(names[i]);
+  free(names);
+  return rc;
+}
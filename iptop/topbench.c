@@ -0,0 +1,368 @@
+/*
+ * Benchmark the generated top-K tables (topk.h) against the uthash and
+ * utstring design abtop started from
+ *
+ *   topk - TOPK_DEFINE for the key, fixed size binary keys, flat table
+ *   ut   - the key formatted to a string with utstring_printf, looked up
+ *          with HASH_FIND, kept in recency order by re-adding it, and a
+ *          utarray top list re-sorted as entries qualify; as abtop.c and
+ *          ip.c were before binary keys
+ *
+ * for each of four kinds of key:
+ *
+ *   mac    - a pair of MAC addresses (12 bytes)
+ *   tuple  - an IPv4 5-tuple (16 bytes, as ab_key_t)
+ *   port   - a port (2 bytes)
+ *   prefix - an IPv4 prefix and its length (8 bytes)
+ *
+ * A stream of -n keys is drawn from -u distinct ones, three in four from
+ * the first tenth, so that there is a top to find and a cache to churn.
+ * The stream is made before the clock starts; each implementation's time
+ * covers what it would do per packet, including the formatting for ut.
+ * One CSV row per (kind, implementation) goes to stdout or -o <file>.
+ *
+ *  ./topbench -n 5000000 -u 100000 -c 10000 -o topbench.csv
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "utstring.h"
+#include "utarray.h"
+#include "uthash.h"
+#include "topk.h"
+
+typedef struct { uint8_t a[6]; uint8_t b[6]; } mac_key_t;
+typedef struct {
+  uint32_t a;
+  uint32_t b;
+  uint16_t a_port;
+  uint16_t b_port;
+  uint8_t proto;
+  uint8_t pad[3];
+} tuple_key_t;
+typedef uint16_t port_key_t;
+typedef struct { uint32_t addr; uint8_t len; uint8_t pad[3]; } prefix_key_t;
+
+TOPK_DEFINE(mac, mac_key_t, uint64_t, 2)
+TOPK_DEFINE(tuple, tuple_key_t, unsigned long, 3)
+TOPK_DEFINE(port, port_key_t, uint32_t, 2)
+TOPK_DEFINE(prefix, prefix_key_t, uint64_t, 1)
+
+char *kind_names[] = {"mac", "tuple", "port", "prefix"};
+#define NUM_KINDS (sizeof(kind_names)/sizeof(*kind_names))
+
+struct {
+  int verbose;
+  char *prog;
+  char *out;
+  FILE *outf;
+  char *kinds;
+  int events;
+  int keys;
+  int cache_sz;
+  int top_sz;
+  uint32_t *seq;       /* the stream, as indexes into the key pool */
+  mac_key_t *macs;
+  tuple_key_t *tuples;
+  port_key_t *ports;
+  prefix_key_t *prefixes;
+  UT_string *label;
+} cfg = {
+  .kinds = "mac,tuple,port,prefix",
+  .events = 5000000,
+  .keys = 100000,
+  .cache_sz = 10000,
+  .top_sz = 10,
+};
+
+void usage() {
+  fprintf(stderr,"usage: %s [-v] [options]\n"
+       " options: \n"
+       " -m <kind,...>        -kinds among mac,tuple,port,prefix\n"
+       " -n <events>          -stream length\n"
+       " -u <keys>            -distinct keys in the stream\n"
+       " -c <cache-sz>        -keys tracked\n"
+       " -k <top-sz>          -top list size\n"
+       " -o <file.csv>        -report file (default stdout)\n"
+       "\n", cfg.prog);
+  exit(-1);
+}
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*****************************************************************************
+ * the uthash/utstring version: abtop.c as it was, keyed by string ids
+ ****************************************************************************/
+
+typedef struct {
+  UT_string id;
+  unsigned long ab;
+  unsigned long ba;
+  unsigned long count;
+  time_t last;
+  UT_hash_handle hh;
+} ut_t;
+
+typedef struct {
+  ut_t *head;
+  ut_t *cache;
+  UT_array top;
+  int cache_sz;
+  int top_sz;
+  ut_t *avail;
+  int navail;
+} uttop_t;
+
+uttop_t *uttop_new(int cache_sz, int top_sz) {
+  uttop_t *t = calloc(1,sizeof(uttop_t));
+  int i;
+  if (!t) return NULL;
+  t->cache = malloc(cache_sz * sizeof(ut_t));
+  if (!t->cache) {free(t); return NULL;}
+  t->cache_sz = cache_sz;
+  t->top_sz = top_sz;
+  t->avail = t->cache;
+  t->navail = t->cache_sz;
+  for(i=0; i<t->cache_sz; i++) utstring_init(&t->cache[i].id);
+  utarray_init(&t->top,&ut_ptr_icd);
+  return t;
+}
+
+static int ut_low_to_high(const void *_a, const void *_b) {
+  ut_t *a = *(ut_t**)_a, *b = *(ut_t**)_b;
+  if (a->count != b->count) return (a->count < b->count) ? -1 : 1;
+  return (a->last < b->last) ? -1 : (a->last > b->last);
+}
+
+static int ut_is_top(uttop_t *t, ut_t *u) {
+  if (utarray_len(&t->top) < (unsigned)t->top_sz) return 1;
+  return u->count >= (*(ut_t**)utarray_front(&t->top))->count;
+}
+
+static ut_t **ut_find_in_top(uttop_t *t, ut_t *u) {
+  ut_t **up=NULL;
+  while( (up=(ut_t**)utarray_next(&t->top,up))) if (u == *up) return up;
+  return NULL;
+}
+
+void uttop_hit(uttop_t *t, char *id, time_t when, unsigned long ab, unsigned long ba) {
+  ut_t *u, **p;
+  HASH_FIND(hh, t->head, id, strlen(id), u);
+  if (!u) {
+    if (HASH_COUNT(t->head) == t->cache_sz) { // delete the oldest
+      u = t->head;
+      HASH_DELETE(hh, t->head, u);
+      t->avail = u;
+      t->navail = 1;
+      if ((p = ut_find_in_top(t,u))) utarray_erase(&t->top,utarray_eltidx(&t->top,p),1);
+    }
+    u = t->avail;
+    t->avail = (--t->navail) ? (t->avail+1) : NULL;
+    utstring_clear(&u->id);
+    utstring_bincpy(&u->id, id, strlen(id));
+    u->count = u->ab = u->ba = 0;
+    u->last = 0;
+  } else {
+    HASH_DELETE(hh, t->head, u); // before re-adding as the newest
+  }
+  HASH_ADD_KEYPTR(hh, t->head, utstring_body(&u->id), utstring_len(&u->id), u);
+  u->count += (ab + ba);
+  u->ab += ab;
+  u->ba += ba;
+  if (when > u->last) u->last = when;
+  if (ut_is_top(t,u)) {
+    if (!ut_find_in_top(t,u)) utarray_push_back(&t->top,&u);
+    utarray_sort(&t->top,ut_low_to_high);
+    if (utarray_len(&t->top) > (unsigned)t->top_sz) utarray_erase(&t->top,0,1);
+  }
+}
+
+unsigned long uttop_first(uttop_t *t) {
+  ut_t **up = (ut_t**)utarray_back(&t->top);
+  return up ? (*up)->count : 0;
+}
+
+void uttop_free(uttop_t *t) {
+  int i;
+  HASH_CLEAR(hh,t->head);
+  for(i=0; i<t->cache_sz; i++) utstring_done(&t->cache[i].id);
+  free(t->cache);
+  utarray_done(&t->top);
+  free(t);
+}
+
+/* the string form each kind of key had to take to be an id */
+static char *label(int kind, uint32_t k) {
+  char a[INET_ADDRSTRLEN], b[INET_ADDRSTRLEN];
+  mac_key_t *m;
+  tuple_key_t *t;
+  prefix_key_t *p;
+
+  utstring_clear(cfg.label);
+  switch(kind) {
+    case 0:
+      m = &cfg.macs[k];
+      utstring_printf(cfg.label, "%02x:%02x:%02x:%02x:%02x:%02x->%02x:%02x:%02x:%02x:%02x:%02x",
+        m->a[0], m->a[1], m->a[2], m->a[3], m->a[4], m->a[5],
+        m->b[0], m->b[1], m->b[2], m->b[3], m->b[4], m->b[5]);
+      break;
+    case 1:
+      t = &cfg.tuples[k];
+      inet_ntop(AF_INET, &t->a, a, sizeof(a));
+      inet_ntop(AF_INET, &t->b, b, sizeof(b));
+      utstring_printf(cfg.label, "%s:%u->%s:%u/%u", a, ntohs(t->a_port), b,
+        ntohs(t->b_port), t->proto);
+      break;
+    case 2:
+      utstring_printf(cfg.label, "%u", cfg.ports[k]);
+      break;
+    case 3:
+      p = &cfg.prefixes[k];
+      inet_ntop(AF_INET, &p->addr, a, sizeof(a));
+      utstring_printf(cfg.label, "%s/%u", a, p->len);
+      break;
+  }
+  return utstring_body(cfg.label);
+}
+
+/*****************************************************************************
+ * the runs
+ ****************************************************************************/
+
+/* the key pool and the stream over it */
+int setup(void) {
+  int i, r, hot = cfg.keys / 10 + 1;
+
+  cfg.seq = malloc(cfg.events * sizeof(uint32_t));
+  cfg.macs = calloc(cfg.keys, sizeof(mac_key_t));
+  cfg.tuples = calloc(cfg.keys, sizeof(tuple_key_t));
+  cfg.ports = calloc(cfg.keys, sizeof(port_key_t));
+  cfg.prefixes = calloc(cfg.keys, sizeof(prefix_key_t));
+  if (!cfg.seq || !cfg.macs || !cfg.tuples || !cfg.ports || !cfg.prefixes) {
+    fprintf(stderr,"out of memory\n");
+    return -1;
+  }
+  utstring_new(cfg.label);
+
+  srand(1);
+  for(i=0; i < cfg.keys; i++) {
+    for(r=0; r < 6; r++) { cfg.macs[i].a[r] = rand(); cfg.macs[i].b[r] = rand(); }
+    cfg.macs[i].a[5] = i; cfg.macs[i].b[5] = i >> 8; cfg.macs[i].b[4] = i >> 16;
+    cfg.tuples[i].a = htonl(0x0a000000 | (rand() & 0xffffff));
+    cfg.tuples[i].b = htonl(0x0a000000 | (i & 0xffffff));
+    cfg.tuples[i].a_port = htons(1024 + (rand() % 64000));
+    cfg.tuples[i].b_port = htons(80);
+    cfg.tuples[i].proto = 6;
+    cfg.ports[i] = i % 65536;  /* at most 64k distinct */
+    cfg.prefixes[i].addr = htonl((uint32_t)i << 8);
+    cfg.prefixes[i].len = 24;
+  }
+  for(i=0; i < cfg.events; i++) {
+    r = rand();
+    cfg.seq[i] = (r & 3) ? (r >> 2) % hot : (r >> 2) % cfg.keys;
+  }
+  return 0;
+}
+
+/* time the generated table for one kind; each hit adds 100 to the first
+ * two counters (as ab and total would be) */
+#define RUN_TOPK(name, pool, ctr_t, t, first) do {                             \
+  name##_t *tk = name##_new(cfg.cache_sz, cfg.top_sz);                         \
+  ctr_t add[3] = {100, 100, 0};                                                \
+  name##_entry_t *out = malloc(cfg.top_sz * sizeof(name##_entry_t));           \
+  if (!tk || !out) { fprintf(stderr,"out of memory\n"); goto done; }           \
+  t = now_ns();                                                                \
+  for(i=0; i < cfg.events; i++) name##_hit(tk, &pool[cfg.seq[i]], add);        \
+  t = now_ns() - t;                                                            \
+  n = name##_top(tk, out);                                                     \
+  name##_sort(out, n);                                                         \
+  first = n ? (unsigned long)out[0].c[0] : 0;                                  \
+  name##_free(tk);                                                             \
+  free(out);                                                                   \
+} while(0)
+
+int run(int kind) {
+  unsigned long first = 0;
+  uttop_t *ut = NULL;
+  int i, n, rc = -1;
+  uint64_t t = 0;
+
+  switch(kind) {
+    case 0: RUN_TOPK(mac, cfg.macs, uint64_t, t, first); break;
+    case 1: RUN_TOPK(tuple, cfg.tuples, unsigned long, t, first); break;
+    case 2: RUN_TOPK(port, cfg.ports, uint32_t, t, first); break;
+    case 3: RUN_TOPK(prefix, cfg.prefixes, uint64_t, t, first); break;
+  }
+  fprintf(cfg.outf, "%s,topk,%d,%d,%d,%d,%.1f,%lu\n", kind_names[kind], cfg.events,
+    cfg.keys, cfg.cache_sz, cfg.top_sz, (double)t / cfg.events, first);
+
+  if ( (ut = uttop_new(cfg.cache_sz, cfg.top_sz)) == NULL) {
+    fprintf(stderr,"out of memory\n");
+    goto done;
+  }
+  t = now_ns();
+  for(i=0; i < cfg.events; i++) uttop_hit(ut, label(kind, cfg.seq[i]), 0, 100, 0);
+  t = now_ns() - t;
+  fprintf(cfg.outf, "%s,ut,%d,%d,%d,%d,%.1f,%lu\n", kind_names[kind], cfg.events,
+    cfg.keys, cfg.cache_sz, cfg.top_sz, (double)t / cfg.events, uttop_first(ut));
+  fflush(cfg.outf);
+  rc = 0;
+
+ done:
+  if (ut) uttop_free(ut);
+  return rc;
+}
+
+int main(int argc, char *argv[]) {
+  char *kinds, *kp, *m;
+  int opt, i, rc = -1;
+
+  cfg.prog = argv[0];
+  cfg.outf = stdout;
+
+  while ( (opt=getopt(argc,argv,"vm:n:u:c:k:o:h")) != -1) {
+    switch(opt) {
+      case 'v': cfg.verbose++; break;
+      case 'm': cfg.kinds=strdup(optarg); break;
+      case 'n': cfg.events=atoi(optarg); break;
+      case 'u': cfg.keys=atoi(optarg); break;
+      case 'c': cfg.cache_sz=atoi(optarg); break;
+      case 'k': cfg.top_sz=atoi(optarg); break;
+      case 'o': cfg.out=strdup(optarg); break;
+      case 'h': default: usage(); break;
+    }
+  }
+  if ((cfg.events < 1) || (cfg.keys < 1) || (cfg.cache_sz < 1) || (cfg.top_sz < 1)) usage();
+
+  if (cfg.out && ((cfg.outf = fopen(cfg.out, "w")) == NULL)) {
+    fprintf(stderr,"can't open %s: %s\n", cfg.out, strerror(errno));
+    goto done;
+  }
+  if (setup() < 0) goto done;
+  fprintf(cfg.outf, "kind,impl,events,keys,cache,top,ns_per_hit,top_count\n");
+
+  kinds = strdup(cfg.kinds);
+  for(m = strtok_r(kinds, ",", &kp); m; m = strtok_r(NULL, ",", &kp)) {
+    for(i=0; i < (int)NUM_KINDS; i++) if (!strcmp(m, kind_names[i])) break;
+    if (i == NUM_KINDS) {
+      fprintf(stderr,"unknown kind %s\n", m);
+      goto done;
+    }
+    if (run(i) < 0) goto done;
+  }
+  rc = 0;
+
+ done:
+  if (cfg.outf && (cfg.outf != stdout)) fclose(cfg.outf);
+  return rc;
+}
@@ -0,0 +1,240 @@
+#include "iptop.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <limits.h>
+
+extern struct iptop_conf cfg;
+
+/*
+ * iptop -L <file>: append each display interval's top list to a history
+ * (see top_log.h for the files), for iptop_read -l to query later.
+ *
+ * the display runs in the capture loop, so it must not wait on the disk:
+ * growing a file, or the page faults of writing to a fresh mapping, can
+ * take milliseconds. log_top only copies the list into a slot of a small
+ * queue and pokes an eventfd; a writer thread of our own appends from
+ * there. should the writer fall that far behind, a record is dropped
+ * rather than the capture held up. offline, with nothing to drop for, the
+ * reader waits for a slot instead.
+ */
+
+#define LOG_QLEN 8
+
+static struct {
+  int fd;
+  int idx_fd;
+  int efd;
+  uint8_t *map;         /* header page, then records */
+  size_t map_len;
+  int64_t *idx;
+  size_t idx_len;
+  uint64_t cap;         /* records both files have room for */
+  size_t rec_sz;
+  uint8_t *q;           /* LOG_QLEN records */
+  volatile unsigned head; /* next slot log_top fills */
+  volatile unsigned tail; /* next slot the writer appends */
+  volatile int stop;
+  unsigned long drops;  /* queue full */
+  unsigned long late;   /* older than the last record; the index is sorted */
+  pthread_t tid;
+  int started;
+} lg = { .fd = -1, .idx_fd = -1, .efd = -1 };
+
+static struct top_log_hdr *log_hdr(void) { return (struct top_log_hdr*)lg.map; }
+
+/* map (or remap) the files at their current sizes */
+static int log_map(size_t len, size_t idx_len) {
+  void *p;
+  p = lg.map ? mremap(lg.map, lg.map_len, len, MREMAP_MAYMOVE)
+             : mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, lg.fd, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr,"mmap %s: %s\n", cfg.log_file, strerror(errno));
+    return -1;
+  }
+  lg.map = p;
+  lg.map_len = len;
+  if (idx_len == 0) return 0;
+  p = lg.idx ? mremap(lg.idx, lg.idx_len, idx_len, MREMAP_MAYMOVE)
+             : mmap(NULL, idx_len, PROT_READ|PROT_WRITE, MAP_SHARED, lg.idx_fd, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr,"mmap %s.idx: %s\n", cfg.log_file, strerror(errno));
+    return -1;
+  }
+  lg.idx = p;
+  lg.idx_len = idx_len;
+  return 0;
+}
+
+static int log_grow(void) {
+  uint64_t cap = lg.cap + TOP_LOG_GROW;
+  size_t len = TOP_LOG_HDR + cap * lg.rec_sz, idx_len = cap * sizeof(int64_t);
+
+  if ((ftruncate(lg.fd, len) == -1) || (ftruncate(lg.idx_fd, idx_len) == -1)) {
+    fprintf(stderr,"ftruncate %s: %s\n", cfg.log_file, strerror(errno));
+    return -1;
+  }
+  if (log_map(len, idx_len) < 0) return -1;
+  lg.cap = cap;
+  return 0;
+}
+
+/* record r goes after the last; nrec is raised once it is all there */
+static int log_append(const struct top_log_rec *r) {
+  uint64_t n = log_hdr()->nrec;
+
+  if (n && (r->t < lg.idx[n-1])) { lg.late++; return 0; }
+  if ((n == lg.cap) && (log_grow() < 0)) return -1;
+  memcpy(lg.map + TOP_LOG_HDR + n * lg.rec_sz, r, lg.rec_sz);
+  lg.idx[n] = r->t;
+  __sync_synchronize();
+  log_hdr()->nrec = n + 1;
+  return 0;
+}
+
+static void *log_writer(void *arg) {
+  uint64_t ev;
+  sigset_t all;
+  int stop;
+
+  /* signals are the main thread's, by signalfd */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, NULL);
+
+  for(;;) {
+    if ((read(lg.efd, &ev, sizeof(ev)) < 0) && (errno != EINTR)) break;
+    stop = lg.stop;
+    __sync_synchronize(); /* everything queued before stop is seen */
+    while (lg.tail != lg.head) {
+      if (log_append((struct top_log_rec*)(lg.q + (lg.tail % LOG_QLEN) * lg.rec_sz)) < 0) {
+        kill(getpid(), SIGTERM); /* have the main thread shut down */
+        return NULL;
+      }
+      __sync_synchronize();
+      lg.tail++;
+    }
+    if (stop) break;
+  }
+  return NULL;
+}
+
+/* open or create the history, and start its writer. an existing history
+ * is appended to if its records are the same size as ours */
+int log_open(void) {
+  char idx_name[PATH_MAX];
+  struct top_log_hdr *h;
+  struct stat sb, isb;
+  int rc = -1;
+
+  lg.rec_sz = top_log_rec_sz(cfg.top_sz);
+  snprintf(idx_name, sizeof(idx_name), "%s.idx", cfg.log_file);
+  if ( (lg.fd = open(cfg.log_file, O_RDWR|O_CREAT, 0644)) == -1) {
+    fprintf(stderr,"open %s: %s\n", cfg.log_file, strerror(errno));
+    goto done;
+  }
+  if ( (lg.idx_fd = open(idx_name, O_RDWR|O_CREAT, 0644)) == -1) {
+    fprintf(stderr,"open %s: %s\n", idx_name, strerror(errno));
+    goto done;
+  }
+  if ((fstat(lg.fd, &sb) == -1) || (fstat(lg.idx_fd, &isb) == -1)) {
+    fprintf(stderr,"fstat %s: %s\n", cfg.log_file, strerror(errno));
+    goto done;
+  }
+
+  if (sb.st_size < TOP_LOG_HDR) { /* new */
+    if (ftruncate(lg.fd, TOP_LOG_HDR) == -1) {
+      fprintf(stderr,"ftruncate %s: %s\n", cfg.log_file, strerror(errno));
+      goto done;
+    }
+    if (log_map(TOP_LOG_HDR, 0) < 0) goto done;
+    h = log_hdr();
+    memset(h, 0, sizeof(*h));
+    h->entry_sz = sizeof(ab_top_t);
+    h->top_sz = cfg.top_sz;
+    h->rec_sz = lg.rec_sz;
+    h->by_rate = !cfg.by_total;
+    h->interval = cfg.display_interval;
+    __sync_synchronize();
+    h->magic = TOP_LOG_MAGIC;
+  } else {
+    lg.cap = (sb.st_size - TOP_LOG_HDR) / lg.rec_sz;
+    if (isb.st_size / sizeof(int64_t) < lg.cap) lg.cap = isb.st_size / sizeof(int64_t);
+    if (log_map(TOP_LOG_HDR + lg.cap * lg.rec_sz, lg.cap * sizeof(int64_t)) < 0) goto done;
+    h = log_hdr();
+    if ((h->magic != TOP_LOG_MAGIC) || (h->entry_sz != sizeof(ab_top_t)) ||
+        (h->rec_sz != lg.rec_sz) || (h->nrec > lg.cap)) {
+      fprintf(stderr,"%s: not an iptop history of this version and -k\n", cfg.log_file);
+      goto done;
+    }
+    if (cfg.verbose) fprintf(stderr,"%s: appending after %lu records\n",
+                             cfg.log_file, (unsigned long)h->nrec);
+  }
+
+  lg.q = malloc(LOG_QLEN * lg.rec_sz);
+  if (lg.q == NULL) {
+    fprintf(stderr,"out of memory\n");
+    goto done;
+  }
+  if ( (lg.efd = eventfd(0, 0)) == -1) {
+    fprintf(stderr,"eventfd: %s\n", strerror(errno));
+    goto done;
+  }
+  if (pthread_create(&lg.tid, NULL, log_writer, NULL)) {
+    fprintf(stderr,"pthread_create failed\n");
+    goto done;
+  }
+  lg.started = 1;
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* queue the n entries of top, ranked low to high as abtop_merge leaves
+ * them, as the record for time t */
+void log_top(time_t t, const ab_top_t *top, int n, int wait) {
+  struct top_log_rec *r;
+  uint64_t one = 1;
+  int i;
+
+  if (lg.started == 0) return;
+  while ((lg.head - lg.tail) == LOG_QLEN) {
+    if (!wait) { lg.drops++; return; }
+    usleep(1000);
+  }
+  r = (struct top_log_rec*)(lg.q + (lg.head % LOG_QLEN) * lg.rec_sz);
+  memset(r, 0, lg.rec_sz);
+  if (n > cfg.top_sz) { top += n - cfg.top_sz; n = cfg.top_sz; }
+  r->t = t;
+  r->ntop = n;
+  for(i=0; i < cfg.nthreads; i++) {
+    r->pkts += cfg.shards[i].pkts;
+    r->bytes += cfg.shards[i].bytes;
+  }
+  for(i=0; i < n; i++) r->top[i] = top[n - 1 - i];
+  __sync_synchronize();
+  lg.head++;
+  if (write(lg.efd, &one, sizeof(one)) != sizeof(one)) return; /* writer sees it next time */
+}
+
+/* let the writer finish what is queued, then close up */
+void log_close(void) {
+  uint64_t one = 1;
+
+  if (lg.started) {
+    lg.stop = 1;
+    __sync_synchronize();
+    if (write(lg.efd, &one, sizeof(one)) == sizeof(one)) pthread_join(lg.tid, NULL);
+    if (cfg.verbose || lg.drops || lg.late)
+      fprintf(stderr,"%s: %lu records, %lu dropped, %lu out of time order\n", cfg.log_file,
+        lg.map ? (unsigned long)log_hdr()->nrec : 0, lg.drops, lg.late);
+  }
+  if (lg.map) munmap(lg.map, lg.map_len);
+  if (lg.idx) munmap(lg.idx, lg.idx_len);
+  if (lg.fd != -1) close(lg.fd);
+  if (lg.idx_fd != -1) close(lg.idx_fd);
+  if (lg.efd != -1) close(lg.efd);
+  free(lg.q);
+  lg.started = 0;
+}
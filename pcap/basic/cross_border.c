@@ -1,5 +1,4 @@
 #include <stdio.h>
-#include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,47 +7,77 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include "decode.h"
 
 
-/* 
+/*
  * decode IP header and test if CIDR border is crossed
  *
- * the CIDR defines the "inside" of a subnet.
- * the crosses_border function tests if the dst or src
- * IP is inside the cidr and the other one is outside.
+ * the CIDRs define the "inside". a packet crosses the border if one
+ * of its addresses is inside some cidr and the other is outside all.
+ * the cidrs are compiled into a DIR-24-8 longest prefix match table
+ * so each address is classified in at most two memory accesses.
+ * per-prefix packet and byte counts, in each direction, are printed
+ * every interval (of packet time) and at the end.
  *
  * try it:
  *
- * ./cross_border -s 192.168.1.0/24 -r ping.pcap 
+ * ./cross_border -s 192.168.1.0/24 -r ping.pcap
  *
  * loosen cidr:
  *
- * ./cross_border -s 192.0.0.0/8 -r ping.pcap 
+ * ./cross_border -s 192.0.0.0/8 -r ping.pcap
  *
- * tighten cidr:
+ * tighten cidr, or give several:
  *
- * ./cross_border -s 192.128.0.0/9 -r ping.pcap
+ * ./cross_border -s 192.128.0.0/9 -s 10.0.0.0/8 -r ping.pcap
+ *
+ * or load thousands from a file, one cidr per line:
+ *
+ * ./cross_border -S internal.txt -r ping.pcap
  */
 
+/* DIR-24-8: tbl24 is indexed by the top 24 bits of the address. an entry
+ * is either a prefix number (0 = no match) or, with TBL_GROUP set, the
+ * number of a 256-entry tbl8 group indexed by the low 8 bits. prefixes
+ * longer than /24 live in the tbl8 groups. */
+#define TBL_GROUP     0x8000
+#define MAX_PREFIXES  (TBL_GROUP - 1)
+#define MAX_GROUPS    TBL_GROUP
+
+struct prefix {
+  uint32_t net;  /* host order, host bits clear */
+  int len;
+  unsigned long pkts_out, bytes_out; /* inside -> outside */
+  unsigned long pkts_in, bytes_in;   /* outside -> inside */
+};
+
 struct cfg {
   char *prog;
   char err[PCAP_ERRBUF_SIZE];
   int maxsz;
   int verbose;
-  char *border;
-  uint32_t cidr;
-  int slash_n;
+  int interval;
+  time_t last;
+  struct prefix *prefixes; /* prefixes[0] unused; 0 means no match */
+  int nprefixes;
+  uint16_t *tbl24;
+  uint16_t *tbl8;
+  int ngroups;
+  unsigned long crossing, internal, external;
 } cfg = {
   .maxsz =  65535,
+  .interval = 10,
 };
 
 void usage(void) {
-  fprintf(stderr,"usage: %s [-v] [-s cidr] -i <eth> | -r <file>\n", cfg.prog);
+  fprintf(stderr,"usage: %s [-v] [-t sec] -s cidr [-s cidr ...] | -S file"
+                 " -i <eth> | -r <file>\n", cfg.prog);
   exit(-1);
 }
 
 /* IP followed by a /N */
-int is_cidr(char *w) {
+int is_cidr(char *w, uint32_t *net, int *len) {
   unsigned a, b, c, d, n;
   int rc = -1, sc;
 
@@ -58,8 +87,9 @@ int is_cidr(char *w) {
   if ((a > 255) || (b > 255) || (c > 255) || (d > 255)) goto done;
   if (n > 32) goto done;
 
-  cfg.cidr = (a << 24) | (b << 16) | (c << 8) | d;
-  cfg.slash_n = n;
+  *net = (a << 24) | (b << 16) | (c << 8) | d;
+  *net &= n ? ~((1UL << (32 - n)) - 1) : 0;
+  *len = n;
 
   rc = 0;
 
@@ -67,123 +97,187 @@ int is_cidr(char *w) {
   return !rc;
 }
 
-/* do the two IPv4 addresses (in host order) differ in their network part? 
- * if so, is one (but not both) of them "inside" the cidr of interest? */
-int crosses_border(uint32_t a, uint32_t b) {
-  uint64_t m, host_part_nbits;
-
-  host_part_nbits = 32 - cfg.slash_n;
-  m = ~((1UL << host_part_nbits) - 1);
+int add_prefix(char *w) {
+  struct prefix *p;
+  uint32_t net;
+  int len;
 
-  return (((cfg.cidr & m) == (a & m)) ^ ((cfg.cidr & m) == (b & m))) ? 1 : 0;
+  if (!is_cidr(w, &net, &len)) {
+    fprintf(stderr, "not a cidr: %s\n", w);
+    return -1;
+  }
+  if (cfg.nprefixes == MAX_PREFIXES) {
+    fprintf(stderr, "too many prefixes (max %d)\n", MAX_PREFIXES);
+    return -1;
+  }
+  p = realloc(cfg.prefixes, (cfg.nprefixes + 2) * sizeof(*p));
+  if (p == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return -1;
+  }
+  cfg.prefixes = p;
+  cfg.nprefixes++;
+  memset(&p[cfg.nprefixes], 0, sizeof(*p));
+  p[cfg.nprefixes].net = net;
+  p[cfg.nprefixes].len = len;
+  return 0;
 }
 
-/*******************************************************************************
- * ethernet frame: | 6 byte dst MAC | 6 byte src MAC | 2 byte type | data
- * IP datagram: | 1 byte v/len | 1 byte TOS | 2 byte len | 16 more bytes | data
- * TCP segment: | 2 byte src port | 2 byte dst port | 4 byte seq | 4 byte ack | 
- *                2 byte flags | 2 byte window | 2 byte sum | 2 byte urg | data
- ******************************************************************************/
-void cb(u_char *unused, const struct pcap_pkthdr *hdr, const u_char *pkt) {
-  /* data link: ethernet frame */
-  enum {other,arp,rarp,ip,vlan,ipv6,e802} etype=other;
-  enum {none,icmp,igmp,tcp,udp} ipproto=none;
-  char *etypes[] = {"other","arp","rarp","ip","vlan","ipv6","802_2/3"};
-  const uint8_t *dst_mac=pkt, *src_mac=pkt+6, *typep=pkt+12;
-  const uint8_t *data = pkt+14, *tci_p;
-  uint16_t type,tci,vid;
-  if (hdr->caplen < 12) return;
- again:
-  if (hdr->caplen < ((typep - pkt) + 2)) return;
-  memcpy(&type, typep, sizeof(uint16_t)); 
-  type = ntohs(type); 
-  switch(type) {
-    case 0x0800: etype = ip; break;
-    case 0x8100: etype = vlan; break;
-    case 0x0806: etype = arp; break;
-    case 0x8035: etype = rarp; break;
-    case 0x86dd: etype = ipv6; break;
-    default: 
-      if (type < 1500) etype = e802;  // 802.2/3 link encapsulation vs. EthernetII
-      else etype = other; 
-      break;
+int read_prefixes(char *file) {
+  char line[100], *c;
+  int rc = -1;
+  FILE *f;
+
+  if ( (f = fopen(file, "r")) == NULL) {
+    fprintf(stderr, "can't open %s\n", file);
+    goto done;
   }
+  while (fgets(line, sizeof(line), f)) {
+    if ( (c = strpbrk(line, "#\r\n"))) *c = '\0';
+    if ( (c = strtok(line, " \t")) == NULL) continue; /* blank */
+    if (add_prefix(c) < 0) goto done;
+  }
+  rc = 0;
+
+ done:
+  if (f) fclose(f);
+  return rc;
+}
 
-  if (etype==e802) {
-    // skip SNAP and LLC header
-    typep += 6;
-    goto again;
+/* shorter prefixes first, so that longer ones overwrite them as we fill */
+static int prefix_sort(const void *_a, const void *_b) {
+  const struct prefix *a = _a, *b = _b;
+  if (a->len != b->len) return a->len - b->len;
+  return (a->net < b->net) ? -1 : (a->net > b->net);
+}
+
+int compile_prefixes(void) {
+  uint32_t i, first, count;
+  uint16_t e, *g;
+  struct prefix *p;
+  int n, k, rc = -1;
+
+  qsort(&cfg.prefixes[1], cfg.nprefixes, sizeof(struct prefix), prefix_sort);
+
+  /* drop duplicates */
+  for(n = 1, k = 2; k <= cfg.nprefixes; k++) {
+    if ((cfg.prefixes[k].net == cfg.prefixes[n].net) &&
+        (cfg.prefixes[k].len == cfg.prefixes[n].len)) continue;
+    cfg.prefixes[++n] = cfg.prefixes[k];
   }
+  cfg.nprefixes = n;
 
-  /* vlan tags are 'interjected' before the ethertype; they are known by their
-   * own ethertype (0x8100) followed by a TCI, after which the real etherype 
-   * (or another double VLAN tag) occurs. Each VLAN tag adds two bytes to the
-   * frame size. The TCI (tag control identifier) contains the VLAN ID (vid).*/
-  if (etype==vlan) { 
-    tci_p = typep + 2; 
-    if (hdr->caplen < ((tci_p - pkt)+2)) return;
-    memcpy(&tci, tci_p, sizeof(uint16_t));  
-    tci = ntohs(tci);
-    vid = tci & 0xfff; // vlan VID is in the low 12 bits of the TCI
-    typep = tci_p + 2;
-    goto again; 
+  cfg.tbl24 = calloc(1 << 24, sizeof(uint16_t));
+  if (cfg.tbl24 == NULL) {
+    fprintf(stderr, "out of memory\n");
+    goto done;
   }
-  data = typep + 2;
-
-  /*****************************************************************************
-  * IP datagram 
-   ****************************************************************************/
-
-  const uint8_t *ip_datagram, *ip_hl, *ip_tos, *ip_len, *ip_id, *ip_fo, *ip_ttl, 
-          *ip_proto, *ip_sum, *ip_src, *ip_dst, *ip_opt, *ip_data;
-  uint8_t ip_version, ip_hdr_len, *ap;
-  uint16_t ip_lenh, ip_idh, ip_opts_len, ip_foh;
-  uint32_t ip_srch, ip_dsth;
-  if (etype == ip) {
-    ip_datagram = data;
-    if (hdr->caplen < ((ip_datagram - pkt) + 20)) return;
-    ip_hl = data;   
-       ip_hdr_len = (*ip_hl & 0x0f) * 4; assert(ip_hdr_len >= 20);
-       ip_opts_len = ip_hdr_len - 20;
-       ip_version = (*ip_hl & 0xf0) >> 4;
-    ip_tos = data + 1;
-    ip_len = data + 2;
-    ip_id =  data + 4;
-    ip_fo =  data + 6;
-    ip_ttl = data + 8;
-    ip_proto=data + 9;
-    ip_sum = data + 10;
-    ip_src = data + 12;
-    ip_dst = data + 16;
-    ip_opt = data + 20;
-    ip_data= data + 20 + ip_opts_len;
-
-    memcpy(&ip_lenh, ip_len, sizeof(uint16_t)); ip_lenh = ntohs(ip_lenh);
-    memcpy(&ip_idh, ip_id, sizeof(uint16_t)); ip_idh = ntohs(ip_idh);
-    memcpy(&ip_foh, ip_fo, sizeof(uint16_t)); ip_foh = (ntohs(ip_foh) & 0x1fff)*8;
-    switch((unsigned)(*ip_proto)) {
-      case 1: ipproto = icmp;  break;
-      case 2: ipproto = igmp;  break;
-      case 6: ipproto = tcp;  break;
-      case 17: ipproto = udp;  break;
-      default: ipproto = none;  break;
+
+  for(n = 1; n <= cfg.nprefixes; n++) {
+    p = &cfg.prefixes[n];
+    if (p->len <= 24) {
+      first = p->net >> 8;
+      count = 1U << (24 - p->len);
+      for(i = first; i < first + count; i++) cfg.tbl24[i] = n;
+      continue;
     }
-    memcpy(&ip_srch, ip_src, sizeof(uint32_t)); ip_srch = ntohl(ip_srch);
-    memcpy(&ip_dsth, ip_dst, sizeof(uint32_t)); ip_dsth = ntohl(ip_dsth);
-    printf("src: %d.%d.%d.%d ", (ip_srch & 0xff000000) >> 24,
-                                (ip_srch & 0x00ff0000) >> 16,
-                                (ip_srch & 0x0000ff00) >>  8,
-                                (ip_srch & 0x000000ff) >>  0);
-    printf("dst: %d.%d.%d.%d ", (ip_dsth & 0xff000000) >> 24,
-                                (ip_dsth & 0x00ff0000) >> 16,
-                                (ip_dsth & 0x0000ff00) >>  8,
-                                (ip_dsth & 0x000000ff) >>  0);
-    data = ip_data;
-
-    if (crosses_border(ip_srch, ip_dsth)) printf("cross-border ");
-    else printf("not cross-border ");
-    printf("\n"); /* end of IP datagram level */
+
+    /* longer than /24: expand the covering tbl24 entry into a group */
+    e = cfg.tbl24[p->net >> 8];
+    if ((e & TBL_GROUP) == 0) {
+      if (cfg.ngroups == MAX_GROUPS) {
+        fprintf(stderr, "too many prefixes longer than /24\n");
+        goto done;
+      }
+      g = realloc(cfg.tbl8, (cfg.ngroups + 1) * 256 * sizeof(uint16_t));
+      if (g == NULL) {
+        fprintf(stderr, "out of memory\n");
+        goto done;
+      }
+      cfg.tbl8 = g;
+      for(i = 0; i < 256; i++) cfg.tbl8[cfg.ngroups * 256 + i] = e;
+      e = TBL_GROUP | cfg.ngroups++;
+      cfg.tbl24[p->net >> 8] = e;
+    }
+    g = &cfg.tbl8[(e & ~TBL_GROUP) * 256];
+    first = p->net & 0xff;
+    count = 1U << (32 - p->len);
+    for(i = first; i < first + count; i++) g[i] = n;
   }
+
+  if (cfg.verbose) fprintf(stderr, "compiled %d prefixes, %d tbl8 groups\n",
+                           cfg.nprefixes, cfg.ngroups);
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+/* longest matching prefix number, or 0 if the address is outside */
+static inline int lookup(uint32_t a) {
+  uint16_t e = cfg.tbl24[a >> 8];
+  if (e & TBL_GROUP) e = cfg.tbl8[(e & ~TBL_GROUP) * 256 + (a & 0xff)];
+  return e;
+}
+
+char *ipf(uint32_t a, char *buf) {
+  sprintf(buf, "%d.%d.%d.%d", (a & 0xff000000) >> 24,
+                              (a & 0x00ff0000) >> 16,
+                              (a & 0x0000ff00) >>  8,
+                              (a & 0x000000ff) >>  0);
+  return buf;
+}
+
+/* print and reset the counts accumulated over the last interval */
+void report(time_t when) {
+  char buf[20];
+  struct prefix *p;
+  int n;
+
+  printf("%lu: crossing %lu internal %lu external %lu\n", (unsigned long)when,
+    cfg.crossing, cfg.internal, cfg.external);
+  for(n = 1; n <= cfg.nprefixes; n++) {
+    p = &cfg.prefixes[n];
+    if ((p->pkts_in | p->pkts_out) == 0) continue;
+    printf(" %s/%d out: %lu pkts %lu bytes in: %lu pkts %lu bytes\n",
+      ipf(p->net, buf), p->len, p->pkts_out, p->bytes_out, p->pkts_in,
+      p->bytes_in);
+    p->pkts_in = p->bytes_in = p->pkts_out = p->bytes_out = 0;
+  }
+  cfg.crossing = cfg.internal = cfg.external = 0;
+}
+
+void cb(u_char *unused, const struct pcap_pkthdr *hdr, const u_char *pkt) {
+  char a[20], b[20];
+  struct pkt_dec d;
+  int ps, pd;
+
+  /* report on interval boundaries of packet time, so files work too */
+  if (cfg.last == 0) cfg.last = hdr->ts.tv_sec;
+  if (hdr->ts.tv_sec >= cfg.last + cfg.interval) {
+    report(cfg.last);
+    cfg.last = hdr->ts.tv_sec;
+  }
+
+  decode_pkt(pkt, hdr->caplen, &d);
+  if ((d.flags & DEC_L3) == 0) return;
+  if (d.ipver != 4) return;
+
+  ps = lookup(d.src);
+  pd = lookup(d.dst);
+  if (ps && !pd) {
+    cfg.crossing++;
+    cfg.prefixes[ps].pkts_out++;
+    cfg.prefixes[ps].bytes_out += hdr->len;
+  } else if (pd && !ps) {
+    cfg.crossing++;
+    cfg.prefixes[pd].pkts_in++;
+    cfg.prefixes[pd].bytes_in += hdr->len;
+  } else if (ps) cfg.internal++;
+  else cfg.external++;
+
+  if (cfg.verbose > 1) printf("src: %s dst: %s %s\n", ipf(d.src, a),
+    ipf(d.dst, b), ((!ps) ^ (!pd)) ? "cross-border" : "not cross-border");
 }
 
 int main(int argc, char *argv[]) {
@@ -193,24 +287,26 @@ int main(int argc, char *argv[]) {
 
   cfg.prog = argv[0];
 
-  while ( (opt=getopt(argc,argv,"vr:i:hs:")) != -1) {
+  while ( (opt=getopt(argc,argv,"vr:i:hs:S:t:")) != -1) {
     switch(opt) {
       case 'v': cfg.verbose++; break;
       case 'r': file=strdup(optarg); break;
       case 'i': dev=strdup(optarg); break;
-      case 's': cfg.border=strdup(optarg); break;
+      case 's': if (add_prefix(optarg) < 0) usage(); break;
+      case 'S': if (read_prefixes(optarg) < 0) usage(); break;
+      case 't': cfg.interval=atoi(optarg); break;
       case 'h': default: usage(); break;
     }
   }
 
+  if (cfg.nprefixes == 0) usage();
+  if (cfg.interval < 1) usage();
   if (file) p = pcap_open_offline(file, cfg.err);
   else if (dev) p = pcap_open_live(dev,cfg.maxsz,1,0,cfg.err);
   else usage();
-  if (cfg.border == NULL) usage();
-  if (is_cidr(cfg.border) < 0) usage();
 
   if (p == NULL) {
-    fprintf(stderr, "can't open %s: %s\n", dev, cfg.err);
+    fprintf(stderr, "can't open %s: %s\n", file ? file : dev, cfg.err);
     goto done;
   }
 
@@ -220,9 +316,15 @@ int main(int argc, char *argv[]) {
     goto done;
   }
 
+  if (compile_prefixes() < 0) goto done;
+
   rc = pcap_loop(p, 0, cb, NULL);
+  report(cfg.last);
 
  done:
+  if (p) pcap_close(p);
+  free(cfg.prefixes);
+  free(cfg.tbl24);
+  free(cfg.tbl8);
   return rc;
 }
-
@@ -0,0 +1,212 @@
+#include <string.h>
+#include <arpa/inet.h>
+#include "decode.h"
+
+/*******************************************************************************
+ * ethernet frame: | 6 byte dst MAC | 6 byte src MAC | 2 byte type | data
+ * 802.3 frame:    | 6 byte dst MAC | 6 byte src MAC | 2 byte len |
+ *                 | 3 byte LLC (aa aa 03) | 3 byte SNAP OUI | 2 byte type | data
+ * vlan tag:       | 2 byte type (8100, 88a8, 9100) | 2 byte TCI | 2 byte type |
+ * IPv4 datagram:  | 1 byte v/len | 1 byte TOS | 2 byte len | 16 more bytes | data
+ * IPv6 datagram:  | 4 byte v/tc/flow | 2 byte payload len | 1 byte next hdr |
+ *                 | 1 byte hop limit | 16 byte src | 16 byte dst | ext/data
+ * IPv6 ext hdr:   | 1 byte next hdr | 1 byte len | ...
+ * TCP segment:    | 2 byte src port | 2 byte dst port | 4 byte seq | 4 byte ack |
+ *                   2 byte flags | 2 byte window | 2 byte sum | 2 byte urg | data
+ * UDP datagram:   | 2 byte src port | 2 byte dst port | 2 byte len | 2 byte sum |
+ ******************************************************************************/
+
+/* how many packets ahead decode_batch prefetches */
+#define DEC_PREFETCH 4
+
+static inline uint16_t get16(const uint8_t *p) {
+  uint16_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohs(v);
+}
+
+static inline uint32_t get32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return ntohl(v);
+}
+
+/* every read below is preceded by a caplen test. offsets are kept in 32 bits
+ * while walking so an oversized length field cannot wrap them; since caplen
+ * is clamped to 64k, anything that passes a caplen test fits the uint16_t's */
+static inline void decode_one(const uint8_t *pkt, uint32_t caplen,
+                              struct pkt_dec *d) {
+  uint32_t off = 12, l4, hl, n;
+  uint16_t type, fo;
+  uint8_t nh;
+  int ext;
+
+  memset(d, 0, sizeof(*d));
+  if (caplen > 0xffff) caplen = 0xffff;
+
+  /***************************************************************************
+   * link layer
+   **************************************************************************/
+ again:
+  if (caplen < off + 2) goto trunc;
+  type = get16(pkt + off);
+
+  /* 802.2/802.3 encapsulation (RFC 1042). only SNAP carries an ethertype */
+  if (type <= 1500) {
+    d->flags |= DEC_LLC;
+    if (caplen < off + 2 + 8) goto trunc;
+    if ((pkt[off+2] != 0xaa) || (pkt[off+3] != 0xaa)) {
+      d->l3_off = off + 2 + 3; /* plain LLC e.g. STP; nothing more to decode */
+      return;
+    }
+    off += 2 + 6; /* length, LLC, OUI; now at the SNAP ethertype */
+    goto again;
+  }
+
+  /* vlan tags precede the real ethertype. QinQ stacks an S-tag (88a8, or
+   * the older 9100) before the customer 8100 tag. VID is low 12 bits of TCI */
+  if ((type == 0x8100) || (type == 0x88a8) || (type == 0x9100)) {
+    if (caplen < off + 4) goto trunc;
+    if (d->nvlan < DEC_MAX_VLAN) d->vid[d->nvlan] = get16(pkt + off + 2) & 0xfff;
+    if (d->nvlan < 0xff) d->nvlan++;
+    off += 4;
+    goto again;
+  }
+
+  d->ethertype = type;
+  off += 2;
+  d->l3_off = off;
+
+  /***************************************************************************
+   * IP datagram
+   **************************************************************************/
+  if (type == 0x0800) {
+    if (caplen < off + 20) goto trunc;
+    if ((pkt[off] >> 4) != 4) goto bad;
+    hl = (pkt[off] & 0x0f) * 4;
+    d->ipver = 4;
+    d->ip_len = get16(pkt + off + 2);
+    fo = get16(pkt + off + 6);
+    d->frag_off = (fo & 0x1fff) * 8;
+    d->ttl = pkt[off + 8];
+    d->proto = pkt[off + 9];
+    d->src = get32(pkt + off + 12);
+    d->dst = get32(pkt + off + 16);
+    if (hl < 20) goto bad;
+    d->flags |= DEC_L3;
+    /* if fragmented, TCP/UDP header only in initial fragment */
+    if (d->frag_off) goto frag;
+    l4 = off + hl;
+  } else if (type == 0x86dd) {
+    if (caplen < off + 40) goto trunc;
+    if ((pkt[off] >> 4) != 6) goto bad;
+    d->ipver = 6;
+    n = get16(pkt + off + 4) + 40;
+    d->ip_len = (n > 0xffff) ? 0xffff : n;
+    nh = pkt[off + 6];
+    d->ttl = pkt[off + 7];
+    d->flags |= DEC_L3;
+    l4 = off + 40;
+
+    /* walk a bounded number of extension headers to reach the transport */
+    for(n = 0; ; n++) {
+      switch(nh) {
+        case 0:   /* hop-by-hop options */
+        case 43:  /* routing */
+        case 60:  /* destination options */
+        case 135: /* mobility */
+        case 139: /* HIP */
+        case 140: /* shim6 */
+          ext = 0; /* length in 8-octet units, not counting the first 8 */
+          break;
+        case 51:  /* AH: length in 4-octet units, minus 2 */
+          ext = 1;
+          break;
+        case 44:  /* fragment: fixed 8 bytes */
+          ext = 2;
+          break;
+        default:
+          goto ext_done;
+      }
+      d->proto = nh;
+      if (n == DEC_MAX_EXTHDR) goto bad;
+      if (caplen < l4 + 8) goto trunc; /* every ext header is >= 8 bytes */
+      nh = pkt[l4];
+      if (ext == 0) l4 += (pkt[l4 + 1] + 1) * 8;
+      else if (ext == 1) l4 += (pkt[l4 + 1] + 2) * 4;
+      else {
+        d->frag_off = get16(pkt + l4 + 2) & 0xfff8;
+        l4 += 8;
+        if (d->frag_off) { d->proto = nh; goto frag; }
+      }
+    }
+   ext_done:
+    d->proto = nh;
+  } else {
+    return; /* arp, etc */
+  }
+
+  /***************************************************************************
+   * UDP datagram or TCP segment
+   **************************************************************************/
+  if (caplen < l4) goto trunc;
+  d->l4_off = l4;
+  switch(d->proto) {
+    case 6:
+      if (caplen < l4 + 20) goto trunc;
+      d->sport = get16(pkt + l4);
+      d->dport = get16(pkt + l4 + 2);
+      d->tcp_flags = pkt[l4 + 13];
+      d->flags |= DEC_L4;
+      hl = (pkt[l4 + 12] >> 4) * 4;
+      if (hl < 20) goto bad;
+      l4 += hl;
+      break;
+    case 17:
+      if (caplen < l4 + 8) goto trunc;
+      d->sport = get16(pkt + l4);
+      d->dport = get16(pkt + l4 + 2);
+      d->flags |= DEC_L4;
+      l4 += 8;
+      break;
+    default:
+      break;
+  }
+  if (caplen < l4) goto trunc;
+  d->pay_off = l4;
+  return;
+
+ frag:
+  d->flags |= DEC_FRAG;
+  return;
+
+ bad:
+  d->flags |= DEC_BAD;
+  return;
+
+ trunc:
+  d->flags |= DEC_TRUNC;
+  return;
+}
+
+void decode_pkt(const uint8_t *pkt, uint32_t caplen, struct pkt_dec *d) {
+  decode_one(pkt, caplen, d);
+}
+
+/* decode n packets into out[0..n-1]. returns how many reached layer 3.
+ * the headers of interest span up to ~90 bytes (QinQ + IPv6 + TCP) so the
+ * first two cache lines of a packet a few slots ahead are prefetched. */
+size_t decode_batch(const uint8_t * const *pkts, const uint32_t *caplens,
+                    size_t n, struct pkt_dec *out) {
+  size_t i, nl3 = 0;
+
+  for(i = 0; i < n; i++) {
+    if (i + DEC_PREFETCH < n) {
+      __builtin_prefetch(pkts[i + DEC_PREFETCH]);
+      __builtin_prefetch(pkts[i + DEC_PREFETCH] + 64);
+    }
+    decode_one(pkts[i], caplens[i], &out[i]);
+    nl3 += (out[i].flags & DEC_L3) ? 1 : 0;
+  }
+  return nl3;
+}
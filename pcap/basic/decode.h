@@ -0,0 +1,56 @@
+#ifndef __DECODE_H__
+#define __DECODE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * allocation-free decoder for ethernet frames
+ *
+ * decode_pkt fills one struct pkt_dec with the offsets of each layer and the
+ * fields most programs want. it never allocates, never asserts on packet data
+ * and never reads past caplen; a short or malformed packet just gets flagged.
+ * decode_batch does the same over an array of packets, prefetching ahead.
+ *
+ * handled: EthernetII, 802.3 LLC/SNAP, 802.1Q and QinQ (0x8100, 0x88a8,
+ * 0x9100) tags, IPv4 with options, IPv6 with extension headers, TCP, UDP.
+ *
+ * addresses are not copied. for IPv4 src/dst are given in host order; for
+ * IPv6 they are at pkt + l3_off + 8 and pkt + l3_off + 24 (16 bytes each).
+ */
+
+#define DEC_TRUNC 0x01  /* caplen ended inside a header */
+#define DEC_BAD   0x02  /* header failed a sanity check */
+#define DEC_FRAG  0x04  /* non-initial fragment; no transport header */
+#define DEC_LLC   0x08  /* 802.3 LLC/SNAP encapsulation */
+#define DEC_L3    0x10  /* IPv4/IPv6 header decoded; ipver, proto valid */
+#define DEC_L4    0x20  /* transport header decoded; ports valid */
+
+#define DEC_MAX_VLAN   2 /* vids recorded; deeper tags are skipped */
+#define DEC_MAX_EXTHDR 8 /* bound on IPv6 extension headers walked */
+
+struct pkt_dec {
+  uint16_t ethertype;  /* innermost ethertype */
+  uint16_t l3_off;     /* offset of the IP header (after the last ethertype) */
+  uint16_t l4_off;     /* offset of the transport header */
+  uint16_t pay_off;    /* offset of the transport payload */
+  uint16_t vid[DEC_MAX_VLAN]; /* outer, inner VLAN id */
+  uint16_t ip_len;     /* IPv4 total length, or IPv6 payload length + 40 */
+  uint16_t frag_off;   /* IPv4/IPv6 fragment offset in bytes */
+  uint16_t sport;
+  uint16_t dport;
+  uint32_t src;        /* IPv4 source, host order */
+  uint32_t dst;        /* IPv4 destination, host order */
+  uint8_t nvlan;       /* number of VLAN tags seen (may exceed DEC_MAX_VLAN) */
+  uint8_t ipver;       /* 4 or 6 */
+  uint8_t proto;       /* transport protocol, after any extension headers */
+  uint8_t ttl;         /* IPv4 ttl or IPv6 hop limit */
+  uint8_t tcp_flags;
+  uint8_t flags;       /* DEC_ flags above */
+};
+
+void decode_pkt(const uint8_t *pkt, uint32_t caplen, struct pkt_dec *d);
+size_t decode_batch(const uint8_t * const *pkts, const uint32_t *caplens,
+                    size_t n, struct pkt_dec *out);
+
+#endif
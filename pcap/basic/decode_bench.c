@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "decode.h"
+
+/*
+ * microbenchmark for decode_batch
+ *
+ * the pcap is mmap'd and indexed up front, so the timed loop measures only
+ * the decoder walking the packets in place, batch by batch. use a capture
+ * larger than the last level cache to see realistic memory behavior.
+ *
+ * ./decode_bench -r big.pcap -n 10 -b 256
+ */
+
+#define PCAP_GLOBAL_HDR_LEN 24
+#define PCAP_REC_HDR_LEN    16
+
+struct {
+  char *prog;
+  char *file;
+  int verbose;
+  int reps;
+  size_t batch;
+  char *buf;
+  size_t len;
+  size_t npkts;
+  const uint8_t **pkts;
+  uint32_t *caplens;
+  struct pkt_dec *out;
+} cfg = {
+  .reps = 10,
+  .batch = 256,
+};
+
+void usage(void) {
+  fprintf(stderr,"usage: %s [-v] -r <file> [-n <reps>] [-b <batch>]\n", cfg.prog);
+  exit(-1);
+}
+
+/* map the file and index its records. only native byte order is handled */
+int load(void) {
+  uint32_t magic, caplen;
+  struct stat s;
+  size_t off;
+  int fd, rc=-1;
+
+  if ( (fd = open(cfg.file, O_RDONLY)) == -1) {
+    fprintf(stderr,"can't open %s: %s\n", cfg.file, strerror(errno));
+    goto done;
+  }
+  if (fstat(fd, &s) == -1) {
+    fprintf(stderr,"can't stat %s: %s\n", cfg.file, strerror(errno));
+    goto done;
+  }
+  if (s.st_size < PCAP_GLOBAL_HDR_LEN) {
+    fprintf(stderr,"file lacks pcap header: %s\n", cfg.file);
+    goto done;
+  }
+  cfg.len = s.st_size;
+  cfg.buf = mmap(0, cfg.len, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
+  if (cfg.buf == MAP_FAILED) {
+    fprintf(stderr, "mmap %s: %s\n", cfg.file, strerror(errno));
+    cfg.buf = NULL;
+    goto done;
+  }
+  memcpy(&magic, cfg.buf, sizeof(magic));
+  if ((magic != 0xa1b2c3d4) && (magic != 0xa1b23c4d)) {
+    fprintf(stderr,"not a native-order pcap: %s\n", cfg.file);
+    goto done;
+  }
+
+  /* first pass counts records, second fills the index */
+  for(off = PCAP_GLOBAL_HDR_LEN; off + PCAP_REC_HDR_LEN <= cfg.len; ) {
+    memcpy(&caplen, cfg.buf + off + 8, sizeof(caplen));
+    if (off + PCAP_REC_HDR_LEN + caplen > cfg.len) break;
+    off += PCAP_REC_HDR_LEN + caplen;
+    cfg.npkts++;
+  }
+  cfg.pkts = malloc(cfg.npkts * sizeof(*cfg.pkts));
+  cfg.caplens = malloc(cfg.npkts * sizeof(*cfg.caplens));
+  cfg.out = malloc(cfg.batch * sizeof(*cfg.out));
+  if (!cfg.pkts || !cfg.caplens || !cfg.out) {
+    fprintf(stderr,"out of memory\n");
+    goto done;
+  }
+  cfg.npkts = 0;
+  for(off = PCAP_GLOBAL_HDR_LEN; off + PCAP_REC_HDR_LEN <= cfg.len; ) {
+    memcpy(&caplen, cfg.buf + off + 8, sizeof(caplen));
+    if (off + PCAP_REC_HDR_LEN + caplen > cfg.len) break;
+    cfg.pkts[cfg.npkts] = (const uint8_t*)cfg.buf + off + PCAP_REC_HDR_LEN;
+    cfg.caplens[cfg.npkts] = caplen;
+    off += PCAP_REC_HDR_LEN + caplen;
+    cfg.npkts++;
+  }
+
+  rc = 0;
+
+ done:
+  if (fd != -1) close(fd);
+  return rc;
+}
+
+/* tally flags over one batch; done outside the timed region */
+void tally(size_t n, unsigned long *counts) {
+  size_t i;
+  for(i=0; i < n; i++) {
+    if (cfg.out[i].ipver == 4) counts[0]++;
+    if (cfg.out[i].ipver == 6) counts[1]++;
+    if (cfg.out[i].flags & DEC_L4) counts[2]++;
+    if (cfg.out[i].flags & DEC_FRAG) counts[3]++;
+    if (cfg.out[i].flags & DEC_TRUNC) counts[4]++;
+    if (cfg.out[i].flags & DEC_BAD) counts[5]++;
+    if (cfg.out[i].nvlan) counts[6]++;
+  }
+}
+
+double elapsed(struct timespec *a, struct timespec *b) {
+  return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long counts[7] = {0}, total = 0, nl3 = 0;
+  struct timespec t0, t1;
+  size_t i, n;
+  int opt, r, rc=-1;
+  cfg.prog = argv[0];
+
+  while ( (opt=getopt(argc,argv,"vr:n:b:h")) != -1) {
+    switch(opt) {
+      case 'v': cfg.verbose++; break;
+      case 'r': cfg.file=strdup(optarg); break;
+      case 'n': cfg.reps=atoi(optarg); break;
+      case 'b': cfg.batch=atoi(optarg); break;
+      case 'h': default: usage(); break;
+    }
+  }
+  if ((cfg.file == NULL) || (cfg.reps < 1) || (cfg.batch < 1)) usage();
+  if (load() < 0) goto done;
+  if (cfg.npkts == 0) {
+    fprintf(stderr,"no packets in %s\n", cfg.file);
+    goto done;
+  }
+
+  /* one untimed pass to warm up and to count what the capture contains */
+  for(i=0; i < cfg.npkts; i += n) {
+    n = (cfg.npkts - i < cfg.batch) ? (cfg.npkts - i) : cfg.batch;
+    decode_batch(cfg.pkts + i, cfg.caplens + i, n, cfg.out);
+    tally(n, counts);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(r=0; r < cfg.reps; r++) {
+    for(i=0; i < cfg.npkts; i += n) {
+      n = (cfg.npkts - i < cfg.batch) ? (cfg.npkts - i) : cfg.batch;
+      nl3 += decode_batch(cfg.pkts + i, cfg.caplens + i, n, cfg.out);
+    }
+    total += cfg.npkts;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  double sec = elapsed(&t0, &t1);
+  printf("%s: %zu packets, %zu bytes\n", cfg.file, cfg.npkts, cfg.len);
+  printf(" ipv4 %lu ipv6 %lu l4 %lu frag %lu trunc %lu bad %lu vlan %lu\n",
+    counts[0], counts[1], counts[2], counts[3], counts[4], counts[5], counts[6]);
+  printf("decoded %lu packets (%lu to l3) in %.3f sec, batch %zu\n",
+    total, nl3, sec, cfg.batch);
+  printf("%.2f ns/packet (%.2f Mpps)\n", sec * 1e9 / total, total / sec / 1e6);
+  rc = 0;
+
+ done:
+  if (cfg.buf) munmap(cfg.buf, cfg.len);
+  free(cfg.pkts);
+  free(cfg.caplens);
+  free(cfg.out);
+  return rc;
+}
@@ -12,8 +12,13 @@
 #include <string.h>
 #include <setjmp.h>
 #include <assert.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 #include <pcap.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include "utarray.h"
 #include "utstring.h"
 
@@ -25,7 +30,7 @@ struct {
   char *file;
   char *filter;
   int fd,wd;
-  enum { none, sniff, one_file, read_dir, watch_dir } mode;
+  enum { none, sniff, one_file, read_dir, watch_dir, follow_dir } mode;
   sigjmp_buf jmp;
   pcap_t *pcap;
   struct bpf_program fp;
@@ -34,6 +39,7 @@ struct {
   int maxsz;
   int path_file_idx;
   int ticks;
+  int jobs;
   size_t eb_sz;
   union {
     /* see inotify(7) as inotify_event has a trailing name
@@ -54,7 +60,9 @@ void usage() {
                  "               -i <eth>   (read from interface), or\n"
                  "               -r <file>  (read one pcap file),  or\n"
                  "               -d <dir>   (read directory of pcaps),  or\n"
-                 "               -w <dir>   (watch incoming pcap directory)*\n"
+                 "               -j <n>     (-d mode: files read in parallel)\n"
+                 "               -w <dir>   (watch incoming pcap directory)*, or\n"
+                 "               -W <dir>   (as -w, but follow the file being written)\n"
                  "\n"
                  " * -w mode is useful with externally-generated,\n"
                  "           pcap written at time intervals, e.g.\n"
@@ -75,16 +83,17 @@ void cb(u_char *data, const struct pcap_pkthdr *hdr, const u_char *pkt) {
   if (cfg.verbose) fprintf(stderr,"packet of length %d\n", hdr->len);
 }
 
-int set_filter() {
+int set_filter(pcap_t *pcap, struct bpf_program *fp) {
   if (cfg.filter == NULL) return 0;
 
   int rc=-1;
-  if ( (rc = pcap_compile(cfg.pcap, &cfg.fp, cfg.filter, 0, PCAP_NETMASK_UNKNOWN)) != 0) {
-    fprintf(stderr, "error in filter expression: %s\n", cfg.err);
+  if ( (rc = pcap_compile(pcap, fp, cfg.filter, 0, PCAP_NETMASK_UNKNOWN)) != 0) {
+    fprintf(stderr, "error in filter expression: %s\n", pcap_geterr(pcap));
     goto done;
   }
-  if ( (rc = pcap_setfilter(cfg.pcap, &cfg.fp)) != 0) {
-    fprintf(stderr, "can't set filter expression: %s\n", cfg.err);
+  if ( (rc = pcap_setfilter(pcap, fp)) != 0) {
+    fprintf(stderr, "can't set filter expression: %s\n", pcap_geterr(pcap));
+    pcap_freecode(fp); /* the caller frees it only on success */
     goto done;
   }
   rc=0;
@@ -99,7 +108,7 @@ int ingest_pcap(char *file) {
   if (cfg.verbose) fprintf(stderr,"reading file %s\n", cfg.path);
   cfg.pcap = pcap_open_offline(cfg.path, cfg.err);
   if (cfg.pcap==NULL)  {fprintf(stderr,"can't open %s: %s\n", cfg.path, cfg.err); goto done;}
-  if (set_filter()) goto done;
+  if (set_filter(cfg.pcap, &cfg.fp)) goto done;
   rc = pcap_loop(cfg.pcap, 0, cb, NULL);  
   pcap_close(cfg.pcap); cfg.pcap=NULL;
 
@@ -154,26 +163,415 @@ static int get_files(char *dir, UT_array *filenames) {
   return rc;
 }
 
+/*******************************************************************************
+ * parallel read of a pcap directory (-d mode)
+ *
+ * worker threads each take the next file in name order, read and filter it
+ * into an in-memory run of records, and mark it ready. the main thread is
+ * the ordered merge stage: it waits for file i, replays its records through
+ * cb, then moves on to file i+1. so cb sees exactly the packet order of a
+ * serial read, while the reading and filtering is spread over the cores.
+ * workers stay at most 2*jobs files ahead of the merge to bound memory.
+ ******************************************************************************/
+
+/* records are a pcap_pkthdr followed by caplen bytes, padded to 8 */
+#define REC_ALIGN(n) (((n) + 7) & ~((size_t)7))
+
+struct job {
+  char *file;
+  char *buf;     /* packed records */
+  size_t len;    /* bytes used in buf */
+  size_t sz;     /* bytes allocated in buf */
+  size_t npkts;
+  int rc;
+  int ready;
+  double read_sec;
+};
+
+struct {
+  struct job *jobs;
+  size_t njobs;
+  size_t next;    /* next file a worker will take */
+  size_t merged;  /* files replayed by the merge stage so far */
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_mutex_t compile_mutex; /* pcap_compile is not reentrant everywhere */
+} pool = {
+  .mutex = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER,
+  .compile_mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+double elapsed(struct timespec *a, struct timespec *b) {
+  return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+void keep_cb(u_char *data, const struct pcap_pkthdr *hdr, const u_char *pkt) {
+  struct job *j = (struct job*)data;
+  size_t need = REC_ALIGN(sizeof(*hdr) + hdr->caplen);
+  char *b;
+
+  if (j->rc) return;
+  if (j->len + need > j->sz) {
+    size_t sz = j->sz ? (j->sz * 2) : (1024*1024);
+    while (j->len + need > sz) sz *= 2;
+    if ( (b = realloc(j->buf, sz)) == NULL) {
+      fprintf(stderr,"out of memory reading %s\n", j->file);
+      j->rc = -1;
+      return;
+    }
+    j->buf = b;
+    j->sz = sz;
+  }
+  memcpy(j->buf + j->len, hdr, sizeof(*hdr));
+  memcpy(j->buf + j->len + sizeof(*hdr), pkt, hdr->caplen);
+  j->len += need;
+  j->npkts++;
+}
+
+int read_job(struct job *j) {
+  char err[PCAP_ERRBUF_SIZE];
+  struct bpf_program fp;
+  struct timespec t0, t1;
+  pcap_t *pcap;
+  int rc = -1, fc, compiled = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  pcap = pcap_open_offline(j->file, err);
+  if (pcap == NULL) {fprintf(stderr,"can't open %s: %s\n", j->file, err); goto done;}
+  pthread_mutex_lock(&pool.compile_mutex);
+  fc = set_filter(pcap, &fp);
+  pthread_mutex_unlock(&pool.compile_mutex);
+  if (fc) goto done;
+  compiled = (cfg.filter != NULL);
+  if (pcap_loop(pcap, 0, keep_cb, (u_char*)j) < 0) {
+    fprintf(stderr,"error reading %s: %s\n", j->file, pcap_geterr(pcap));
+    goto done;
+  }
+  rc = j->rc;
+
+ done:
+  if (compiled) pcap_freecode(&fp);
+  if (pcap) pcap_close(pcap);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  j->read_sec = elapsed(&t0, &t1);
+  return rc;
+}
+
+void *worker(void *unused) {
+  struct job *j;
+
+  while (1) {
+    pthread_mutex_lock(&pool.mutex);
+    while ((pool.next < pool.njobs) &&
+           (pool.next >= pool.merged + 2 * cfg.jobs)) {
+      pthread_cond_wait(&pool.cond, &pool.mutex);
+    }
+    if (pool.next == pool.njobs) {
+      pthread_mutex_unlock(&pool.mutex);
+      break;
+    }
+    j = &pool.jobs[pool.next++];
+    pthread_mutex_unlock(&pool.mutex);
+
+    j->rc = read_job(j);
+
+    pthread_mutex_lock(&pool.mutex);
+    j->ready = 1;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.mutex);
+  }
+  return NULL;
+}
+
+/* the ordered merge stage; runs in the main thread */
+int read_dir_parallel(UT_array *filenames) {
+  struct timespec t0, t1, m0, m1;
+  struct pcap_pkthdr *hdr;
+  unsigned long total = 0;
+  pthread_t *tids = NULL;
+  size_t i, off;
+  int n, nt = 0, rc = -1;
+  struct job *j;
+  char **f;
+
+  pool.njobs = utarray_len(filenames);
+  pool.jobs = calloc(pool.njobs ? pool.njobs : 1, sizeof(struct job));
+  tids = calloc(cfg.jobs, sizeof(pthread_t));
+  if (!pool.jobs || !tids) {fprintf(stderr,"out of memory\n"); goto done;}
+  for(i=0; i < pool.njobs; i++) {
+    f = (char**)utarray_eltptr(filenames, i);
+    pool.jobs[i].file = *f;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(nt=0; nt < cfg.jobs; nt++) {
+    if ( (n = pthread_create(&tids[nt], NULL, worker, NULL)) != 0) {
+      fprintf(stderr,"pthread_create: %s\n", strerror(n));
+      break;
+    }
+  }
+  if (nt == 0) goto done;
+
+  for(i=0; i < pool.njobs; i++) {
+    j = &pool.jobs[i];
+    pthread_mutex_lock(&pool.mutex);
+    while (!j->ready) pthread_cond_wait(&pool.cond, &pool.mutex);
+    pthread_mutex_unlock(&pool.mutex);
+
+    clock_gettime(CLOCK_MONOTONIC, &m0);
+    for(off=0; off < j->len; off += REC_ALIGN(sizeof(*hdr) + hdr->caplen)) {
+      hdr = (struct pcap_pkthdr*)(j->buf + off);
+      cb(NULL, hdr, (u_char*)hdr + sizeof(*hdr));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &m1);
+    total += j->npkts;
+    fprintf(stderr,"%s: %zu packets, %.1f MB, read %.3f sec (%.1f MB/s), "
+                   "cb %.3f sec%s\n", j->file, j->npkts, j->len/(1024.0*1024),
+       j->read_sec, j->read_sec ? (j->len/(1024.0*1024))/j->read_sec : 0,
+       elapsed(&m0, &m1), j->rc ? " (error)" : "");
+    free(j->buf);
+    j->buf = NULL;
+
+    pthread_mutex_lock(&pool.mutex);
+    pool.merged++;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.mutex);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  fprintf(stderr,"%zu files, %lu packets in %.3f sec with %d jobs\n",
+    pool.njobs, total, elapsed(&t0, &t1), nt);
+  rc = 0;
+
+ done:
+  while (nt > 0) pthread_join(tids[--nt], NULL);
+  free(pool.jobs);
+  free(tids);
+  return rc;
+}
+
+/*******************************************************************************
+ * follow the pcap currently being written (-W mode)
+ *
+ * rather than wait for IN_CLOSE_WRITE, we read complete records as they are
+ * appended to the newest file in the directory. libpcap can't resume a file
+ * at an offset, so the records are parsed here and run through the filter
+ * with pcap_offline_filter.
+ *
+ * two kinds of writer need handling. one write(2)s records, so the file only
+ * ever holds what was written (possibly ending mid-record) and IN_MODIFY
+ * tells us when it grows. the other, like pcap-record, ftruncate's the file
+ * to its full size up front and stores records through a shared mapping; the
+ * unwritten tail reads as zeros and no IN_MODIFY is generated for the stores,
+ * so we also poll on the timer tick. a record is taken when it ends exactly
+ * at end of file, or when the record header after it is non-zero (so it was
+ * completely stored before the next one was begun). an all-zero record header
+ * means we have caught up with the writer.
+ ******************************************************************************/
+
+#define PCAP_GLOBAL_HDR_LEN 24
+#define PCAP_REC_HDR_LEN    16
+#define TAIL_BUFSZ (1024*1024)
+#define TAIL_MAXCAP (256*1024)
+
+struct {
+  int fd;
+  char name[NAME_MAX+1];  /* file being followed */
+  char last[NAME_MAX+1];  /* most recently finished file */
+  off_t off;              /* next record offset; 0 until global header read */
+  int swap;               /* file is opposite byte order */
+  int nsec;               /* timestamps in nanoseconds */
+  int linktype;
+  pcap_t *dead;           /* for compiling the filter */
+  struct bpf_program fp;
+  int have_fp;
+  char *buf;
+} tail = {
+  .fd = -1,
+};
+
+static uint32_t tail32(uint32_t v) { return tail.swap ? __builtin_bswap32(v) : v; }
+
+int follow_header(off_t size) {
+  uint32_t h[PCAP_GLOBAL_HDR_LEN/sizeof(uint32_t)];
+
+  if (size < PCAP_GLOBAL_HDR_LEN) return 0; /* not written yet */
+  if (pread(tail.fd, h, sizeof(h), 0) != sizeof(h)) {
+    fprintf(stderr,"pread %s: %s\n", tail.name, strerror(errno));
+    return -1;
+  }
+  switch(h[0]) {
+    case 0xa1b2c3d4: tail.swap = 0; tail.nsec = 0; break;
+    case 0xd4c3b2a1: tail.swap = 1; tail.nsec = 0; break;
+    case 0xa1b23c4d: tail.swap = 0; tail.nsec = 1; break;
+    case 0x4d3cb2a1: tail.swap = 1; tail.nsec = 1; break;
+    case 0:          return 0; /* preallocated but header not stored yet */
+    default:
+      fprintf(stderr,"%s: not a pcap file\n", tail.name);
+      return -1;
+  }
+  tail.linktype = tail32(h[5]);
+  if (cfg.filter) {
+    tail.dead = pcap_open_dead(tail.linktype, cfg.maxsz);
+    if (tail.dead == NULL) {fprintf(stderr,"pcap_open_dead failed\n"); return -1;}
+    if (set_filter(tail.dead, &tail.fp)) return -1;
+    tail.have_fp = 1;
+  }
+  tail.off = PCAP_GLOBAL_HDR_LEN;
+  return 1;
+}
+
+/* deliver any complete records appended since the last call */
+int follow_read(void) {
+  struct pcap_pkthdr hdr;
+  uint32_t h[4], nx[4];
+  size_t pos, end;
+  ssize_t nr;
+  off_t fend;
+  struct stat s;
+  int more, rc;
+
+  if (tail.fd == -1) return 0;
+  if (fstat(tail.fd, &s) == -1) {
+    fprintf(stderr,"fstat %s: %s\n", tail.name, strerror(errno));
+    return -1;
+  }
+  if ((tail.off == 0) && ((rc = follow_header(s.st_size)) <= 0)) return rc;
+
+  do {
+    more = 1;
+    nr = pread(tail.fd, tail.buf, TAIL_BUFSZ, tail.off);
+    if (nr < 0) {
+      fprintf(stderr,"pread %s: %s\n", tail.name, strerror(errno));
+      return -1;
+    }
+    for(pos = 0; pos + PCAP_REC_HDR_LEN <= nr; pos = end) {
+      memcpy(h, tail.buf + pos, sizeof(h));
+      if ((h[0] == 0) && (h[2] == 0)) { more = 0; break; } /* zero tail */
+      h[2] = tail32(h[2]);
+      if (h[2] > TAIL_MAXCAP) {
+        fprintf(stderr,"%s: bad record at offset %lu\n", tail.name,
+          (unsigned long)(tail.off + pos));
+        return -1;
+      }
+      end = pos + PCAP_REC_HDR_LEN + h[2];
+      fend = tail.off + end;
+      if (fend > s.st_size) { more = 0; break; } /* partly written */
+      if (fend < s.st_size) {
+        if (end + PCAP_REC_HDR_LEN > nr) break; /* re-read from pos */
+        memcpy(nx, tail.buf + end, sizeof(nx));
+        if ((nx[0] == 0) && (nx[2] == 0)) { more = 0; break; }
+      }
+      hdr.ts.tv_sec = tail32(h[0]);
+      hdr.ts.tv_usec = tail.nsec ? (tail32(h[1]) / 1000) : tail32(h[1]);
+      hdr.caplen = h[2];
+      hdr.len = tail32(h[3]);
+      const u_char *pkt = (u_char*)tail.buf + pos + PCAP_REC_HDR_LEN;
+      if (tail.have_fp && !pcap_offline_filter(&tail.fp, &hdr, pkt)) continue;
+      cb(NULL, &hdr, pkt);
+    }
+    tail.off += pos;
+  } while (more && (pos > 0));
+
+  return 0;
+}
+
+void follow_close(void) {
+  if (tail.fd == -1) return;
+  if (cfg.verbose) fprintf(stderr,"finished %s at offset %lu\n", tail.name,
+                           (unsigned long)tail.off);
+  close(tail.fd);
+  tail.fd = -1;
+  if (tail.have_fp) pcap_freecode(&tail.fp);
+  if (tail.dead) pcap_close(tail.dead);
+  tail.have_fp = 0;
+  tail.dead = NULL;
+  memcpy(tail.last, tail.name, sizeof(tail.last));
+  tail.name[0] = '\0';
+}
+
+/* finish the current file, if any, and start following name */
+int follow_open(char *name) {
+  if (tail.fd != -1) {
+    if (follow_read() < 0) return -1;
+    follow_close();
+  }
+  if (tail.buf == NULL) {
+    if ( (tail.buf = malloc(TAIL_BUFSZ)) == NULL) {
+      fprintf(stderr,"out of memory\n");
+      return -1;
+    }
+  }
+  strncpy(&cfg.path[cfg.path_file_idx], name, PATH_MAX-cfg.path_file_idx);
+  snprintf(tail.name, sizeof(tail.name), "%s", name);
+  if (cfg.verbose) fprintf(stderr,"following file %s\n", cfg.path);
+  tail.off = 0;
+  tail.fd = open(cfg.path, O_RDONLY);
+  if (tail.fd == -1) {
+    fprintf(stderr,"can't open %s: %s\n", cfg.path, strerror(errno));
+    return -1;
+  }
+  return follow_read();
+}
+
+int follow_event(struct inotify_event *ev) {
+  int current = (tail.fd != -1) && !strcmp(ev->name, tail.name);
+
+  if (ev->mask & IN_CREATE) return follow_open(ev->name);
+
+  if (ev->mask & IN_MODIFY) {
+    if (current) return follow_read();
+    /* started up while a file was being written; pick it up */
+    if ((tail.fd == -1) && strcmp(ev->name, tail.last)) return follow_open(ev->name);
+    return 0;
+  }
+
+  if ((ev->mask & IN_CLOSE_WRITE) && current) {
+    if (follow_read() < 0) return -1;
+    follow_close();
+  }
+  return 0;
+}
+
+/* one second ticks, or faster when following to keep latency under a
+ * second for writers that don't generate IN_MODIFY */
+void arm_timer(void) {
+  struct itimerval it;
+  memset(&it, 0, sizeof(it));
+  if (cfg.mode == follow_dir) it.it_value.tv_usec = 200*1000;
+  else it.it_value.tv_sec = 1;
+  setitimer(ITIMER_REAL, &it, NULL);
+}
+
 int main(int argc, char *argv[]) {
   struct inotify_event *ev, *nx;
-  int opt, rc, n, fl, num_bytes;
+  int opt, rc, n, fl, num_bytes, mask;
   UT_array *filenames;
   size_t sz;
   cfg.prog = argv[0];
+  cfg.jobs = sysconf(_SC_NPROCESSORS_ONLN);
   sigs[0] = SIGRTMIN+0;  /* we'll choose this RT signal for I/O readiness */
+  struct option opts[] = {
+    {"jobs", required_argument, NULL, 'j'},
+    {NULL, 0, NULL, 0},
+  };
 
-  while ( (opt=getopt(argc,argv,"vr:i:w:f:d:h")) != -1) {
+  while ( (opt=getopt_long(argc,argv,"vr:i:w:W:f:d:j:h",opts,NULL)) != -1) {
     switch(opt) {
       case 'v': cfg.verbose++; break;
       case 'r': cfg.mode = one_file;  cfg.file=strdup(optarg); break;
       case 'i': cfg.mode = sniff;     cfg.dev=strdup(optarg); break; 
       case 'w': cfg.mode = watch_dir; cfg.dir=strdup(optarg); break; 
+      case 'W': cfg.mode = follow_dir; cfg.dir=strdup(optarg); break; 
       case 'd': cfg.mode = read_dir;  cfg.dir=strdup(optarg); break; 
       case 'f': cfg.filter=strdup(optarg); break; 
+      case 'j': cfg.jobs=atoi(optarg); break;
       case 'h': default: usage(); break;
     }
   }
   if (cfg.mode==none) usage();
+  if (cfg.jobs < 1) cfg.jobs = 1;
 
   /* block all signals. we stay blocked always except in sugsuspend */
   sigset_t all;
@@ -194,10 +592,13 @@ int main(int argc, char *argv[]) {
 
   switch(cfg.mode) { // initial setup
     case watch_dir:
+    case follow_dir:
       /* setup an inotify watch on the pcap directory. */
       cfg.fd = inotify_init();
       if (cfg.fd==-1) {fprintf(stderr, "inotify_init: %s\n", strerror(errno)); goto done;}
-      cfg.wd = inotify_add_watch(cfg.fd, cfg.dir, IN_CLOSE_WRITE);
+      mask = IN_CLOSE_WRITE;
+      if (cfg.mode == follow_dir) mask |= IN_CREATE | IN_MODIFY;
+      cfg.wd = inotify_add_watch(cfg.fd, cfg.dir, mask);
       if (cfg.wd==-1) {fprintf(stderr,"inotify_add_watch: %s",strerror(errno)); goto done;}
       /* request SIGRTMIN to our pid when fd is ready; see fcntl(2) */
       fl = fcntl(cfg.fd, F_GETFL);
@@ -218,7 +619,7 @@ int main(int argc, char *argv[]) {
       if (cfg.fd<0) {fprintf(stderr,"can't get pcap descriptor\n"); goto done;}
       rc = pcap_setnonblock(cfg.pcap, 1, cfg.err);
       if (rc== -1) {fprintf(stderr,"can't set pcap nonblock: %s\n",cfg.err); goto done;}
-      set_filter();
+      set_filter(cfg.pcap, &cfg.fp);
       /* request signal SIGRTMIN to be sent to us when descriptor ready */
       fl = fcntl(cfg.fd, F_GETFL); 
       fl |= O_ASYNC;                      /* want a signal on fd ready */
@@ -234,8 +635,7 @@ int main(int argc, char *argv[]) {
     case read_dir:
       utarray_new(filenames, &ut_str_icd);
       get_files(cfg.dir, filenames);
-      char **f=NULL;
-      while( (f=(char**)utarray_next(filenames,f))) ingest_pcap(*f);
+      read_dir_parallel(filenames);
       utarray_free(filenames);
       goto done;
       break;
@@ -247,13 +647,15 @@ int main(int argc, char *argv[]) {
 
   switch (signo) {
     case 0:       /* initial setup. no signal yet */
-      alarm(1);
+      arm_timer();
       break;
     case SIGALRM: /* periodic work and reschedule */
       if ((++cfg.ticks % 10) == 0) do_stats();
-      alarm(1);
-      if (cfg.mode != watch_dir) break;
-      /* in watch_Dir mode, check if there is data on inotify descriptor */
+      arm_timer();
+      if (cfg.mode == follow_dir) {
+        if (follow_read() < 0) goto done;
+      } else if (cfg.mode != watch_dir) break;
+      /* in watch_dir mode, check if there is data on inotify descriptor */
       if (ioctl(cfg.fd,FIONREAD,&num_bytes) != 0) {
         fprintf(stderr,"ioctl error %s\n",strerror(errno));
         goto done;
@@ -286,6 +688,19 @@ int main(int argc, char *argv[]) {
             }
           }
           break;
+        case follow_dir:
+          while ( (rc=read(cfg.fd,&cfg.e.eb,cfg.eb_sz)) > 0) {
+            for(ev = &cfg.e.eb; rc > 0; ev = nx) {
+
+              sz = sizeof(*ev) + ev->len;
+              nx = (struct inotify_event*)((char*)ev + sz);
+              rc -= sz;
+
+              if (ev->len == 0) continue;
+              if (follow_event(ev)) goto done;
+            }
+          }
+          break;
         default: assert(0); break;
       }
 
@@ -303,5 +718,6 @@ int main(int argc, char *argv[]) {
 done:
   if (cfg.pcap) pcap_close(cfg.pcap);
   if (cfg.fd > 0) close(cfg.fd);
+  follow_close();
   return 0;
 }
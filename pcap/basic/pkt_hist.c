@@ -0,0 +1,293 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <pcap.h>
+#include "pkt_hist.h"
+
+/*
+ * histogram of frame lengths per interface and direction, published
+ * to shared memory for pkt_hist_read or a dashboard to map and read.
+ *
+ * each interface is opened twice, once per direction (pcap_setdirection)
+ * so the direction comes free with the handle. the per-packet work is
+ * one bucket computation and three increments; see pkt_hist.h.
+ *
+ *  ./pkt_hist -i eth0 -i eth1
+ *  ./pkt_hist_read -t 1
+ */
+
+struct handle {
+  pcap_t *pcap;
+  int fd;
+  struct hist *h;
+};
+
+struct {
+  int verbose;
+  char *prog;
+  char *shm_name;
+  char *file;
+  int keep;
+  int snaplen;
+  int publish_ms;
+  char err[PCAP_ERRBUF_SIZE];
+  int signal_fd;
+  int epoll_fd;
+  int shm_fd;
+  struct hist_shm *shm;
+  struct hist_if ifs[HIST_MAX_IF];  /* private counts, copied to shm */
+  int nif;
+  struct handle handles[HIST_MAX_IF * 2];
+  int nhandles;
+  uint64_t last_publish;
+} cfg = {
+  .shm_name = HIST_SHM,
+  .snaplen = 64,  /* lengths only; no need for the payload */
+  .publish_ms = 100,
+  .signal_fd = -1,
+  .epoll_fd = -1,
+  .shm_fd = -1,
+};
+
+void usage() {
+  fprintf(stderr,"usage: %s [-v] -i <eth> [-i <eth> ...] | -r <file>\n"
+                 "               -n <shm-name>   (default %s)\n"
+                 "               -p <ms>         (publish interval)\n"
+                 "               -k              (keep shm at exit)\n"
+                 "\n",
+          cfg.prog, HIST_SHM);
+  exit(-1);
+}
+
+/* signals that we'll accept via signalfd in epoll */
+int sigs[] = {SIGHUP,SIGTERM,SIGINT,SIGQUIT,SIGALRM};
+
+uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+void cb(u_char *data, const struct pcap_pkthdr *hdr, const u_char *pkt) {
+  struct hist *h = (struct hist*)data;
+  h->count[hist_bucket(hdr->len)]++;
+  h->pkts++;
+  h->bytes += hdr->len;
+}
+
+void publish(void) {
+  cfg.last_publish = now_ms();
+  hist_publish(cfg.shm, cfg.ifs, cfg.last_publish);
+}
+
+int setup_shm(void) {
+  int rc = -1;
+
+  cfg.shm_fd = shm_open(cfg.shm_name, O_RDWR|O_CREAT, 0644);
+  if (cfg.shm_fd == -1) {
+    fprintf(stderr,"shm_open %s: %s\n", cfg.shm_name, strerror(errno));
+    goto done;
+  }
+  if (ftruncate(cfg.shm_fd, sizeof(struct hist_shm)) == -1) {
+    fprintf(stderr,"ftruncate: %s\n", strerror(errno));
+    goto done;
+  }
+  cfg.shm = mmap(NULL, sizeof(struct hist_shm), PROT_READ|PROT_WRITE,
+                 MAP_SHARED, cfg.shm_fd, 0);
+  if (cfg.shm == MAP_FAILED) {
+    fprintf(stderr,"mmap: %s\n", strerror(errno));
+    cfg.shm = NULL;
+    goto done;
+  }
+  memset(cfg.shm, 0, sizeof(struct hist_shm));
+  cfg.shm->sub_bits = HIST_SUB_BITS;
+  cfg.shm->nif = cfg.nif;
+  publish();
+  cfg.shm->magic = HIST_MAGIC; /* last, so readers see a complete segment */
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+int add_if(char *name) {
+  if (cfg.nif == HIST_MAX_IF) {
+    fprintf(stderr,"too many interfaces (max %d)\n", HIST_MAX_IF);
+    return -1;
+  }
+  snprintf(cfg.ifs[cfg.nif].name, sizeof(cfg.ifs[cfg.nif].name), "%s", name);
+  cfg.nif++;
+  return 0;
+}
+
+int new_epoll(int events, int fd) {
+  int rc;
+  struct epoll_event ev;
+  memset(&ev,0,sizeof(ev)); // placate valgrind
+  ev.events = events;
+  ev.data.fd= fd;
+  if (cfg.verbose) fprintf(stderr,"adding fd %d to epoll\n", fd);
+  rc = epoll_ctl(cfg.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  if (rc == -1) {
+    fprintf(stderr,"epoll_ctl: %s\n", strerror(errno));
+  }
+  return rc;
+}
+
+/* open one capture handle for interface i in direction d */
+int open_handle(int i, int d) {
+  struct handle *h = &cfg.handles[cfg.nhandles];
+  char *dev = cfg.ifs[i].name;
+
+  if ( (h->pcap = pcap_create(dev, cfg.err)) == NULL) {
+    fprintf(stderr,"can't open %s: %s\n", dev, cfg.err);
+    return -1;
+  }
+  if (pcap_set_promisc(h->pcap, 1))           {fprintf(stderr,"pcap_set_promisc failed\n"); return -1;}
+  if (pcap_set_snaplen(h->pcap, cfg.snaplen)) {fprintf(stderr,"pcap_set_snaplen failed\n"); return -1;}
+  if (pcap_activate(h->pcap))                 {fprintf(stderr,"pcap_activate %s: %s\n", dev, pcap_geterr(h->pcap)); return -1;}
+  if (pcap_setdirection(h->pcap, (d == HIST_IN) ? PCAP_D_IN : PCAP_D_OUT)) {
+    fprintf(stderr,"pcap_setdirection %s: %s\n", dev, pcap_geterr(h->pcap));
+    return -1;
+  }
+  if (pcap_setnonblock(h->pcap, 1, cfg.err)) {fprintf(stderr,"pcap_setnonblock: %s\n", cfg.err); return -1;}
+  h->fd = pcap_get_selectable_fd(h->pcap);
+  if (h->fd == -1)                            {fprintf(stderr,"pcap_get_sel_fd failed\n"); return -1;}
+  h->h = &cfg.ifs[i].dir[d];
+  cfg.nhandles++;
+  return new_epoll(EPOLLIN, h->fd);
+}
+
+int handle_signal() {
+  int rc=-1;
+  struct signalfd_siginfo info;
+
+  if (read(cfg.signal_fd, &info, sizeof(info)) != sizeof(info)) {
+    fprintf(stderr,"failed to read signal fd buffer\n");
+    goto done;
+  }
+
+  switch(info.ssi_signo) {
+    case SIGALRM:
+      publish(); /* even if idle, so readers see a fresh timestamp */
+      alarm(1);
+      break;
+    default:
+      fprintf(stderr,"got signal %d\n", info.ssi_signo);
+      goto done;
+      break;
+  }
+
+ rc = 0;
+
+ done:
+  return rc;
+}
+
+int get_pcap_data(struct handle *h) {
+  if (pcap_dispatch(h->pcap, 10000, cb, (u_char*)h->h) < 0) {
+    pcap_perror(h->pcap, "pcap error: ");
+    return -1;
+  }
+  if (now_ms() >= cfg.last_publish + cfg.publish_ms) publish();
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  struct epoll_event ev;
+  int i, n, opt, rc = -1;
+  pcap_t *p = NULL;
+  cfg.prog = argv[0];
+
+  while ( (opt=getopt(argc,argv,"vi:r:n:p:kh")) != -1) {
+    switch(opt) {
+      case 'v': cfg.verbose++; break;
+      case 'i': if (add_if(optarg)) goto done; break;
+      case 'r': cfg.file=strdup(optarg); break;
+      case 'n': cfg.shm_name=strdup(optarg); break;
+      case 'p': cfg.publish_ms=atoi(optarg); break;
+      case 'k': cfg.keep=1; break;
+      case 'h': default: usage(); break;
+    }
+  }
+  if ((cfg.nif == 0) && (cfg.file == NULL)) usage();
+  if (cfg.nif && cfg.file) usage();
+
+  /* from a file the direction is unknown; count it all as "any" */
+  if (cfg.file) {
+    if (add_if(basename(cfg.file))) goto done;
+    if (setup_shm() < 0) goto done;
+    if ( (p = pcap_open_offline(cfg.file, cfg.err)) == NULL) {
+      fprintf(stderr,"can't open %s: %s\n", cfg.file, cfg.err);
+      goto done;
+    }
+    rc = pcap_loop(p, 0, cb, (u_char*)&cfg.ifs[0].dir[HIST_ANY]);
+    publish();
+    pcap_close(p);
+    goto done;
+  }
+
+  if (setup_shm() < 0) goto done;
+
+  /* block all signals. we take signals synchronously via signalfd */
+  sigset_t all;
+  sigfillset(&all);
+  sigprocmask(SIG_SETMASK,&all,NULL);
+
+  /* a few signals we'll accept via our signalfd */
+  sigset_t sw;
+  sigemptyset(&sw);
+  for(n=0; n < sizeof(sigs)/sizeof(*sigs); n++) sigaddset(&sw, sigs[n]);
+
+  cfg.signal_fd = signalfd(-1, &sw, 0);
+  if (cfg.signal_fd == -1) {
+    fprintf(stderr,"signalfd: %s\n", strerror(errno));
+    goto done;
+  }
+
+  cfg.epoll_fd = epoll_create(1);
+  if (cfg.epoll_fd == -1) {
+    fprintf(stderr,"epoll: %s\n", strerror(errno));
+    goto done;
+  }
+  if (new_epoll(EPOLLIN, cfg.signal_fd)) goto done;
+
+  for(i=0; i < cfg.nif; i++) {
+    if (open_handle(i, HIST_IN)) goto done;
+    if (open_handle(i, HIST_OUT)) goto done;
+  }
+
+  alarm(1);
+
+  while (epoll_wait(cfg.epoll_fd, &ev, 1, -1) > 0) {
+    if (cfg.verbose > 1)  fprintf(stderr,"epoll reports fd %d\n", ev.data.fd);
+    if (ev.data.fd == cfg.signal_fd) { if (handle_signal() < 0) goto done; continue; }
+    for(i=0; i < cfg.nhandles; i++) {
+      if (ev.data.fd != cfg.handles[i].fd) continue;
+      if (get_pcap_data(&cfg.handles[i]) < 0) goto done;
+      break;
+    }
+  }
+  rc = 0;
+
+done:
+  for(i=0; i < cfg.nhandles; i++) pcap_close(cfg.handles[i].pcap);
+  if (cfg.shm) munmap(cfg.shm, sizeof(struct hist_shm));
+  if (cfg.shm_fd != -1) {
+    close(cfg.shm_fd);
+    if (!cfg.keep) shm_unlink(cfg.shm_name);
+  }
+  if (cfg.signal_fd != -1) close(cfg.signal_fd);
+  if (cfg.epoll_fd != -1) close(cfg.epoll_fd);
+  return rc;
+}
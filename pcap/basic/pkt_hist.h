@@ -0,0 +1,89 @@
+#ifndef __PKT_HIST_H__
+#define __PKT_HIST_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * log-linear histogram of frame lengths, shared by pkt_hist (the writer)
+ * and pkt_hist_read. lengths below 2^HIST_SUB_BITS get a bucket each; above
+ * that every power of two is split into 2^HIST_SUB_BITS equal buckets, so
+ * the relative bucket width is constant (1/32 with 5 sub bits: the buckets
+ * around 1500 are 32 bytes wide).
+ *
+ * the writer counts into private histograms and periodically copies them
+ * into the shared segment inside a seqlock: seq is odd while a copy is in
+ * progress. a reader copies the segment out and retries if seq was odd or
+ * changed meanwhile. readers never write to the segment.
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS  ((16 - HIST_SUB_BITS + 1) << HIST_SUB_BITS) /* to 64k */
+#define HIST_MAX_IF   8
+#define HIST_MAGIC    0x68697374 /* "hist" */
+#define HIST_SHM      "/pkt_hist"
+
+enum { HIST_IN, HIST_OUT, HIST_ANY, HIST_DIRS }; /* ANY: direction unknown */
+
+struct hist {
+  uint64_t pkts;
+  uint64_t bytes;
+  uint64_t count[HIST_BUCKETS];
+};
+
+struct hist_if {
+  char name[16];
+  struct hist dir[HIST_DIRS];
+};
+
+struct hist_shm {
+  uint32_t magic;
+  uint32_t sub_bits;
+  uint32_t nif;
+  volatile uint32_t seq;
+  uint64_t published;  /* unix time of last copy, in ms */
+  struct hist_if ifs[HIST_MAX_IF];
+};
+
+/* bucket of length n; a clz, two shifts and an add */
+static inline unsigned hist_bucket(uint32_t n) {
+  unsigned e;
+  if (n < (1U << HIST_SUB_BITS)) return n;
+  if (n > 0xffff) n = 0xffff;
+  e = 31 - __builtin_clz(n); /* >= HIST_SUB_BITS */
+  return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+         ((n >> (e - HIST_SUB_BITS)) & ((1U << HIST_SUB_BITS) - 1));
+}
+
+/* smallest length that falls in bucket b */
+static inline uint32_t hist_lower(unsigned b) {
+  unsigned e, s;
+  if (b < (1U << HIST_SUB_BITS)) return b;
+  e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  s = b & ((1U << HIST_SUB_BITS) - 1);
+  return (1U << e) + (s << (e - HIST_SUB_BITS));
+}
+
+static inline void hist_publish(struct hist_shm *shm, const struct hist_if *ifs,
+                                uint64_t now_ms) {
+  shm->seq++;
+  __sync_synchronize();
+  memcpy(shm->ifs, ifs, shm->nif * sizeof(*ifs));
+  shm->published = now_ms;
+  __sync_synchronize();
+  shm->seq++;
+}
+
+/* consistent copy of the shared segment into out */
+static inline void hist_snapshot(const struct hist_shm *shm, struct hist_shm *out) {
+  uint32_t s1, s2;
+  do {
+    while ((s1 = shm->seq) & 1) ;
+    __sync_synchronize();
+    memcpy(out, (const void*)shm, sizeof(*out));
+    __sync_synchronize();
+    s2 = shm->seq;
+  } while (s1 != s2);
+}
+
+#endif
@@ -0,0 +1,105 @@
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include "pkt_hist.h"
+
+/*
+ * print the frame length histograms that pkt_hist publishes.
+ * the segment is mapped read-only; no syscall reaches pkt_hist.
+ *
+ *  ./pkt_hist_read            (once)
+ *  ./pkt_hist_read -t 1       (every second, counts over that second)
+ */
+
+struct {
+  int verbose;
+  char *prog;
+  char *shm_name;
+  int interval;
+  struct hist_shm *shm;
+  struct hist_shm cur;
+  struct hist_shm prev;
+} cfg = {
+  .shm_name = HIST_SHM,
+};
+
+char *dirs[] = {"in", "out", "any"};
+
+void usage() {
+  fprintf(stderr,"usage: %s [-v] [-n <shm-name>] [-t <seconds>]\n", cfg.prog);
+  exit(-1);
+}
+
+/* print h, less what was in p if we're showing an interval */
+void show(char *name, int d, struct hist *h, struct hist *p) {
+  uint64_t n, pkts = h->pkts - (p ? p->pkts : 0);
+  unsigned b;
+
+  if (pkts == 0) return;
+  printf("%s %s: %lu packets %lu bytes\n", name, dirs[d], (unsigned long)pkts,
+    (unsigned long)(h->bytes - (p ? p->bytes : 0)));
+  for(b=0; b < HIST_BUCKETS; b++) {
+    n = h->count[b] - (p ? p->count[b] : 0);
+    if (n == 0) continue;
+    printf(" %5u-%-5u %12lu %5.1f%%\n", hist_lower(b),
+      (b + 1 < HIST_BUCKETS) ? hist_lower(b + 1) - 1 : 0xffff,
+      (unsigned long)n, n * 100.0 / pkts);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  int fd = -1, opt, rc = -1, i, d;
+  cfg.prog = argv[0];
+
+  while ( (opt=getopt(argc,argv,"vn:t:h")) != -1) {
+    switch(opt) {
+      case 'v': cfg.verbose++; break;
+      case 'n': cfg.shm_name=strdup(optarg); break;
+      case 't': cfg.interval=atoi(optarg); break;
+      case 'h': default: usage(); break;
+    }
+  }
+
+  if ( (fd = shm_open(cfg.shm_name, O_RDONLY, 0)) == -1) {
+    fprintf(stderr,"shm_open %s: %s\n", cfg.shm_name, strerror(errno));
+    goto done;
+  }
+  cfg.shm = mmap(NULL, sizeof(struct hist_shm), PROT_READ, MAP_SHARED, fd, 0);
+  if (cfg.shm == MAP_FAILED) {
+    fprintf(stderr,"mmap: %s\n", strerror(errno));
+    cfg.shm = NULL;
+    goto done;
+  }
+  if ((cfg.shm->magic != HIST_MAGIC) || (cfg.shm->sub_bits != HIST_SUB_BITS)) {
+    fprintf(stderr,"%s: not a pkt_hist segment of this version\n", cfg.shm_name);
+    goto done;
+  }
+
+  hist_snapshot(cfg.shm, &cfg.prev);
+  do {
+    if (cfg.interval) sleep(cfg.interval);
+    hist_snapshot(cfg.shm, &cfg.cur);
+    if (cfg.verbose) printf("published %lu.%03lu\n",
+      (unsigned long)(cfg.cur.published / 1000), (unsigned long)(cfg.cur.published % 1000));
+    for(i=0; i < cfg.cur.nif && i < HIST_MAX_IF; i++) {
+      for(d=0; d < HIST_DIRS; d++) {
+        show(cfg.cur.ifs[i].name, d, &cfg.cur.ifs[i].dir[d],
+             cfg.interval ? &cfg.prev.ifs[i].dir[d] : NULL);
+      }
+    }
+    printf("\n");
+    fflush(stdout);
+    cfg.prev = cfg.cur;
+  } while (cfg.interval);
+  rc = 0;
+
+ done:
+  if (cfg.shm) munmap(cfg.shm, sizeof(struct hist_shm));
+  if (fd != -1) close(fd);
+  return rc;
+}
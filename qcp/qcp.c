@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* splice */
 #include <stdio.h>
 #include <sys/inotify.h>
 #include <limits.h>
@@ -15,6 +16,13 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include "qcp.h"
  
 int verbose=0;
 char *watch_dir;
@@ -22,146 +30,476 @@ char *watch_dir;
 void usage(char *prog) {
   fprintf(stderr, "usage: %s -s <ip> -p <port> <file>   (send one file)\n", prog);
   fprintf(stderr, "   or: %s -s <ip> -p <port> -w <dir> (watch directory)\n", prog);
+  fprintf(stderr, "       -m sendfile|splice|write (how to send, default sendfile)\n");
+  fprintf(stderr, "       -n <streams>  (split large files over parallel connections)\n");
+  fprintf(stderr, "       -W <files>    (with -w, files sent ahead of their acks, default 32)\n");
   exit(-1);
 }
 
 char *server = "127.0.0.1";
 uint16_t port = 2000;
-int md;
- 
-char *map(char *file, size_t *len) {
-  struct stat s;
-  char *buf;
 
-  if ( (md = open(file, O_RDONLY)) == -1) {
-      fprintf(stderr,"can't open %s: %s\n", file, strerror(errno));
-      exit(-1);
+/* how the file content gets to the socket. sendfile and splice move it
+ * from the page cache to the socket inside the kernel; write copies it
+ * out of an mmap of the file, faulting every page into our address space */
+enum {SEND_SENDFILE, SEND_SPLICE, SEND_WRITE};
+char *send_modes[] = {"sendfile", "splice", "write"};
+int send_mode = SEND_SENDFILE;
+
+#define PIPE_SZ (1024*1024) /* splice moves up to this much per call */
+
+/* with -n, a file is split into ranges, each sent on its own connection,
+ * if every range gets at least this much */
+#define MIN_RANGE (4*1024*1024)
+int nstreams = 1;
+
+int send_sendfile(int fd, int md, off_t off, size_t len) {
+  off_t end = off + len;
+  ssize_t rc;
+
+  while (off < end) {
+    rc = sendfile(fd, md, &off, end - off);
+    if (rc < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr,"sendfile: %s\n", strerror(errno));
+      return -1;
+    }
+    if (rc == 0) {
+      fprintf(stderr,"sendfile: file shrank\n");
+      return -1;
+    }
   }
-  if (fstat(md, &s) == -1) {
-      close(md);
-      fprintf(stderr,"can't stat %s: %s\n", file, strerror(errno));
-      exit(-1);
+  return 0;
+}
+
+/* file to pipe, pipe to socket; the pipe holds page references, not data */
+int send_splice(int fd, int md, off_t off, size_t len) {
+  int pd[2] = {-1,-1}, rc = -1;
+  loff_t o = off, end = off + len;
+  ssize_t n, m;
+
+  if (pipe(pd) == -1) {
+    fprintf(stderr,"pipe: %s\n", strerror(errno));
+    goto done;
   }
-  *len = s.st_size;
-  buf = mmap(0, s.st_size, PROT_READ, MAP_PRIVATE, md, 0);
-  if (buf == MAP_FAILED) {
-    close(md);
-    fprintf(stderr, "failed to mmap %s: %s\n", file, strerror(errno));
-    exit(-1);
+  fcntl(pd[1], F_SETPIPE_SZ, PIPE_SZ); /* best effort; else the default 64k */
+
+  while (o < end) {
+    n = splice(md, &o, pd[1], NULL, end - o, SPLICE_F_MOVE|SPLICE_F_MORE);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr,"splice: %s\n", strerror(errno));
+      goto done;
+    }
+    if (n == 0) {
+      fprintf(stderr,"splice: file shrank\n");
+      goto done;
+    }
+    while (n) {
+      m = splice(pd[0], NULL, fd, NULL, n, SPLICE_F_MOVE|SPLICE_F_MORE);
+      if (m < 0) {
+        if (errno == EINTR) continue;
+        fprintf(stderr,"splice: %s\n", strerror(errno));
+        goto done;
+      }
+      n -= m;
+    }
   }
-  /* don't: close(md); */
-  return buf;
+  rc = 0;
+
+ done:
+  if (pd[0] != -1) close(pd[0]);
+  if (pd[1] != -1) close(pd[1]);
+  return rc;
 }
 
-int send_file(char *filename) {
-  char *buf, *base;
-  size_t buflen;
-  int rc=-1,baselen;
-  time_t before,after;
+int send_write(int fd, int md, off_t off, size_t len) {
+  off_t pg = off & ~(off_t)(sysconf(_SC_PAGESIZE) - 1); /* mmap offsets are paged */
+  char *buf, *b;
+  size_t l = len;
+  ssize_t rc;
 
-  buf = map(filename, &buflen);
-  if (!buf) return -1;
+  if (len == 0) return 0;
+  buf = mmap(0, len + (off - pg), PROT_READ, MAP_PRIVATE, md, pg);
+  if (buf == MAP_FAILED) {
+    fprintf(stderr, "mmap: %s\n", strerror(errno));
+    return -1;
+  }
+  for(b = buf + (off - pg); l; l -= rc, b += rc) {
+    rc = write(fd,b,l);
+    if (rc < 0) {
+      fprintf(stderr,"write: %s\n", strerror(errno));
+      break;
+    }
+  }
+  munmap(buf,len + (off - pg));
+  return l ? -1 : 0;
+}
 
-  /**********************************************************
-   * create an IPv4/TCP socket, not yet bound to any address
-   *********************************************************/
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (fd == -1) {
-    fprintf(stderr,"socket: %s\n", strerror(errno));
-    goto done;
+int send_content(int fd, int md, off_t off, size_t len) {
+  switch (send_mode) {
+    case SEND_SENDFILE: return send_sendfile(fd, md, off, len);
+    case SEND_SPLICE:   return send_splice(fd, md, off, len);
+    case SEND_WRITE:    return send_write(fd, md, off, len);
+  }
+  return -1;
+}
+
+int write_all(int fd, const void *buf, size_t len) {
+  const char *b = buf;
+  ssize_t rc;
+  for(; len; len -= rc, b += rc) {
+    rc = write(fd, b, len);
+    if (rc < 0) {
+      if (errno == EINTR) { rc = 0; continue; }
+      fprintf(stderr,"write: %s\n", strerror(errno));
+      return -1;
+    }
   }
+  return 0;
+}
 
+/* wall and cpu (user + system) seconds, to report throughput and cost */
+void now(double *wall, double *cpu) {
+  struct timespec ts;
+  struct rusage ru;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  getrusage(RUSAGE_SELF, &ru);
+  *wall = ts.tv_sec + ts.tv_nsec / 1e9;
+  *cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+         ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+int resolve(struct sockaddr_in *sin) {
   struct hostent *h=gethostbyname(server);
   if (!h) {
     fprintf(stderr,"cannot resolve name: %s\n", hstrerror(h_errno));
-    goto done;
+    return -1;
   }
     
   /**********************************************************
    * internet socket address structure, for the remote side
    *********************************************************/
-  struct sockaddr_in sin;
-  sin.sin_family = AF_INET;
-  sin.sin_addr.s_addr = ((struct in_addr*)h->h_addr)->s_addr;
-  sin.sin_port = htons(port);
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = ((struct in_addr*)h->h_addr)->s_addr;
+  sin->sin_port = htons(port);
 
-  if (sin.sin_addr.s_addr == INADDR_NONE) {
+  if (sin->sin_addr.s_addr == INADDR_NONE) {
     fprintf(stderr,"invalid remote IP %s\n", server);
-    goto done;
+    return -1;
+  }
+  return 0;
+}
+
+int connect_to(struct sockaddr_in *sin) {
+  /**********************************************************
+   * create an IPv4/TCP socket, not yet bound to any address
+   *********************************************************/
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    fprintf(stderr,"socket: %s\n", strerror(errno));
+    return -1;
   }
 
   /**********************************************************
    * Perform the 3 way handshake, (c)syn, (s)ack/syn, c(ack)
    *********************************************************/
-  if (connect(fd, (struct sockaddr*)&sin, sizeof(sin)) == -1) {
+  if (connect(fd, (struct sockaddr*)sin, sizeof(*sin)) == -1) {
     fprintf(stderr,"connect: %s\n", strerror(errno));
-    goto done;
+    close(fd);
+    return -1;
   }
+  return fd;
+}
+
+/* one connection's share of a file; with -n each has its own thread */
+struct stream {
+  pthread_t tid;
+  int started;
+  int fd;
+  int md;
+  struct qcp_range r;
+  int rc;
+};
 
-  time(&before);
+void *send_range(void *arg) {
+  struct stream *s = arg;
+  s->rc = send_content(s->fd, s->md, s->r.off, s->r.len);
+  return NULL;
+}
 
-  /* write a length-prefixed filename.*/
+int send_file(char *filename) {
+  char *base, hdr[sizeof(int) + sizeof(struct qcp_range) + NAME_MAX];
+  size_t len, chunk;
+  struct stat st;
+  struct sockaddr_in sin;
+  struct stream ss[QCP_MAX_RANGES];
+  int rc=-1, baselen, md, i, n, hlen, ranged = QCP_RANGED;
+  double wall0, cpu0, wall, cpu, gb;
+  uint64_t id;
+
+  for(i=0; i < QCP_MAX_RANGES; i++) { ss[i].fd = -1; ss[i].started = 0; ss[i].rc = 0; }
+  if ( (md = open(filename, O_RDONLY)) == -1) {
+    fprintf(stderr,"can't open %s: %s\n", filename, strerror(errno));
+    goto done;
+  }
+  if (fstat(md, &st) == -1) {
+    fprintf(stderr,"can't stat %s: %s\n", filename, strerror(errno));
+    goto done;
+  }
+  len = st.st_size;
   base = basename(filename);
   baselen = strlen(base);
-  if (verbose) fprintf(stderr,"sending %s\n", base);
-  if (write(fd,&baselen,sizeof(baselen)) != sizeof(baselen)) {
-    fprintf(stderr,"write: %s\n", (rc<0)?strerror(errno):"incomplete");
+  if (baselen > NAME_MAX) {
+    fprintf(stderr,"name too long: %s\n", base);
     goto done;
   }
 
-  if (write(fd,base,baselen) != baselen) {
-    fprintf(stderr,"write: %s\n", (rc<0)?strerror(errno):"incomplete");
-    goto done;
+  /* a file big enough to split gets a connection per range, all
+   * opened before any content is sent */
+  n = (len / MIN_RANGE < nstreams) ? (len / MIN_RANGE) : nstreams;
+  if (n < 1) n = 1;
+  if (resolve(&sin) < 0) goto done;
+  for(i=0; i < n; i++) {
+    if ( (ss[i].fd = connect_to(&sin)) == -1) goto done;
   }
 
-  /* and write the file content */
-  size_t l = buflen;
-  char *b  = buf;
-  
-  while(l) {
-    rc = write(fd,b,l);
-    if (rc < 0) {
-      fprintf(stderr,"write: %s\n", strerror(errno));
-      goto done;
+  now(&wall0, &cpu0);
+  if (verbose) fprintf(stderr,"sending %s\n", base);
+
+  if (n == 1) {
+    /* write a length-prefixed filename, then the file content */
+    memcpy(hdr, &baselen, sizeof(baselen));
+    memcpy(hdr + sizeof(baselen), base, baselen);
+    if (write_all(ss[0].fd, hdr, sizeof(baselen) + baselen) < 0) goto done;
+    if (send_content(ss[0].fd, md, 0, len) < 0) goto done;
+  } else {
+    /* ranges of whole pages; the last takes the remainder */
+    id = ((uint64_t)getpid() << 32) ^ (uint64_t)wall0 ^ (uint64_t)(wall0 * 1e9);
+    chunk = (len / n) & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+    for(i=0; i < n; i++) {
+      ss[i].md = md;
+      memset(&ss[i].r, 0, sizeof(ss[i].r));
+      ss[i].r.id = id;
+      ss[i].r.size = len;
+      ss[i].r.off = i * chunk;
+      ss[i].r.len = (i == n - 1) ? (len - i * chunk) : chunk;
+      ss[i].r.index = i;
+      ss[i].r.nranges = n;
+      ss[i].r.namelen = baselen;
+      memcpy(hdr, &ranged, sizeof(ranged));
+      memcpy(hdr + sizeof(ranged), &ss[i].r, sizeof(ss[i].r));
+      memcpy(hdr + sizeof(ranged) + sizeof(ss[i].r), base, baselen);
+      hlen = sizeof(ranged) + sizeof(ss[i].r) + baselen;
+      if (write_all(ss[i].fd, hdr, hlen) < 0) goto done;
     }
-    l -= rc;
-    b += rc;
+    for(i=1; i < n; i++) {
+      if (pthread_create(&ss[i].tid, NULL, send_range, &ss[i])) {
+        fprintf(stderr,"pthread_create failed\n");
+        goto done;
+      }
+      ss[i].started = 1;
+    }
+    send_range(&ss[0]);
+    for(i=1; i < n; i++) { pthread_join(ss[i].tid, NULL); ss[i].started = 0; }
+    for(i=0; i < n; i++) if (ss[i].rc < 0) goto done;
   }
 
-  close(fd);
-  time(&after);
-  int sec = after-before;
-  if (verbose) fprintf(stderr,"sent in %u sec (%.0f MB/s)\n", sec, 
-    sec ? ((buflen/(1024.0*1024))/sec) :0);
-
-
-  munmap(buf,buflen);
-  close(md);
+  for(i=0; i < n; i++) {
+    rc = close(ss[i].fd);
+    ss[i].fd = -1;
+    if (rc == -1) {
+      fprintf(stderr,"close: %s\n", strerror(errno));
+      goto done;
+    }
+  }
+  rc = -1;
+  now(&wall, &cpu);
+  wall -= wall0;
+  cpu -= cpu0;
+  gb = len / (1024.0*1024*1024);
+  if (verbose) fprintf(stderr,"sent %s: %zu bytes in %.3f sec (%.0f MB/s) by %s "
+    "on %d stream%s, cpu %.3f sec (%.2f sec/GB)\n", filename, len, wall,
+    wall > 0 ? (len/(1024.0*1024))/wall : 0, send_modes[send_mode], n,
+    n > 1 ? "s" : "", cpu, gb > 0 ? cpu/gb : 0);
 
-  if (verbose) fprintf(stderr,"sent %s\n",filename);
   rc = 0;
 
  done:
+  /* on failure, closing the sockets wakes any stream still sending */
+  for(i=0; i < QCP_MAX_RANGES; i++) if (ss[i].fd != -1) shutdown(ss[i].fd, SHUT_RDWR);
+  for(i=0; i < QCP_MAX_RANGES; i++) if (ss[i].started) pthread_join(ss[i].tid, NULL);
+  for(i=0; i < QCP_MAX_RANGES; i++) if (ss[i].fd != -1) close(ss[i].fd);
+  if (md != -1) close(md);
   return rc;
 }
 
+/* -w: the files go on one connection, framed (see qcp.h), each as soon
+ * as it is closed, without waiting for the ack of the one before, up to
+ * a window of them. a file is kept open until qcps acknowledges it, so
+ * should the connection drop, those not yet acknowledged are sent again
+ * on a new one */
+#define MAX_WINDOW 256
+#define RETRIES 10          /* reconnects, a second apart, before giving up */
+int window = 32;
+
+struct pending {
+  char *name;
+  int md;
+  size_t len;
+  uint32_t cksum;
+};
+
+struct {
+  int fd;
+  struct sockaddr_in sin;
+  struct pending p[MAX_WINDOW]; /* file seq is at seq % window */
+  uint32_t seq;       /* of the next file */
+  uint32_t acked;     /* acked .. seq-1 await their acks */
+  struct qcp_ack ack; /* as read so far */
+  size_t got;
+} pl = { .fd = -1 };
+
+int send_frame(uint32_t seq) {
+  struct pending *p = &pl.p[seq % window];
+  char hdr[sizeof(struct qcp_frame) + NAME_MAX], *base = basename(p->name);
+  struct qcp_frame f;
+
+  memset(&f, 0, sizeof(f));
+  f.size = p->len;
+  f.seq = seq;
+  f.namelen = strlen(base);
+  f.cksum = p->cksum;
+  memcpy(hdr, &f, sizeof(f));
+  memcpy(hdr + sizeof(f), base, f.namelen);
+  if (write_all(pl.fd, hdr, sizeof(f) + f.namelen) < 0) return -1;
+  return send_content(pl.fd, p->md, 0, p->len);
+}
+
+/* (re)connect, and send again what was not acknowledged */
+int pl_connect(void) {
+  int framed = QCP_FRAMED, try;
+  uint32_t seq;
+
+  for(try=0; try < RETRIES; try++) {
+    if (try) sleep(1);
+    if (pl.fd != -1) close(pl.fd);
+    pl.got = 0;
+    if ( (pl.fd = connect_to(&pl.sin)) == -1) continue;
+    if (write_all(pl.fd, &framed, sizeof(framed)) < 0) continue;
+    for(seq = pl.acked; seq != pl.seq; seq++) if (send_frame(seq) < 0) break;
+    if (seq != pl.seq) continue;
+    if (verbose && try) fprintf(stderr,"reconnected, %u files sent again\n", pl.seq - pl.acked);
+    return 0;
+  }
+  fprintf(stderr,"giving up on %s\n", server);
+  return -1;
+}
+
+/* take the acks qcps has sent; with block, wait for one. -1 if the
+ * connection failed */
+int pl_acks(int block) {
+  struct pending *p;
+  ssize_t rc;
+
+  for(;;) {
+    rc = recv(pl.fd, (char*)&pl.ack + pl.got, sizeof(pl.ack) - pl.got, block ? 0 : MSG_DONTWAIT);
+    if (rc == 0) {
+      fprintf(stderr,"connection closed by %s\n", server);
+      return -1;
+    }
+    if (rc < 0) {
+      if (errno == EINTR) continue;
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return 0;
+      fprintf(stderr,"recv: %s\n", strerror(errno));
+      return -1;
+    }
+    pl.got += rc;
+    if (pl.got < sizeof(pl.ack)) continue;
+    pl.got = 0;
+    if ((pl.acked == pl.seq) || (pl.ack.seq != pl.acked)) {
+      fprintf(stderr,"unexpected ack %u\n", pl.ack.seq);
+      return -1;
+    }
+    p = &pl.p[pl.acked % window];
+    if (pl.ack.status) fprintf(stderr,"%s failed to write %s\n", server, p->name);
+    else if (verbose) fprintf(stderr,"sent %s\n", p->name);
+    close(p->md);
+    free(p->name);
+    p->name = NULL;
+    pl.acked++;
+    block = 0;
+  }
+}
+
+/* send a file that was just closed, once there is room in the window */
+int pl_file(char *path) {
+  struct pending *p;
+  struct stat st;
+  char *buf;
+  int md;
+
+  while ((pl.seq - pl.acked) == window) {
+    if ((pl_acks(1) < 0) && (pl_connect() < 0)) return -1;
+  }
+
+  if ( (md = open(path, O_RDONLY)) == -1) {
+    fprintf(stderr,"can't open %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+  if (fstat(md, &st) == -1) {
+    fprintf(stderr,"can't stat %s: %s\n", path, strerror(errno));
+    close(md);
+    return 0;
+  }
+  p = &pl.p[pl.seq % window];
+  p->md = md;
+  p->len = st.st_size;
+  p->cksum = 1;
+  if (p->len) { /* the checksum is the one pass over the content we make */
+    buf = mmap(0, p->len, PROT_READ, MAP_PRIVATE, md, 0);
+    if (buf == MAP_FAILED) {
+      fprintf(stderr, "mmap %s: %s\n", path, strerror(errno));
+      close(md);
+      return 0;
+    }
+    p->cksum = qcp_adler32(1, (unsigned char*)buf, p->len);
+    munmap(buf, p->len);
+  }
+  p->name = strdup(path);
+  pl.seq++;
+
+  if (verbose > 1) fprintf(stderr,"sending %s\n", path);
+  if ((send_frame(pl.seq - 1) < 0) && (pl_connect() < 0)) return -1;
+  return 0;
+}
+
 int main(int argc, char * argv[]) {
   int opt, fd = -1, wd, rc;
   char *file=NULL, *buf, *name;
   char filename[100];
  
-  while ( (opt = getopt(argc, argv, "v+s:p:hw:")) != -1) {
+  while ( (opt = getopt(argc, argv, "v+s:p:hw:m:n:W:")) != -1) {
     switch (opt) {
       case 's': server = strdup(optarg); break;
       case 'p': port = atoi(optarg); break;
       case 'v': verbose++; break;
       case 'w': watch_dir=strdup(optarg); break;
+      case 'n': nstreams = atoi(optarg); break;
+      case 'W': window = atoi(optarg); break;
+      case 'm': for(send_mode=SEND_WRITE; send_mode > 0; send_mode--)
+                  if (!strcmp(optarg, send_modes[send_mode])) break;
+                if (strcmp(optarg, send_modes[send_mode])) usage(argv[0]);
+                break;
       default: usage(argv[0]); break;
     }
   }
  
   if (optind < argc) file=argv[optind++];
   if (!file && !watch_dir) usage(argv[0]);
+  if ((nstreams < 1) || (nstreams > QCP_MAX_RANGES)) usage(argv[0]);
+  if ((window < 1) || (window > MAX_WINDOW)) usage(argv[0]);
 
   /* send one file only */
   if (file) {
@@ -196,8 +534,28 @@ int main(int argc, char * argv[]) {
     goto done;
   }
 
-  /* one read will produce one or more event structures */
-  while ( (rc=read(fd,eb,eb_sz)) > 0) {
+  /* a connection we write to may be reset; that is an error, not a signal */
+  signal(SIGPIPE, SIG_IGN);
+  if (resolve(&pl.sin) < 0) goto done;
+  if (pl_connect() < 0) goto done;
+
+  /* wait for files to be closed, or for acks */
+  struct pollfd pfd[2] = {{.fd = fd, .events = POLLIN}, {.events = POLLIN}};
+  for(;;) {
+    pfd[1].fd = pl.fd;
+    if (poll(pfd, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "poll: %s\n", strerror(errno));
+      goto done;
+    }
+    if (pfd[1].revents && (pl_acks(0) < 0) && (pl_connect() < 0)) goto done;
+    if (pfd[0].revents == 0) continue;
+
+    /* one read will produce one or more event structures */
+    if ( (rc=read(fd,eb,eb_sz)) <= 0) {
+      if (rc < 0) fprintf(stderr, "read: %s\n", strerror(errno));
+      goto done;
+    }
     for(ev = eb; rc > 0; ev = nx) {
 
       sz = sizeof(*ev) + ev->len;
@@ -207,14 +565,10 @@ int main(int argc, char * argv[]) {
       name = (ev->len ? ev->name : watch_dir);
       memcpy(&path[len+1],name,strlen(name)+1);
 
-      if (send_file(path)) goto done;
+      if (pl_file(path) < 0) goto done;
     }
   }
 
-  if (rc < 0) {
-   fprintf(stderr, "read: %s\n", strerror(errno));
-  }
-
 
  done:
   if (fd != -1) close(fd);
@@ -0,0 +1,77 @@
+#ifndef __QCP_H__
+#define __QCP_H__
+
+#include <stdint.h>
+
+/*
+ * what qcp sends qcps on each connection.
+ *
+ * a whole file, on one connection:
+ *
+ *   int namelen, the name, the content until the sender closes
+ *
+ * one range of a file sent over several connections (qcp -n):
+ *
+ *   int QCP_RANGED, struct qcp_range, the name, then exactly len bytes of
+ *   the content from off, and the sender closes
+ *
+ * a stream of files, on one connection that stays open (qcp -w):
+ *
+ *   int QCP_FRAMED, then for each file: struct qcp_frame, the name, and
+ *   exactly size bytes of content
+ *
+ * for which qcps sends back a struct qcp_ack per file, in order, once the
+ * file is written, checked against its checksum and named. the sender
+ * keeps sending without waiting for them, up to a window of files.
+ *
+ * all in the sender's byte order, as the name length always was. qcps
+ * writes the ranges into a hidden file of the full size, and renames it
+ * to the name once every range has arrived; a framed file too is named
+ * only once it is complete and checked.
+ */
+
+#define QCP_RANGED  (-0x51435052)   /* in place of a name length */
+#define QCP_MAX_RANGES 64
+#define QCP_FRAMED  (-0x51435046)   /* in place of a name length */
+
+struct qcp_range {
+  uint64_t id;        /* the transfer: the same on each of its connections */
+  uint64_t size;      /* of the whole file */
+  uint64_t off;       /* of this range */
+  uint64_t len;
+  uint32_t index;     /* of this range, 0 .. nranges-1; in index order the
+                         ranges tile the file, each starting where the one
+                         before it ends */
+  uint32_t nranges;
+  uint32_t namelen;
+  uint32_t pad;
+};
+
+struct qcp_frame {
+  uint64_t size;
+  uint32_t seq;       /* the sender's number for the file, echoed in its ack */
+  uint32_t namelen;
+  uint32_t cksum;     /* qcp_adler32 of the content */
+  uint32_t pad;
+};
+
+struct qcp_ack {
+  uint32_t seq;
+  int32_t status;     /* 0, or -1 if the file was not written */
+};
+
+/* adler-32, as zlib's; start from 1 */
+static inline uint32_t qcp_adler32(uint32_t adler, const unsigned char *p, size_t n) {
+  uint32_t s1 = adler & 0xffff, s2 = adler >> 16;
+  size_t k;
+  while (n) {
+    k = (n < 5552) ? n : 5552;  /* the most bytes before s2 can overflow */
+    n -= k;
+    while (k--) { s1 += *p++; s2 += s1; }
+    s1 %= 65521;
+    s2 %= 65521;
+  }
+  return (s2 << 16) | s1;
+}
+
+#endif
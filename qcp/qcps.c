@@ -1,48 +1,161 @@
+#define _GNU_SOURCE /* splice */
 #include <stdio.h>
 #include <getopt.h>
 #include <libgen.h>
-#include <assert.h>
+#include <limits.h>
+#include <signal.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/mman.h>
 #include <arpa/inet.h>
+#include "qcp.h"
 
-#define BUFSZ (200*1024*1024)  // 200 mb
-char buf[BUFSZ];
-int port = 2000;             /* no significance */
-int verbose=0;
+/*****************************************************************************
+ * qcps receives files sent by qcp, from any number of senders at once.
+ *
+ * one thread, one epoll. each connection has a small state: reading the
+ * length-prefixed name, then the content until the sender closes. the
+ * content moves socket -> pipe -> file by splice(2), so it is never
+ * copied into qcps, and there is no buffer to size. sockets are non-
+ * blocking; a connection takes a bounded number of splices per wakeup,
+ * so a fast sender cannot starve the rest, and a slow one only holds its
+ * own descriptors.
+ *
+ * a file is written under a hidden name of its connection's, and renamed
+ * to its name when the sender closes, so that two senders of one name
+ * can't mix their content, and the name only ever holds a whole file. a
+ * failure on one connection (a bad name, an unwritable file, a reset)
+ * closes that connection and removes its partial file; the rest carry on.
+ *
+ * a file sent in ranges (qcp -n, see qcp.h) is a transfer shared by the
+ * connections of its ranges. the first to arrive creates a hidden file
+ * of the full size, allocated up front so the ranges land in place
+ * rather than each extending it; each range is spliced at its offset.
+ * once every range is in, the file is renamed to its name, so the name
+ * only ever holds a complete file. should any range fail, the transfer
+ * fails: its other connections are dropped and the hidden file removed.
+ * so does one left with no connection for -t seconds, whose sender died
+ * or whose missing ranges never connected; it could never complete.
+ *
+ * a framed connection (qcp -w) carries file after file. each goes to a
+ * hidden file, is checked against the sender's checksum, and is renamed
+ * to its name; then the sender gets an ack, good or bad, for that file.
+ * the checksum is made as the content lands, of what each splice put in
+ * the page cache, so a big file costs the other connections no more
+ * than its splices do. a file that fails its check is removed and the
+ * connection carries on.
+ ****************************************************************************/
 
-void usage(char *prog) {
-  fprintf(stderr, "usage: %s [-v] [-p <port>]\n", prog);
-  exit(-1);
-}
+#define PIPE_SZ   (1024*1024) /* splice moves up to this much per call */
+#define MAX_SPLICE 16          /* splices per connection per wakeup */
+#define XFER_IDLE 60           /* default -t: secs a transfer may lack a connection */
 
+enum { READ_LEN, READ_RANGE, READ_FRAME, READ_NAME, READ_DATA };
 
-int main(int argc, char *argv[]) {
+/* a file arriving in ranges, over several connections */
+struct xfer {
+  uint64_t id;
+  char name[NAME_MAX+1];
+  char tmp[NAME_MAX+32];
+  int fd;
+  uint64_t size;
+  uint32_t nranges;
+  uint64_t have;     /* bit per range, set once all of it is in */
+  uint64_t begun;    /* bit per range, set once a connection claims it */
+  uint64_t off[QCP_MAX_RANGES];  /* of each begun range */
+  uint64_t end[QCP_MAX_RANGES];
+  int refs;          /* connections writing to it */
+  time_t last;       /* monotonic secs when refs last changed */
+  int failed;
+  struct xfer *next;
+};
 
-  int opt,rc;
+struct conn {
+  int fd;
+  int state;
   int namelen;
-  char *base;
+  int got;          /* bytes of the length or name read so far */
+  char name[NAME_MAX+1];
+  int fw;           /* the file being written */
+  int ranged;       /* one range of a file */
+  struct qcp_range r;
+  struct xfer *x;   /* if a range: its transfer, and r says which */
+  loff_t off;       /* next offset in the file */
+  int framed;       /* file after file, each acknowledged */
+  struct qcp_frame f;
+  char tmp[NAME_MAX+16]; /* where the file is written, until it is named */
+  uint64_t left;    /* bytes of the framed file yet to come */
+  uint64_t summed;  /* bytes of it checksummed, into sum, as they land */
+  uint32_t sum;
+  int bad;          /* framed file that can't be written: drained, and nacked */
+  unsigned long nfiles;
+  int pd[2];        /* socket -> pd[1], pd[0] -> file */
+  size_t bytes;
+  struct timespec start;
+  char peer[INET_ADDRSTRLEN + 8];
+};
 
-  while ( (opt = getopt(argc, argv, "v+p:h")) != -1) {
-    switch (opt) {
-      case 'p': port = atoi(optarg); break;
-      case 'v': verbose++; break;
-      default: usage(argv[0]); break;
-    }
+struct {
+  int port;
+  int fd;            /* listener descriptor      */
+  int signal_fd;     /* used to receive signals  */
+  int epoll_fd;      /* used for all notification*/
+  int verbose;
+  int idle;          /* secs an unconnected transfer waits for its ranges */
+  char *prog;
+  struct conn **conns; /* by descriptor */
+  int nconns;          /* slots in conns */
+  int active;
+  struct xfer *xfers;
+} cfg = {
+  .port = 2000,             /* no significance */
+  .fd = -1,
+  .signal_fd = -1,
+  .epoll_fd = -1,
+  .idle = XFER_IDLE,
+};
+
+void usage() {
+  fprintf(stderr, "usage: %s [-v] [-p <port>] [-t <idle-secs>]\n", cfg.prog);
+  exit(-1);
+}
+
+/* signals that we'll accept synchronously via signalfd */
+int sigs[] = {SIGHUP,SIGTERM,SIGINT,SIGQUIT};
+
+int add_epoll(int events, int fd) {
+  int rc;
+  struct epoll_event ev;
+  memset(&ev,0,sizeof(ev)); // placate valgrind
+  ev.events = events;
+  ev.data.fd= fd;
+  if (cfg.verbose > 1) fprintf(stderr,"adding fd %d to epoll\n", fd);
+  rc = epoll_ctl(cfg.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  if (rc == -1) {
+    fprintf(stderr,"epoll_ctl: %s\n", strerror(errno));
   }
- 
+  return rc;
+}
+
+int setup_listener() {
+  int rc = -1, one=1;
+
   /**********************************************************
    * create an IPv4/TCP socket, not yet bound to any address
    *********************************************************/
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0);
   if (fd == -1) {
-    printf("socket: %s\n", strerror(errno));
-    exit(-1);
+    fprintf(stderr,"socket: %s\n", strerror(errno));
+    goto done;
   }
 
   /**********************************************************
@@ -51,70 +164,555 @@ int main(int argc, char *argv[]) {
   struct sockaddr_in sin;
   sin.sin_family = AF_INET;
   sin.sin_addr.s_addr = htonl(INADDR_ANY);
-  sin.sin_port = htons(port);
+  sin.sin_port = htons(cfg.port);
 
   /**********************************************************
    * bind socket to address and port we'd like to receive on
    *********************************************************/
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
   if (bind(fd, (struct sockaddr*)&sin, sizeof(sin)) == -1) {
-    printf("bind: %s\n", strerror(errno));
-    exit(-1);
+    fprintf(stderr,"bind: %s\n", strerror(errno));
+    goto done;
   }
 
   /**********************************************************
-   * put socket into listening state 
+   * put socket into listening state; senders arrive together
    *********************************************************/
-  if (listen(fd,1) == -1) {
-    printf("listen: %s\n", strerror(errno));
-    exit(-1);
+  if (listen(fd,SOMAXCONN) == -1) {
+    fprintf(stderr,"listen: %s\n", strerror(errno));
+    goto done;
   }
 
-  /**********************************************************
-   * accept a connection, read til it closes, repeat
-   *********************************************************/
-  while (1) {
-    struct sockaddr_in cin;
-    socklen_t cin_sz = sizeof(cin);
-    int fa = accept(fd, (struct sockaddr*)&cin, &cin_sz);
-    if (fa == -1) {
-      printf("accept: %s\n", strerror(errno));
+  cfg.fd = fd;
+  rc=0;
+
+ done:
+  if ((rc < 0) && (fd != -1)) close(fd);
+  return rc;
+}
+
+/* monotonic time in seconds */
+time_t now_secs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+/* let go of a transfer. it is done with once complete, or failed and no
+ * connection is still writing to it; failed, its file is removed */
+void put_xfer(struct xfer *x, int ok) {
+  struct xfer **p;
+
+  if (!ok) x->failed = 1;
+  x->refs--;
+  x->last = now_secs();
+  if ((x->have == (~0ULL >> (64 - x->nranges))) && !x->failed) {
+    if (close(x->fd) == -1) {
+      fprintf(stderr,"close %s: %s\n", x->tmp, strerror(errno));
+      x->failed = 1;
+    } else if (rename(x->tmp, x->name) == -1) {
+      fprintf(stderr,"rename %s to %s: %s\n", x->tmp, x->name, strerror(errno));
+      x->failed = 1;
+    } else if (cfg.verbose) fprintf(stderr,"%s: complete, %lu bytes in %u ranges\n",
+                                    x->name, (unsigned long)x->size, x->nranges);
+    x->fd = -1;
+    if (!x->failed) x->tmp[0] = '\0';
+  }
+  if (x->refs || !(x->failed || (x->tmp[0] == '\0'))) return;
+  if (x->fd != -1) close(x->fd);
+  if (x->tmp[0]) {
+    unlink(x->tmp);
+    fprintf(stderr,"%s: failed\n", x->name);
+  }
+  for(p = &cfg.xfers; *p != x; p = &(*p)->next) ;
+  *p = x->next;
+  free(x);
+}
+
+/* fail each transfer that has had no connection for cfg.idle seconds.
+ * its missing ranges aren't coming, and its hidden file holds blocks */
+void expire_xfers() {
+  struct xfer *x, *next;
+  time_t now = now_secs();
+
+  for(x = cfg.xfers; x; x = next) {
+    next = x->next;
+    if (x->refs || (now - x->last < cfg.idle)) continue;
+    fprintf(stderr,"%s: no range for %d sec\n", x->name, cfg.idle);
+    x->refs++;
+    put_xfer(x, 0);
+  }
+}
+
+/* close a connection. unless ok, its file is incomplete, so remove it */
+void close_conn(struct conn *c, int ok) {
+  struct timespec now;
+  double secs;
+
+  if (c->x) {
+    if (ok) c->x->have |= 1ULL << c->r.index;
+    put_xfer(c->x, ok);
+  } else if (c->framed) {
+    if (c->fw != -1) { /* mid-file */
+      close(c->fw);
+      if (c->tmp[0]) unlink(c->tmp);
+    }
+  } else if (c->fw != -1) {
+    if ((close(c->fw) == -1) && ok) {
+      fprintf(stderr,"%s: close %s: %s\n", c->peer, c->tmp, strerror(errno));
+      ok = 0;
+    }
+    if (ok && (rename(c->tmp, c->name) == -1)) {
+      fprintf(stderr,"%s: rename %s: %s\n", c->peer, c->name, strerror(errno));
+      ok = 0;
+    }
+    if (!ok) unlink(c->tmp);
+  }
+  if (c->pd[0] != -1) close(c->pd[0]);
+  if (c->pd[1] != -1) close(c->pd[1]);
+  close(c->fd); /* which takes it out of epoll */
+
+  if (ok && cfg.verbose && c->framed) fprintf(stderr,"%s: closed after %lu files, %zu bytes\n",
+                                            c->peer, c->nfiles, c->bytes);
+  else if (ok && cfg.verbose) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    secs = (now.tv_sec - c->start.tv_sec) + (now.tv_nsec - c->start.tv_nsec) / 1e9;
+    fprintf(stderr,"%s: received %s, %zu bytes in %.3f sec (%.0f MB/s)\n", c->peer,
+      c->name, c->bytes, secs, secs > 0 ? (c->bytes/(1024.0*1024))/secs : 0);
+  }
+  if (!ok) fprintf(stderr,"%s: dropped%s%s\n", c->peer, c->state == READ_DATA ? " " : "",
+                   c->state == READ_DATA ? c->name : "");
+  cfg.conns[c->fd] = NULL;
+  cfg.active--;
+  free(c);
+}
+
+/* accept every pending connection on the listening socket */
+void accept_clients() {
+  struct sockaddr_in in;
+  socklen_t sz = sizeof(in);
+  struct conn *c, **cs;
+  int fd, n;
+
+  while ( (fd = accept4(cfg.fd, (struct sockaddr*)&in, &sz, SOCK_NONBLOCK)) != -1) {
+    if (fd >= cfg.nconns) {
+      n = (fd + 1) * 2;
+      cs = realloc(cfg.conns, n * sizeof(*cs));
+      if (cs == NULL) { fprintf(stderr,"out of memory\n"); close(fd); continue; }
+      memset(&cs[cfg.nconns], 0, (n - cfg.nconns) * sizeof(*cs));
+      cfg.conns = cs;
+      cfg.nconns = n;
+    }
+    if ( (c = calloc(1, sizeof(*c))) == NULL) {
+      fprintf(stderr,"out of memory\n");
+      close(fd);
       continue;
     }
-    if (sizeof(cin)==cin_sz) {
-      if (verbose) printf("connection from %s:%d\n", 
-        inet_ntoa(cin.sin_addr), (int)ntohs(cin.sin_port));
-    }
-    /* first read the length prefixed filename */
-    if (read(fa,&namelen,sizeof(namelen)) != sizeof(namelen)) {
-      fprintf(stderr,"failed to read length\n");
-      exit(-1);
-    }
-    assert(namelen < 200);
-    if (read(fa,buf,namelen) != namelen) {
-      fprintf(stderr,"failed to read name\n");
-      exit(-1);
-    }
-    char *filename = buf;
-    filename[namelen]='\0';
-    base = basename(filename);
-    int fw = open(base, O_WRONLY|O_TRUNC|O_CREAT, 0644);
-    if (fw == -1) {
-      fprintf(stderr,"can't open %s: %s\n",filename,strerror(errno));
-      exit(-1);
-    }
-    if (verbose) fprintf(stderr,"writing %s\n",filename);
-    do {
-      rc = read(fa,buf,BUFSZ);
-      if (rc==-1) printf("read: %s\n", strerror(errno));
-      if (rc<=0) close(fw);
-      else {
-        //if (verbose) printf("received %d bytes: %.*s\n", rc, rc, buf);
-        if (write(fw,buf,rc) != rc) {
-          fprintf(stderr,"error writing to %s: %s\n", filename, strerror(errno));
-          exit(-1);
+    c->fd = fd;
+    c->fw = c->pd[0] = c->pd[1] = -1;
+    snprintf(c->peer, sizeof(c->peer), "%s:%d", inet_ntoa(in.sin_addr),
+      (int)ntohs(in.sin_port));
+    clock_gettime(CLOCK_MONOTONIC, &c->start);
+    cfg.conns[fd] = c;
+    cfg.active++;
+    if (cfg.verbose) fprintf(stderr,"connection from %s\n", c->peer);
+    if (add_epoll(EPOLLIN, fd) == -1) close_conn(c, 0);
+    sz = sizeof(in);
+  }
+  if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+    fprintf(stderr,"accept: %s\n", strerror(errno));
+}
+
+/* read toward want bytes of the header into p. -1 error, 0 more to come,
+ * 1 done, 2 closed between framed files */
+int read_hdr(struct conn *c, void *p, int want) {
+  int rc = read(c->fd, (char*)p + c->got, want - c->got);
+  if ((rc == 0) && (c->state == READ_FRAME) && (c->got == 0)) return 2; /* between files */
+  if (rc == 0) {
+    fprintf(stderr,"%s: closed before the name\n", c->peer);
+    return -1;
+  }
+  if (rc < 0) {
+    if ((errno == EAGAIN) || (errno == EINTR)) return 0;
+    fprintf(stderr,"%s: read: %s\n", c->peer, strerror(errno));
+    return -1;
+  }
+  c->got += rc;
+  if (c->got < want) return 0;
+  c->got = 0;
+  return 1;
+}
+
+/* do range r and those of x begun so far tile the file, in index order?
+ * a range must start where the one before it ends, and end where the one
+ * after it starts, so that once all are in there is no gap nor overlap */
+int range_fits(struct xfer *x, struct qcp_range *r) {
+  uint32_t i = r->index, j;
+
+  if ((i == 0) && (r->off != 0)) return 0;
+  if ((i == r->nranges - 1) && (r->off + r->len != r->size)) return 0;
+  if (x == NULL) return 1;
+  for(j=0; j < x->nranges; j++) {
+    if (!(x->begun & (1ULL << j))) continue;
+    if ((j < i) && ((x->end[j] > r->off) || ((j == i - 1) && (x->end[j] != r->off)))) return 0;
+    if ((j > i) && ((r->off + r->len > x->off[j]) ||
+                    ((j == i + 1) && (r->off + r->len != x->off[j])))) return 0;
+  }
+  return 1;
+}
+
+/* the transfer that range c->r belongs to, made on its first range */
+struct xfer *get_xfer(struct conn *c) {
+  struct qcp_range *r = &c->r;
+  struct xfer *x;
+
+  for(x = cfg.xfers; x; x = x->next) {
+    if ((x->id == r->id) && !strcmp(x->name, c->name)) break;
+  }
+  if ((x && ((x->size != r->size) || (x->nranges != r->nranges) ||
+             (x->begun & (1ULL << r->index)) || x->failed)) || !range_fits(x, r)) {
+    fprintf(stderr,"%s: range %u of %s does not fit its transfer\n", c->peer,
+      r->index, c->name);
+    if (x) { /* which can't now be whole */
+      x->refs++;
+      put_xfer(x, 0);
+    }
+    return NULL;
+  }
+  if (x == NULL) {
+    if ( (x = calloc(1, sizeof(*x))) == NULL) {
+      fprintf(stderr,"out of memory\n");
+      return NULL;
+    }
+    x->id = r->id;
+    x->size = r->size;
+    x->nranges = r->nranges;
+    strcpy(x->name, c->name);
+    snprintf(x->tmp, sizeof(x->tmp), ".%s.%016llx", c->name, (unsigned long long)r->id);
+    x->fd = open(x->tmp, O_WRONLY|O_CREAT|O_EXCL, 0644);
+    if (x->fd == -1) {
+      fprintf(stderr,"%s: can't open %s: %s\n", c->peer, x->tmp, strerror(errno));
+      free(x);
+      return NULL;
+    }
+    /* all the blocks now, so the ranges don't each extend the file */
+    if (x->size && (fallocate(x->fd, 0, 0, x->size) == -1) &&
+        (ftruncate(x->fd, x->size) == -1)) {
+      fprintf(stderr,"%s: can't size %s: %s\n", c->peer, x->tmp, strerror(errno));
+      close(x->fd);
+      unlink(x->tmp);
+      free(x);
+      return NULL;
+    }
+    x->next = cfg.xfers;
+    cfg.xfers = x;
+    if (cfg.verbose) fprintf(stderr,"%s: %lu bytes in %u ranges\n", x->name,
+                             (unsigned long)x->size, x->nranges);
+  }
+  x->begun |= 1ULL << r->index;
+  x->off[r->index] = r->off;
+  x->end[r->index] = r->off + r->len;
+  x->refs++;
+  x->last = now_secs();
+  return x;
+}
+
+/* the name is known: make the file, and the pipe to feed it */
+int open_file(struct conn *c) {
+  char *base;
+
+  c->name[c->namelen] = '\0';
+  base = basename(c->name);
+  if ((*base == '\0') || !strcmp(base, ".") || !strcmp(base, "..") || !strcmp(base, "/")) {
+    fprintf(stderr,"%s: bad name\n", c->peer);
+    if (!c->framed) return -1;
+    c->bad = 1;
+  }
+  memmove(c->name, base, strlen(base) + 1);
+  if (c->ranged) {
+    if ( (c->x = get_xfer(c)) == NULL) return -1;
+    c->off = c->r.off;
+  } else if (c->framed) {
+    snprintf(c->tmp, sizeof(c->tmp), ".%s.%d", c->name, c->fd);
+    if (!c->bad) c->fw = open(c->tmp, O_RDWR|O_TRUNC|O_CREAT, 0644); /* read to check */
+    if (!c->bad && (c->fw == -1)) {
+      fprintf(stderr,"%s: can't open %s: %s\n", c->peer, c->tmp, strerror(errno));
+      c->bad = 1;
+    }
+    if (c->bad) { /* the other files on the connection needn't suffer */
+      c->tmp[0] = '\0';
+      if ( (c->fw = open("/dev/null", O_WRONLY)) == -1) return -1;
+    }
+    c->left = c->f.size;
+    c->summed = 0;
+    c->sum = 1;
+    if (c->pd[0] != -1) return 0; /* the pipe of the last file */
+  } else { /* senders of the same name each have their own */
+    snprintf(c->tmp, sizeof(c->tmp), ".%s.%d", c->name, c->fd);
+    c->fw = open(c->tmp, O_WRONLY|O_TRUNC|O_CREAT, 0644);
+    if (c->fw == -1) {
+      fprintf(stderr,"%s: can't open %s: %s\n", c->peer, c->tmp, strerror(errno));
+      return -1;
+    }
+  }
+  if (pipe2(c->pd, O_NONBLOCK) == -1) {
+    fprintf(stderr,"pipe: %s\n", strerror(errno));
+    return -1;
+  }
+  fcntl(c->pd[1], F_SETPIPE_SZ, PIPE_SZ); /* best effort; else the default 64k */
+  if (cfg.verbose && c->x) fprintf(stderr,"%s: writing %s range %u\n", c->peer,
+                                   c->name, c->r.index);
+  else if (cfg.verbose && !c->framed) fprintf(stderr,"%s: writing %s\n", c->peer, c->name);
+  return 0;
+}
+
+/* add what has landed in the framed file since last time to its checksum,
+ * read back from the page cache. a file that can't be read is nacked */
+void sum_frame(struct conn *c) {
+  uint64_t upto = c->f.size - c->left, off = c->summed & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+  char *p;
+
+  if (c->bad || (upto == c->summed)) return;
+  p = mmap(NULL, upto - off, PROT_READ, MAP_SHARED, c->fw, off);
+  if (p == MAP_FAILED) {
+    fprintf(stderr,"%s: reading %s: %s\n", c->peer, c->tmp, strerror(errno));
+    c->bad = 1;
+    return;
+  }
+  c->sum = qcp_adler32(c->sum, (unsigned char*)p + (c->summed - off), upto - c->summed);
+  munmap(p, upto - off);
+  c->summed = upto;
+}
+
+/* a framed file is all in: check it, name it, and acknowledge it */
+int end_frame(struct conn *c) {
+  struct qcp_ack a = { c->f.seq, 0 };
+
+  if (close(c->fw) == -1) {
+    fprintf(stderr,"%s: close %s: %s\n", c->peer, c->tmp, strerror(errno));
+    a.status = -1;
+  }
+  c->fw = -1;
+  if (c->bad) a.status = -1;
+  if ((a.status == 0) && (c->sum != c->f.cksum)) {
+    fprintf(stderr,"%s: %s fails its checksum\n", c->peer, c->name);
+    a.status = -1;
+  }
+  if ((a.status == 0) && (rename(c->tmp, c->name) == -1)) {
+    fprintf(stderr,"%s: rename %s: %s\n", c->peer, c->name, strerror(errno));
+    a.status = -1;
+  }
+  if (a.status && c->tmp[0]) unlink(c->tmp);
+  else if (cfg.verbose) fprintf(stderr,"%s: received %s, %lu bytes\n", c->peer,
+                                c->name, (unsigned long)c->f.size);
+  c->nfiles++;
+  c->bad = 0;
+  c->state = READ_FRAME;
+  /* acks are few and small next to the socket buffer; a short write means
+   * the sender stopped reading them */
+  if (write(c->fd, &a, sizeof(a)) != sizeof(a)) {
+    fprintf(stderr,"%s: can't acknowledge %s\n", c->peer, c->name);
+    return -1;
+  }
+  return 0;
+}
+
+/* move what the socket has to the file. -1 error, 0 more to come, 1 done */
+int splice_data(struct conn *c) {
+  int fw = c->x ? c->x->fd : c->fw;
+  size_t want = PIPE_SZ;
+  uint64_t left = 0;
+  ssize_t n, m;
+  int i;
+
+  for(i=0; i < MAX_SPLICE; i++) {
+    if (c->framed) {
+      if (c->left == 0) return 1;
+      want = (c->left < PIPE_SZ) ? c->left : PIPE_SZ;
+    }
+    if (c->x) {
+      if (c->x->failed) return -1;  /* another range failed */
+      left = c->r.off + c->r.len - c->off;
+      want = left ? ((left < PIPE_SZ) ? left : PIPE_SZ) : 1;
+    }
+    n = splice(c->fd, NULL, c->pd[1], NULL, want, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+    if (n == 0) {  /* sender closed: the file, or the range, is complete */
+      if (c->framed) {
+        fprintf(stderr,"%s: closed in the middle of %s\n", c->peer, c->name);
+        return -1;
+      }
+      if (c->x && left) {
+        fprintf(stderr,"%s: range %u of %s short by %lu\n", c->peer, c->r.index,
+          c->name, (unsigned long)left);
+        return -1;
+      }
+      return 1;
+    }
+    if ((n > 0) && c->x && (left == 0)) {
+      fprintf(stderr,"%s: more than range %u of %s\n", c->peer, c->r.index, c->name);
+      return -1;
+    }
+    if (n < 0) {
+      if ((errno == EAGAIN) || (errno == EINTR)) return 0;
+      fprintf(stderr,"%s: splice: %s\n", c->peer, strerror(errno));
+      return -1;
+    }
+    /* the file side does not block on a pipe's worth */
+    if (c->framed) c->left -= n;
+    for(c->bytes += n; n; n -= m) {
+      m = splice(c->pd[0], NULL, fw, c->x ? &c->off : NULL, n, SPLICE_F_MOVE);
+      if (m < 0) {
+        if (errno == EINTR) { m = 0; continue; }
+        fprintf(stderr,"%s: writing %s: %s\n", c->peer, c->name, strerror(errno));
+        return -1;
+      }
+    }
+    if (c->framed) sum_frame(c);
+  }
+  return 0;
+}
+
+void handle_client(int fd) {
+  struct conn *c = (fd < cfg.nconns) ? cfg.conns[fd] : NULL;
+  int rc = 0;
+
+  if (c == NULL) return;
+  switch (c->state) {
+    case READ_LEN:
+      if ( (rc = read_hdr(c, &c->namelen, sizeof(c->namelen))) != 1) break;
+      if (c->namelen == QCP_RANGED) {
+        c->ranged = 1;
+        c->state = READ_RANGE;
+        goto range;
+      }
+      if (c->namelen == QCP_FRAMED) {
+        c->framed = 1;
+        c->state = READ_FRAME;
+        goto frame;
+      }
+      if ((c->namelen <= 0) || (c->namelen > NAME_MAX)) {
+        fprintf(stderr,"%s: bad name length %d\n", c->peer, c->namelen);
+        rc = -1;
+        break;
+      }
+      c->state = READ_NAME;
+      goto name;
+    case READ_RANGE:
+     range:
+      if ( (rc = read_hdr(c, &c->r, sizeof(c->r))) != 1) break;
+      if ((c->r.nranges < 1) || (c->r.nranges > QCP_MAX_RANGES) ||
+          (c->r.index >= c->r.nranges) || (c->r.off > c->r.size) ||
+          (c->r.len > c->r.size - c->r.off) ||
+          (c->r.namelen < 1) || (c->r.namelen > NAME_MAX)) {
+        fprintf(stderr,"%s: bad range header\n", c->peer);
+        rc = -1;
+        break;
+      }
+      c->namelen = c->r.namelen;
+      c->state = READ_NAME;
+      goto name;
+    case READ_FRAME:
+     frame:
+      if ( (rc = read_hdr(c, &c->f, sizeof(c->f))) != 1) break;
+      if ((c->f.namelen < 1) || (c->f.namelen > NAME_MAX)) {
+        fprintf(stderr,"%s: bad frame header\n", c->peer);
+        rc = -1;
+        break;
+      }
+      c->namelen = c->f.namelen;
+      c->state = READ_NAME;
+      /* fall through */
+    case READ_NAME:
+     name:
+      if ( (rc = read_hdr(c, c->name, c->namelen)) != 1) break;
+      if (open_file(c) < 0) { rc = -1; break; }
+      c->state = READ_DATA;
+      /* fall through */
+    case READ_DATA:
+      rc = splice_data(c);
+      if ((rc == 1) && c->framed) rc = end_frame(c); /* and on to the next */
+      break;
+  }
+  if (rc < 0) close_conn(c, 0);
+  else if ((rc == 2) || ((rc == 1) && (c->state == READ_DATA))) close_conn(c, 1);
+}
+
+int main(int argc, char *argv[]) {
+  int n, opt;
+  struct epoll_event ev[64];
+  struct signalfd_siginfo info;
+
+  cfg.prog = argv[0];
+  while ( (opt = getopt(argc, argv, "v+p:t:h")) != -1) {
+    switch (opt) {
+      case 'p': cfg.port = atoi(optarg); break;
+      case 'v': cfg.verbose++; break;
+      case 't': cfg.idle = atoi(optarg); break;
+      default: usage(); break;
+    }
+  }
+  if (cfg.idle <= 0) usage();
+
+  /* block all signals. we take signals synchronously via signalfd */
+  sigset_t all;
+  sigfillset(&all);
+  sigprocmask(SIG_SETMASK,&all,NULL);
+
+  /* a few signals we'll accept via our signalfd */
+  sigset_t sw;
+  sigemptyset(&sw);
+  for(n=0; n < sizeof(sigs)/sizeof(*sigs); n++) sigaddset(&sw, sigs[n]);
+
+  if (setup_listener()) goto done;
+
+  /* create the signalfd for receiving signals */
+  cfg.signal_fd = signalfd(-1, &sw, 0);
+  if (cfg.signal_fd == -1) {
+    fprintf(stderr,"signalfd: %s\n", strerror(errno));
+    goto done;
+  }
+
+  /* set up the epoll instance */
+  cfg.epoll_fd = epoll_create(1);
+  if (cfg.epoll_fd == -1) {
+    fprintf(stderr,"epoll: %s\n", strerror(errno));
+    goto done;
+  }
+
+  /* add descriptors of interest */
+  if (add_epoll(EPOLLIN, cfg.fd))        goto done; // listening socket
+  if (add_epoll(EPOLLIN, cfg.signal_fd)) goto done; // signal socket
+
+  /**********************************************************
+   * accept connections, and move data for each that's ready
+   *********************************************************/
+  while ( (n = epoll_wait(cfg.epoll_fd, ev, sizeof(ev)/sizeof(*ev),
+                         cfg.xfers ? 1000 : -1)) != -1) {
+    if (cfg.xfers) expire_xfers(); /* wake each second while any are open */
+    while (n--) {
+      if (ev[n].data.fd == cfg.signal_fd) {
+        if (read(cfg.signal_fd, &info, sizeof(info)) != sizeof(info)) {
+          fprintf(stderr,"failed to read signal fd buffer\n");
+          continue;
         }
+        fprintf(stderr,"got signal %d\n", info.ssi_signo);
+        goto done;
       }
-    } while (rc > 0);
-    close(fa);
+      if (ev[n].data.fd == cfg.fd) accept_clients();
+      else handle_client(ev[n].data.fd);
+    }
+  }
+  fprintf(stderr, "epoll_wait: %s\n", strerror(errno));
+
+ done:   /* transfers in progress are incomplete */
+  for(n=0; n < cfg.nconns; n++) if (cfg.conns[n]) close_conn(cfg.conns[n], 0);
+  while (cfg.xfers) { /* ranges yet to connect */
+    cfg.xfers->refs++;
+    put_xfer(cfg.xfers, 0);
   }
+  free(cfg.conns);
+  if (cfg.fd != -1) close(cfg.fd);
+  if (cfg.epoll_fd != -1) close(cfg.epoll_fd);
+  if (cfg.signal_fd != -1) close(cfg.signal_fd);
+  return 0;
 }
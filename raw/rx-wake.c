@@ -0,0 +1,584 @@
+/*
+ * Benchmark the ways this repo waits for packets
+ *
+ *   signal - O_ASYNC descriptor raising SIGRTMIN (F_SETSIG), taken with
+ *            sigtimedwait; as pcap/basic/signal_driven_capture.c
+ *   epoll  - epoll_wait on the descriptor; as pcap/epoll/pcap-epoll.c
+ *   busy   - spin on the ring slot status, no syscalls; as the ring pollers
+ *
+ * All three read the same TPACKET_V2 ring (see rx-ring2.c) so only the
+ * wakeup differs. A forked generator sends UDP datagrams over loopback at a
+ * fixed offered load, each stamped with CLOCK_MONOTONIC and a sequence
+ * number. The receiver takes the delivery latency of each datagram as the
+ * time it sees it in the ring minus its stamp, and counts the rest:
+ *
+ *  latency percentiles, receiver CPU time (getrusage), voluntary and
+ *  involuntary context switches, kernel ring drops (PACKET_STATISTICS)
+ *  and datagrams never seen.
+ *
+ * One CSV row per (model, load) goes to stdout or -o <file>.
+ *
+ *  sudo ./rx-wake -l 1000,10000,100000 -d 5 -o wake.csv
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAGIC 0x77616b65 /* "wake" */
+#define END_MARKS 10     /* end-of-run datagrams sent, in case some drop */
+
+/* the datagram payload */
+struct stamp {
+  uint32_t magic;
+  uint32_t seq;   /* or, in an end mark, the number sent */
+  uint64_t ns;    /* CLOCK_MONOTONIC at send; 0 marks the end */
+};
+
+struct ring {
+  uint8_t *map;
+  size_t map_len;
+  struct tpacket_req req; /* linux/if_packet.h */
+};
+
+enum model { signal_model, epoll_model, busy_model, num_models };
+char *model_names[] = {"signal", "epoll", "busy"};
+
+/* results of one run */
+struct run {
+  enum model model;
+  unsigned rate;
+  unsigned long sent;
+  unsigned long received;
+  unsigned long wakeups;
+  unsigned kernel_drops;
+  uint32_t *lat;      /* per-datagram latency, ns */
+  size_t lat_sz;
+  int done;
+};
+
+struct {
+  int verbose;
+  char *prog;
+  char *dev;
+  char *out;
+  FILE *outf;
+  char *loads;
+  char *models;
+  int duration;
+  uint16_t port;
+  int rx_fd;
+  int epoll_fd;
+  int sink_fd;
+  struct ring ring;
+  unsigned ring_block_sz;
+  unsigned ring_block_nr;
+  unsigned ring_frame_sz;
+  unsigned ring_curr_idx;
+  unsigned ring_frame_nr;
+} cfg = {
+  .dev = "lo",
+  .loads = "1000,10000,100000",
+  .models = "signal,epoll,busy",
+  .duration = 5,
+  .port = 9999,
+  .rx_fd = -1,
+  .epoll_fd = -1,
+  .sink_fd = -1,
+  .ring_block_sz = 1 << 20,
+  .ring_block_nr = 16,
+  .ring_frame_sz = 1 << 11,
+};
+
+void usage() {
+  fprintf(stderr,"usage: %s [-v] [options]\n"
+       " options: \n"
+       " -i <eth>             -interface name (default lo)\n"
+       " -l <pps,pps,...>     -offered loads in packets/sec\n"
+       " -m <model,...>       -models among signal,epoll,busy\n"
+       " -d <seconds>         -duration of each run\n"
+       " -p <port>            -udp port for generated traffic\n"
+       " -o <file.csv>        -report file (default stdout)\n"
+       " -B <num-blocks>      -packet ring num-blocks e.g. 16\n"
+       " -S <log2-block-size> -log2 packet ring block size (e.g. 20 = 1mb)\n"
+       " -F <frame-size>      -max frame (packet + header) size (e.g. 2048)\n"
+       "\n", cfg.prog);
+  exit(-1);
+}
+
+static inline uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int setup_rx(void) {
+  int rc=-1, ec;
+
+  cfg.ring_frame_nr = (cfg.ring_block_sz*cfg.ring_block_nr) / cfg.ring_frame_sz;
+  cfg.ring_curr_idx = 0;
+
+  /* want all link layer protocol packets (linux/if_ether.h) */
+  int protocol = htons(ETH_P_ALL);
+
+  cfg.rx_fd = socket(AF_PACKET, SOCK_RAW, protocol);
+  if (cfg.rx_fd == -1) {
+    fprintf(stderr,"socket: %s\n", strerror(errno));
+    goto done;
+  }
+
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, cfg.dev, sizeof(ifr.ifr_name)-1);
+  ec = ioctl(cfg.rx_fd, SIOCGIFINDEX, &ifr);
+  if (ec < 0) {
+    fprintf(stderr,"failed to find interface %s\n", cfg.dev);
+    goto done;
+  }
+
+  int v = TPACKET_V2;
+  ec = setsockopt(cfg.rx_fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v));
+  if (ec < 0) {
+    fprintf(stderr,"setsockopt PACKET_VERSION: %s\n", strerror(errno));
+    goto done;
+  }
+
+  memset(&cfg.ring.req, 0, sizeof(cfg.ring.req));
+  cfg.ring.req.tp_block_size = cfg.ring_block_sz;
+  cfg.ring.req.tp_frame_size = cfg.ring_frame_sz;
+  cfg.ring.req.tp_block_nr = cfg.ring_block_nr;
+  cfg.ring.req.tp_frame_nr = cfg.ring_frame_nr;
+  ec = setsockopt(cfg.rx_fd, SOL_PACKET, PACKET_RX_RING, &cfg.ring.req,
+                   sizeof(cfg.ring.req));
+  if (ec < 0) {
+    fprintf(stderr,"setsockopt PACKET_RX_RING: %s\n", strerror(errno));
+    goto done;
+  }
+
+  cfg.ring.map_len = cfg.ring.req.tp_block_size * cfg.ring.req.tp_block_nr;
+  cfg.ring.map = mmap(NULL, cfg.ring.map_len, PROT_READ|PROT_WRITE,
+                      MAP_SHARED|MAP_LOCKED, cfg.rx_fd, 0);
+  if (cfg.ring.map == MAP_FAILED) {
+    fprintf(stderr,"mmap: %s\n", strerror(errno));
+    cfg.ring.map = NULL;
+    goto done;
+  }
+
+  struct sockaddr_ll sl;
+  memset(&sl, 0, sizeof(sl));
+  sl.sll_family = AF_PACKET;
+  sl.sll_protocol = protocol;
+  sl.sll_ifindex = ifr.ifr_ifindex;
+  ec = bind(cfg.rx_fd, (struct sockaddr*)&sl, sizeof(sl));
+  if (ec < 0) {
+    fprintf(stderr,"bind: %s\n", strerror(errno));
+    goto done;
+  }
+
+  rc = 0;
+
+ done:
+  return rc;
+}
+
+void close_rx(void) {
+  if (cfg.ring.map) munmap(cfg.ring.map, cfg.ring.map_len);
+  cfg.ring.map = NULL;
+  if (cfg.rx_fd != -1) close(cfg.rx_fd);
+  cfg.rx_fd = -1;
+  if (cfg.epoll_fd != -1) close(cfg.epoll_fd);
+  cfg.epoll_fd = -1;
+}
+
+/* the wakeup model specific part of the setup */
+int setup_model(enum model m) {
+  struct epoll_event ev;
+  int fl;
+
+  switch(m) {
+    case signal_model:
+      /* request SIGRTMIN to our pid when the descriptor is ready */
+      fl = fcntl(cfg.rx_fd, F_GETFL);
+      fl |= O_ASYNC | O_NONBLOCK;
+      if (fcntl(cfg.rx_fd, F_SETFL, fl) < 0) goto err;
+      if (fcntl(cfg.rx_fd, F_SETSIG, SIGRTMIN) < 0) goto err;
+      if (fcntl(cfg.rx_fd, F_SETOWN, getpid()) < 0) goto err;
+      break;
+    case epoll_model:
+      cfg.epoll_fd = epoll_create(1);
+      if (cfg.epoll_fd == -1) goto err;
+      memset(&ev,0,sizeof(ev)); // placate valgrind
+      ev.events = EPOLLIN;
+      ev.data.fd = cfg.rx_fd;
+      if (epoll_ctl(cfg.epoll_fd, EPOLL_CTL_ADD, cfg.rx_fd, &ev) < 0) goto err;
+      break;
+    case busy_model:
+      break;
+    default:
+      return -1;
+  }
+  return 0;
+
+ err:
+  fprintf(stderr,"%s setup: %s\n", model_names[m], strerror(errno));
+  return -1;
+}
+
+/* generator: runs in a child process, sends rate datagrams/sec */
+void generate(unsigned rate) {
+  struct sockaddr_in sin;
+  struct timespec next;
+  struct stamp st;
+  uint64_t gap, total, seq;
+  int fd, i;
+
+  prctl(PR_SET_TIMERSLACK, 1UL); /* tighter clock_nanosleep wakeups */
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd == -1) {
+    fprintf(stderr,"socket: %s\n", strerror(errno));
+    _exit(-1);
+  }
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = htons(cfg.port);
+
+  gap = 1000000000ULL / rate;
+  total = (uint64_t)rate * cfg.duration;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  st.magic = MAGIC;
+
+  for(seq = 0; seq < total; seq++) {
+    /* sleep to the scheduled time; if already past it, send at once */
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    st.seq = seq;
+    st.ns = now_ns();
+    sendto(fd, &st, sizeof(st), 0, (struct sockaddr*)&sin, sizeof(sin));
+    next.tv_nsec += gap;
+    while (next.tv_nsec >= 1000000000) { next.tv_nsec -= 1000000000; next.tv_sec++; }
+  }
+
+  /* end marks carry the number sent */
+  st.seq = total;
+  st.ns = 0;
+  for(i=0; i < END_MARKS; i++) {
+    usleep(1000);
+    sendto(fd, &st, sizeof(st), 0, (struct sockaddr*)&sin, sizeof(sin));
+  }
+  close(fd);
+  _exit(0);
+}
+
+/* return our stamp if the frame is an incoming generator datagram */
+static struct stamp *get_stamp(uint8_t *cur, struct tpacket2_hdr *hdr) {
+  struct sockaddr_ll *sll;
+  uint8_t *f = cur + hdr->tp_mac;
+  uint16_t type, dport;
+  unsigned hl;
+
+  /* loopback shows each datagram twice; skip the outgoing copy */
+  sll = (struct sockaddr_ll*)(cur + TPACKET_ALIGN(sizeof(struct tpacket2_hdr)));
+  if (sll->sll_pkttype == PACKET_OUTGOING) return NULL;
+
+  if (hdr->tp_snaplen < 14 + 20 + 8 + sizeof(struct stamp)) return NULL;
+  memcpy(&type, f + 12, sizeof(type));
+  if (ntohs(type) != 0x0800) return NULL;
+  hl = (f[14] & 0x0f) * 4;
+  if (f[14 + 9] != 17) return NULL;
+  if (hdr->tp_snaplen < 14 + hl + 8 + sizeof(struct stamp)) return NULL;
+  memcpy(&dport, f + 14 + hl + 2, sizeof(dport));
+  if (ntohs(dport) != cfg.port) return NULL;
+  return (struct stamp*)(f + 14 + hl + 8);
+}
+
+/* plow through the ready packets in the ring */
+void handle_ring(struct run *r) {
+  struct tpacket2_hdr *hdr;
+  struct stamp st, *sp;
+  uint8_t *cur;
+  uint64_t t;
+
+  while (1) {
+    cur = cfg.ring.map + cfg.ring_curr_idx * cfg.ring_frame_sz;
+    hdr = (struct tpacket2_hdr *)cur;
+    if ((hdr->tp_status & TP_STATUS_USER) == 0) break;
+    __sync_synchronize(); /* read the frame only after its status */
+
+    if ( (sp = get_stamp(cur, hdr)) != NULL) {
+      t = now_ns();
+      memcpy(&st, sp, sizeof(st));
+      if (st.magic != MAGIC) goto next;
+      if (st.ns == 0) {
+        r->sent = st.seq;
+        r->done = 1;
+        goto next;
+      }
+      if (r->received < r->lat_sz) r->lat[r->received] = (t > st.ns) ? (t - st.ns) : 0;
+      r->received++;
+    }
+
+   next:
+    /* return the packet by assigning status word TP_STATUS_KERNEL (0) */
+    hdr->tp_status = TP_STATUS_KERNEL;
+    cfg.ring_curr_idx = (cfg.ring_curr_idx + 1) % cfg.ring_frame_nr;
+  }
+}
+
+/* receive until the generator's end mark, or a timeout past its end */
+int receive(struct run *r, uint64_t deadline) {
+  struct epoll_event ev;
+  struct timespec ts = {0, 100*1000*1000}; /* 100ms wait granularity */
+  siginfo_t info;
+  sigset_t ss;
+  int n, spins = 0;
+
+  sigemptyset(&ss);
+  sigaddset(&ss, SIGRTMIN);
+  sigaddset(&ss, SIGIO); /* sent if the RT signal queue overflows */
+
+  while (!r->done) {
+    switch(r->model) {
+      case signal_model:
+        n = sigtimedwait(&ss, &info, &ts);
+        if ((n == -1) && (errno != EAGAIN) && (errno != EINTR)) {
+          fprintf(stderr,"sigtimedwait: %s\n", strerror(errno));
+          return -1;
+        }
+        if (n > 0) r->wakeups++;
+        handle_ring(r);
+        break;
+      case epoll_model:
+        n = epoll_wait(cfg.epoll_fd, &ev, 1, 100);
+        if ((n == -1) && (errno != EINTR)) {
+          fprintf(stderr,"epoll_wait: %s\n", strerror(errno));
+          return -1;
+        }
+        if (n > 0) r->wakeups++;
+        handle_ring(r);
+        break;
+      case busy_model:
+        handle_ring(r);
+        if (++spins % 1024) continue; /* check the clock now and then */
+        break;
+      default:
+        return -1;
+    }
+    if (now_ns() > deadline) {
+      fprintf(stderr,"%s %u pps: no end mark from generator\n",
+        model_names[r->model], r->rate);
+      break;
+    }
+  }
+  return 0;
+}
+
+static int lat_sort(const void *_a, const void *_b) {
+  uint32_t a = *(uint32_t*)_a, b = *(uint32_t*)_b;
+  return (a < b) ? -1 : (a > b);
+}
+
+double pct(struct run *r, size_t n, double p) {
+  if (n == 0) return 0;
+  size_t i = (size_t)(p * (n - 1) + 0.5);
+  return r->lat[i] / 1000.0;
+}
+
+double tv_sec(struct timeval *a, struct timeval *b) {
+  return (b->tv_sec - a->tv_sec) + (b->tv_usec - a->tv_usec) / 1e6;
+}
+
+void report_header(void) {
+  fprintf(cfg.outf, "model,offered_pps,duration_s,sent,received,lost,"
+    "kernel_drops,wakeups,lat_p50_us,lat_p90_us,lat_p99_us,lat_p999_us,"
+    "lat_max_us,cpu_user_s,cpu_sys_s,cpu_pct,vol_csw,invol_csw\n");
+}
+
+int run_one(enum model m, unsigned rate) {
+  struct rusage ru0, ru1;
+  struct tpacket_stats stats;
+  socklen_t len = sizeof(stats);
+  uint64_t t0, t1;
+  struct run r;
+  siginfo_t info;
+  struct timespec zero = {0, 0};
+  sigset_t ss;
+  pid_t pid = -1;
+  int rc = -1, status;
+  size_t n;
+
+  memset(&r, 0, sizeof(r));
+  r.model = m;
+  r.rate = rate;
+  r.lat_sz = (size_t)rate * cfg.duration;
+  r.lat = malloc(r.lat_sz * sizeof(uint32_t));
+  if (r.lat == NULL) {
+    fprintf(stderr,"out of memory\n");
+    goto done;
+  }
+
+  if (setup_rx() < 0) goto done;
+  if (setup_model(m) < 0) goto done;
+
+  /* discard stale signals queued by an earlier run's socket */
+  sigemptyset(&ss);
+  sigaddset(&ss, SIGRTMIN);
+  sigaddset(&ss, SIGIO);
+  while (sigtimedwait(&ss, &info, &zero) > 0) ;
+  handle_ring(&r);
+  r.received = 0;
+
+  getrusage(RUSAGE_SELF, &ru0);
+  t0 = now_ns();
+  if ( (pid = fork()) == -1) {
+    fprintf(stderr,"fork: %s\n", strerror(errno));
+    goto done;
+  }
+  if (pid == 0) generate(rate);
+
+  if (receive(&r, t0 + (cfg.duration + 2) * 1000000000ULL) < 0) goto done;
+  t1 = now_ns();
+  getrusage(RUSAGE_SELF, &ru1);
+
+  if (getsockopt(cfg.rx_fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) < 0) {
+    fprintf(stderr,"getsockopt PACKET_STATISTICS: %s\n", strerror(errno));
+    goto done;
+  }
+  r.kernel_drops = stats.tp_drops;
+  if (r.sent == 0) r.sent = r.lat_sz; /* end mark lost; assume all went */
+
+  n = (r.received < r.lat_sz) ? r.received : r.lat_sz;
+  qsort(r.lat, n, sizeof(uint32_t), lat_sort);
+  double cpu_u = tv_sec(&ru0.ru_utime, &ru1.ru_utime);
+  double cpu_s = tv_sec(&ru0.ru_stime, &ru1.ru_stime);
+  double wall = (t1 - t0) / 1e9;
+
+  fprintf(cfg.outf, "%s,%u,%d,%lu,%lu,%ld,%u,%lu,%.1f,%.1f,%.1f,%.1f,%.1f,"
+    "%.3f,%.3f,%.1f,%ld,%ld\n", model_names[m], rate, cfg.duration, r.sent,
+    r.received, (long)r.sent - (long)r.received, r.kernel_drops, r.wakeups,
+    pct(&r, n, 0.50), pct(&r, n, 0.90), pct(&r, n, 0.99), pct(&r, n, 0.999),
+    n ? r.lat[n-1] / 1000.0 : 0, cpu_u, cpu_s, 100 * (cpu_u + cpu_s) / wall,
+    ru1.ru_nvcsw - ru0.ru_nvcsw, ru1.ru_nivcsw - ru0.ru_nivcsw);
+  fflush(cfg.outf);
+  if (cfg.verbose) fprintf(stderr,"%s %u pps: %lu/%lu received\n",
+    model_names[m], rate, r.received, r.sent);
+  rc = 0;
+
+ done:
+  if (pid > 0) {
+    if (rc < 0) kill(pid, SIGTERM);
+    waitpid(pid, &status, 0);
+  }
+  close_rx();
+  free(r.lat);
+  return rc;
+}
+
+/* a bound udp socket so the generator's datagrams have somewhere to go */
+int setup_sink(void) {
+  struct sockaddr_in sin;
+  int sz = 4096;
+
+  cfg.sink_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (cfg.sink_fd == -1) {
+    fprintf(stderr,"socket: %s\n", strerror(errno));
+    return -1;
+  }
+  setsockopt(cfg.sink_fd, SOL_SOCKET, SO_RCVBUF, &sz, sizeof(sz));
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sin.sin_port = htons(cfg.port);
+  if (bind(cfg.sink_fd, (struct sockaddr*)&sin, sizeof(sin)) == -1) {
+    fprintf(stderr,"bind: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  char *models, *loads, *mp, *lp, *m, *l;
+  int opt, i, rc = -1;
+  unsigned rate;
+  sigset_t ss;
+
+  cfg.prog = argv[0];
+  cfg.outf = stdout;
+
+  while ( (opt=getopt(argc,argv,"vi:l:m:d:p:o:B:S:F:h")) != -1) {
+    switch(opt) {
+      case 'v': cfg.verbose++; break;
+      case 'i': cfg.dev=strdup(optarg); break;
+      case 'l': cfg.loads=strdup(optarg); break;
+      case 'm': cfg.models=strdup(optarg); break;
+      case 'd': cfg.duration=atoi(optarg); break;
+      case 'p': cfg.port=atoi(optarg); break;
+      case 'o': cfg.out=strdup(optarg); break;
+      case 'B': cfg.ring_block_nr=atoi(optarg); break;
+      case 'S': cfg.ring_block_sz = 1 << (unsigned)atoi(optarg); break;
+      case 'F': cfg.ring_frame_sz=atoi(optarg); break;
+      case 'h': default: usage(); break;
+    }
+  }
+  if (cfg.duration < 1) usage();
+  if (cfg.ring_block_sz % cfg.ring_frame_sz) {
+    fprintf(stderr,"-S block_sz must be multiple of -F frame_sz\n");
+    goto done;
+  }
+
+  if (cfg.out && ((cfg.outf = fopen(cfg.out, "w")) == NULL)) {
+    fprintf(stderr,"can't open %s: %s\n", cfg.out, strerror(errno));
+    goto done;
+  }
+
+  /* readiness signals are taken synchronously with sigtimedwait */
+  sigemptyset(&ss);
+  sigaddset(&ss, SIGRTMIN);
+  sigaddset(&ss, SIGIO);
+  sigprocmask(SIG_BLOCK, &ss, NULL);
+
+  if (setup_sink() < 0) goto done;
+  report_header();
+
+  models = strdup(cfg.models);
+  for(m = strtok_r(models, ",", &mp); m; m = strtok_r(NULL, ",", &mp)) {
+    for(i=0; i < num_models; i++) if (!strcmp(m, model_names[i])) break;
+    if (i == num_models) {
+      fprintf(stderr,"unknown model %s\n", m);
+      usage();
+    }
+    loads = strdup(cfg.loads);
+    for(l = strtok_r(loads, ",", &lp); l; l = strtok_r(NULL, ",", &lp)) {
+      if ( (rate = atoi(l)) == 0) usage();
+      if (run_one(i, rate) < 0) goto done;
+    }
+    free(loads);
+  }
+  free(models);
+  rc = 0;
+
+ done:
+  if (cfg.sink_fd != -1) close(cfg.sink_fd);
+  if (cfg.outf && (cfg.outf != stdout)) fclose(cfg.outf);
+  return rc;
+}